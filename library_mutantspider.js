@@ -30,6 +30,119 @@ mergeInto( LibraryManager.library, {
   ms_rez_mount: function(pathAddr, root_addr) {
       FS.mount(REZFS, {root_addr: root_addr}, Pointer_stringify(pathAddr));
   },
+  // REZFS only reads rez_dir's as it needs them, so when a resource pack is
+  // mounted it is enough to point /resources at the new root directory
+  ms_rez_set_root_js__sig: 'vi',
+  ms_rez_set_root_js__deps: ['$FS', '$REZFS'],
+  ms_rez_set_root_js: function(root_addr) {
+    FS.lookupPath('/resources').node.contents = root_addr;
+  },
+  // read 'size' bytes, starting at 'offset', of the resource pack at 'urlAddr'
+  // into the heap at 'dst'.  This is synchronous, so only possible in node,
+  // where the pack is just a local file
+  ms_rez_fetch_js__sig: 'iiiii',
+  ms_rez_fetch_js: function(urlAddr, offset, size, dst) {
+    var url = Pointer_stringify(urlAddr);
+    if (!ENVIRONMENT_IS_NODE)
+      return 0;
+    try {
+      var fs = require('fs');
+      var fd = fs.openSync(url.replace(/^file:\/\//, ''), 'r');
+      var done = 0;
+      while (done < size) {
+        var n = fs.readSync(fd, Buffer.from(HEAPU8.buffer, dst + done, size - done), 0, size - done, offset + done);
+        if (n <= 0)
+          break;
+        done += n;
+      }
+      fs.closeSync(fd);
+      return done == size ? 1 : 0;
+    } catch (e) {
+      Module.printErr('fetching ' + url + ' failed: ' + e);
+      return 0;
+    }
+  },
+  ms_rez_fetch_sync_js__sig: 'i',
+  ms_rez_fetch_sync_js: function() {
+    return ENVIRONMENT_IS_NODE ? 1 : 0;
+  },
+  // the resource pack downloads, by url.  'ranges' is whether the server
+  // honors the Range header, once the first response says.  Until then the
+  // other requests wait in 'waiting'.  A server that doesn't sends the whole
+  // pack, which is kept in 'whole' and used for every later request
+  $MS_REZ: {
+    packs: {},
+    fetch: function(url, offset, size, dst, okAddr, cb) {
+      var done = function(ok) {
+        HEAP32[okAddr >> 2] = ok ? 1 : 0;
+        Module.ccall('MS_Callback', 'null', ['number'], [cb]);
+      };
+      var copy = function(buf, skip) {
+        if (buf.byteLength < skip + size)
+          return false;
+        HEAPU8.set(new Uint8Array(buf, skip, size), dst);
+        return true;
+      };
+      var pack = MS_REZ.packs[url] || (MS_REZ.packs[url] = {ranges: undefined, whole: null, waiting: null});
+      if (pack.whole) {
+        setTimeout(function() { done(copy(pack.whole, offset)); }, 0);
+        return;
+      }
+      if (pack.ranges === undefined) {
+        if (pack.waiting) {
+          pack.waiting.push([url, offset, size, dst, okAddr, cb]);
+          return;
+        }
+        pack.waiting = [];
+      }
+      var finish = function(ok) {
+        done(ok);
+        var waiting = pack.waiting;
+        pack.waiting = null;
+        if (waiting)
+          waiting.forEach(function(args) { MS_REZ.fetch.apply(null, args); });
+      };
+      var xhr = new XMLHttpRequest();
+      xhr.open('GET', url, true);
+      xhr.responseType = 'arraybuffer';
+      xhr.setRequestHeader('Range', 'bytes=' + offset + '-' + (offset + size - 1));
+      xhr.onload = function() {
+        // 206 means the server honored the Range header, 200 (or 0, for
+        // file://) that we got the whole file
+        if (xhr.status == 206) {
+          pack.ranges = true;
+          finish(copy(xhr.response, 0));
+        } else if (xhr.status == 200 || xhr.status == 0) {
+          pack.ranges = false;
+          pack.whole = xhr.response;
+          finish(copy(pack.whole, offset));
+        } else {
+          Module.printErr('fetching ' + url + ' failed with http status: ' + xhr.status);
+          finish(false);
+        }
+      };
+      xhr.onerror = function() {
+        Module.printErr('fetching ' + url + ' failed');
+        finish(false);
+      };
+      xhr.send(null);
+    }
+  },
+  // the same thing, without blocking.  Sets the int at 'okAddr' to 1 if it
+  // worked, and then passes 'cb' (an ms_callback_base*) to MS_Callback
+  ms_rez_fetch_async_js__sig: 'viiiiii',
+  ms_rez_fetch_async_js__deps: ['$MS_REZ', 'ms_rez_fetch_js'],
+  ms_rez_fetch_async_js: function(urlAddr, offset, size, dst, okAddr, cb) {
+    if (ENVIRONMENT_IS_NODE) {
+      var ok = _ms_rez_fetch_js(urlAddr, offset, size, dst);
+      setTimeout(function() {
+        HEAP32[okAddr >> 2] = ok;
+        Module.ccall('MS_Callback', 'null', ['number'], [cb]);
+      }, 0);
+      return;
+    }
+    MS_REZ.fetch(Pointer_stringify(urlAddr), offset, size, dst, okAddr, cb);
+  },
   ms_syncfs_from_persistent__sig: 'v',
   ms_syncfs_from_persistent__deps: ['$FS'],
   ms_syncfs_from_persistent: function() {
@@ -50,6 +163,127 @@ mergeInto( LibraryManager.library, {
   ms_timed_callback_js__sig: 'vii',
   ms_timed_callback_js: function(milliseconds, proc) {
     setTimeout(function(){Module.ccall('MS_Callback', 'null', ['number'], [proc]);}, milliseconds);
+  },
+  
+  // per-op counters for the file system code (see mutantspider::fs_stats).
+  // wrap() returns 'fn' unchanged unless ms_fs_stats_enable_js has been
+  // called, so nothing is counted in builds made with -DMS_NO_FS_STATS
+  $MSSTATS: {
+    enabled: false,
+    buckets: 16,    // mutantspider::fs_latency_buckets
+    names: [],
+    ops: {},
+    
+    wrap: function(name, fn, counts_bytes) {
+      if (!MSSTATS.enabled || !fn)
+        return fn;
+      var op = MSSTATS.ops[name];
+      if (!op) {
+        op = {calls: 0, errors: 0, bytes: 0, ns_total: 0, ns_max: 0, latency: []};
+        for (var b = 0; b < MSSTATS.buckets; b++)
+          op.latency.push(0);
+        MSSTATS.ops[name] = op;
+        MSSTATS.names.push(name);
+      }
+      return function() {
+        var start = MSSTATS.now();
+        var failed = true;
+        try {
+          var ret = fn.apply(this, arguments);
+          failed = false;
+          if (counts_bytes && ret > 0)
+            op.bytes += ret;
+          return ret;
+        } finally {
+          MSSTATS.count(op, MSSTATS.now() - start, failed);
+        }
+      };
+    },
+    
+    // milliseconds, with as much precision as the browser gives us
+    now: function() {
+      return (typeof performance !== 'undefined' && performance.now) ? performance.now() : Date.now();
+    },
+    
+    count: function(op, ms, failed) {
+      var ns = Math.round(ms * 1000000);
+      op.calls++;
+      if (failed)
+        op.errors++;
+      op.ns_total += ns;
+      op.ns_max = Math.max(op.ns_max, ns);
+      var b = 0;
+      for (var us = Math.floor(ns / 1000); us >= 1 && b < MSSTATS.buckets - 1; us = Math.floor(us / 2))
+        ++b;
+      op.latency[b]++;
+    }
+  },
+  ms_fs_stats_enable_js__sig: 'v',
+  ms_fs_stats_enable_js__deps: ['$FS', '$MSSTATS'],
+  ms_fs_stats_enable_js: function() {
+    MSSTATS.enabled = true;
+    var dev = FS.makedev(64, 0);
+    FS.registerDevice(dev, {
+      open: function(stream) {
+        stream.ms_text = intArrayFromString(Pointer_stringify(Module.ccall('MS_FsStatsText', 'number', [], [])), true);
+      },
+      read: function(stream, buffer, offset, length, pos) {
+        var size = Math.max(0, Math.min(length, stream.ms_text.length - pos));
+        for (var i = 0; i < size; i++)
+          buffer[offset + i] = stream.ms_text[pos + i];
+        return size;
+      }
+    });
+    FS.mkdir('/.ms');
+    FS.mkdev('/.ms/stats', 292/*0444*/, dev);
+  },
+  ms_fs_stats_js__sig: 'iiiii',
+  ms_fs_stats_js__deps: ['$MSSTATS', '$PBMEMFS'],
+  ms_fs_stats_js: function(vals, max_ops, names, names_size) {
+    var q = PBMEMFS.queue_stats(MSSTATS.now());
+    var v = vals >> 3;
+    HEAPF64[v++] = q.tasks_queued;
+    HEAPF64[v++] = q.depth;
+    HEAPF64[v++] = q.peak_depth;
+    HEAPF64[v++] = Math.round(q.lag_ms * 1000000);
+    HEAPF64[v++] = q.commits;
+    HEAPF64[v++] = q.commit_entries;
+    HEAPF64[v++] = q.commit_bytes;
+    HEAPF64[v++] = Math.round(q.commit_ms_total * 1000000);
+    HEAPF64[v++] = Math.round(q.commit_ms_max * 1000000);
+    
+    var num_ops = 0;
+    var names_end = names + names_size;
+    for (var i = 0; i < MSSTATS.names.length && num_ops < max_ops; i++) {
+      var name = MSSTATS.names[i];
+      if (names + name.length + 1 > names_end)
+        break;
+      for (var p = 0; p < name.length; p++)
+        HEAP8[names++] = name.charCodeAt(p);
+      HEAP8[names++] = 0;
+      var op = MSSTATS.ops[name];
+      HEAPF64[v++] = op.calls;
+      HEAPF64[v++] = op.errors;
+      HEAPF64[v++] = op.bytes;
+      HEAPF64[v++] = op.ns_total;
+      HEAPF64[v++] = op.ns_max;
+      for (var b = 0; b < MSSTATS.buckets; b++)
+        HEAPF64[v++] = op.latency[b];
+      ++num_ops;
+    }
+    return num_ops;
+  },
+  ms_persist_flush_js__sig: 'vi',
+  ms_persist_flush_js__deps: ['$PBMEMFS'],
+  ms_persist_flush_js: function(proc) {
+    PBMEMFS.flush(function() {
+      setTimeout(function(){Module.ccall('MS_Callback', 'null', ['number'], [proc]);}, 0);
+    });
+  },
+  ms_persist_chunk_size_js__sig: 'vi',
+  ms_persist_chunk_size_js__deps: ['$PBMEMFS'],
+  ms_persist_chunk_size_js: function(bytes) {
+    PBMEMFS.chunk_size = bytes;
   }
 });
 
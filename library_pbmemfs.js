@@ -1,5 +1,5 @@
 mergeInto(LibraryManager.library, {
-  $PBMEMFS__deps: ['$IDBFS', '$FS', '$MEMFS'],
+  $PBMEMFS__deps: ['$IDBFS', '$FS', '$MEMFS', '$MSSTATS'],
   $PBMEMFS: {
   
     dir_node_ops: null,
@@ -11,6 +11,60 @@ mergeInto(LibraryManager.library, {
     orig_dir_setattr: null,
     orig_file_setattr: null,
     recording_changes: false,
+    
+    // every IndexedDB transaction we start is given a sequence number and
+    // stays in pending_ops until it completes (or fails).  flush_waiters
+    // are called once there is nothing left in pending_ops at or below
+    // the sequence number they were given.  The values in pending_ops are
+    // the times (MSSTATS.now()) the transactions were started
+    next_seq: 0,
+    pending_ops: {},
+    peak_depth: 0,
+    flush_waiters: [],
+    
+    // streams that have been written to but not yet closed, keyed by fd
+    dirty_streams: {},
+    
+    // changes that haven't been committed to IndexedDB yet, keyed by
+    // mountpoint and then path.  Each is {store: true to write the node as
+    // it is when the commit happens, false to delete it, created: true if
+    // the first change to the path since the last commit created it}.
+    // The first change after a commit starts a commit_delay_ms window, and
+    // everything changed in the window is committed in one transaction per
+    // mount (see note_change and commit)
+    changes: {},
+    changes_since: 0,
+    commit_timer: null,
+    commit_delay_ms: 50,
+    
+    // files larger than chunk_size (if it isn't 0, see set_persist_chunk_size)
+    // are stored in chunk_size pieces, in a second database for each mount
+    // (chunk_db_name) keyed by [path, chunk size, chunk index], so that a
+    // change only rewrites the chunks it touched.  The file's entry in the
+    // IDBFS database then has no contents, but has ms_chunk_size and ms_size
+    // set.  Having the chunk size in the key means chunks written at a new
+    // size never replace the ones an older entry still describes.  While a
+    // file node is stored that way its ms_stored_chunks is the number of
+    // chunks, ms_stored_chunk_size their size, and writes record the chunks
+    // they touch in ms_dirty_chunks ('all' once the chunks stored don't
+    // line up with chunk_size).  chunks_used is set once any file has been
+    // stored in chunks
+    chunk_size: 0,
+    chunks_used: false,
+    chunk_dbs: {},
+    
+    // the {mountpoint, changes, seq, start} of each commit_mount that hasn't
+    // been started yet, in the order they were made, and whether the one
+    // before them still has to finish first (see commit_mount)
+    commit_queue: [],
+    commit_busy: false,
+    
+    // for mutantspider::fs_stats, about the commits made so far
+    commits: 0,
+    commit_entries: 0,
+    commit_bytes: 0,
+    commit_ms_total: 0,
+    commit_ms_max: 0,
 
     mount: function(mount) {
       var node = IDBFS.mount.apply(null, arguments);
@@ -18,82 +72,491 @@ mergeInto(LibraryManager.library, {
         PBMEMFS.dir_node_ops = {};
         for (var p in node.node_ops)
           PBMEMFS.dir_node_ops[p] = node.node_ops[p];
-        PBMEMFS.dir_node_ops.mknod = PBMEMFS.mknod;
+        PBMEMFS.dir_node_ops.mknod = MSSTATS.wrap('pbmemfs_mknod', PBMEMFS.mknod);
         PBMEMFS.orig_unlink = node.node_ops.unlink;
-        PBMEMFS.dir_node_ops.unlink = PBMEMFS.unlink;
+        PBMEMFS.dir_node_ops.unlink = MSSTATS.wrap('pbmemfs_unlink', PBMEMFS.unlink);
         PBMEMFS.orig_rmdir = node.node_ops.rmdir;
-        PBMEMFS.dir_node_ops.rmdir = PBMEMFS.rmdir;
+        PBMEMFS.dir_node_ops.rmdir = MSSTATS.wrap('pbmemfs_rmdir', PBMEMFS.rmdir);
         PBMEMFS.orig_dir_setattr = node.node_ops.setattr;
-        PBMEMFS.dir_node_ops.setattr = PBMEMFS.dir_setattr;
+        PBMEMFS.dir_node_ops.setattr = MSSTATS.wrap('pbmemfs_setattr', PBMEMFS.dir_setattr);
+        PBMEMFS.dir_node_ops.lookup = MSSTATS.wrap('pbmemfs_lookup', node.node_ops.lookup);
+        PBMEMFS.dir_node_ops.readdir = MSSTATS.wrap('pbmemfs_readdir', node.node_ops.readdir);
       }
       node.node_ops = PBMEMFS.dir_node_ops;
       return node;
     },
 
+    // when populating, IDBFS creates the files that are stored in chunks
+    // empty, and we then read their chunks.  That also clears out any chunks
+    // no entry describes, so it is done whenever chunking is turned on
     syncfs: function(mount, populate, callback) {
+      var chunked = [];
+      var orig_store_local = IDBFS.storeLocalEntry;
+      if (populate) {
+        IDBFS.storeLocalEntry = function(path, entry, cb) {
+          if (entry.ms_chunk_size)
+            chunked.push({path: path, entry: entry});
+          orig_store_local(path, entry, cb);
+        };
+      }
       IDBFS.syncfs(mount, populate, function(err) {
-        if (!err)
-          PBMEMFS.recording_changes = true;
-        callback(err)
+        IDBFS.storeLocalEntry = orig_store_local;
+        if (err || !(chunked.length || PBMEMFS.chunk_size))
+          return PBMEMFS.syncfs_done(err, callback);
+        if (chunked.length)
+          PBMEMFS.chunks_used = true;
+        PBMEMFS.load_chunked(mount.mountpoint, chunked, function(err) {
+          PBMEMFS.syncfs_done(err, callback);
+        });
+      });
+    },
+    
+    syncfs_done: function(err, callback) {
+      if (!err)
+        PBMEMFS.recording_changes = true;
+      callback(err)
+    },
+    
+    chunk_db_name: function(mountpoint) {
+      return mountpoint + '#chunks';
+    },
+    
+    // like IDBFS.getDB, for the chunk database.  Callbacks are called in the
+    // order they were passed in, so transactions are started in that order
+    get_chunk_db: function(mountpoint, callback) {
+      var name = PBMEMFS.chunk_db_name(mountpoint);
+      var db = PBMEMFS.chunk_dbs[name];
+      if (db && db.waiting)
+        return db.waiting.push(callback);
+      if (db)
+        return callback(null, db);
+      var waiting = [callback];
+      PBMEMFS.chunk_dbs[name] = {waiting: waiting};
+      var done = function(err, db) {
+        if (err)
+          delete PBMEMFS.chunk_dbs[name];
+        else
+          PBMEMFS.chunk_dbs[name] = db;
+        for (var i = 0; i < waiting.length; i++)
+          waiting[i](err, db);
+      };
+      var req;
+      try {
+        req = IDBFS.indexedDB().open(name, 1);
+      } catch (e) {
+        return done(e);
+      }
+      req.onupgradeneeded = function(e) {
+        e.target.result.createObjectStore('chunks');
+      };
+      req.onsuccess = function() { done(null, req.result); };
+      req.onerror = function(e) {
+        done(this.error);
+        e.preventDefault();
+      };
+    },
+    
+    // the key ranges covering every chunk stored for 'path' except the first
+    // 'keep' of the ones stored with 'chunk_size' (so all of them when 'keep'
+    // is 0).  Keys compare element by element, and a shorter key is less than
+    // a longer one it starts, so [path, chunk_size] is just below
+    // [path, chunk_size, 0]
+    stale_chunk_ranges: function(path, chunk_size, keep) {
+      if (!keep)
+        return [IDBKeyRange.bound([path, 0], [path, Infinity])];
+      return [IDBKeyRange.bound([path, 0], [path, chunk_size]),
+              IDBKeyRange.bound([path, chunk_size, keep], [path, Infinity])];
+    },
+    
+    // read the chunks of each of the files in 'chunked' ({path, entry} from the
+    // IDBFS database) and write them to the (empty) files IDBFS created.  The
+    // chunks that none of those entries describe are left over from changes
+    // whose cleanup never ran (see commit_mount), and are deleted
+    load_chunked: function(mountpoint, chunked, callback) {
+      PBMEMFS.get_chunk_db(mountpoint, function(err, db) {
+        if (err)
+          return callback(err);
+        var files = {};
+        chunked.forEach(function(c) {
+          var size = c.entry.ms_size;
+          var chunk_size = c.entry.ms_chunk_size;
+          files[c.path] = {entry: c.entry, data: new Uint8Array(size), num_chunks: Math.ceil(size / chunk_size)};
+        });
+        var transaction = db.transaction(['chunks'], 'readwrite');
+        var store = transaction.objectStore('chunks');
+        store.openCursor().onsuccess = function(e) {
+          var cursor = e.target.result;
+          if (cursor) {
+            var f = files[cursor.key[0]];
+            if (f && cursor.key[1] === f.entry.ms_chunk_size && cursor.key[2] < f.num_chunks) {
+              var size = f.entry.ms_size;
+              var offset = cursor.key[2] * cursor.key[1];
+              f.data.set(cursor.value.subarray(0, Math.min(cursor.value.length, size - offset)), offset);
+            } else
+              cursor.delete();
+            cursor.continue();
+            return;
+          }
+          chunked.forEach(function(c) {
+            var f = files[c.path];
+            FS.writeFile(c.path, f.data, { encoding: 'binary', canOwn: true });
+            FS.utime(c.path, c.entry.timestamp, c.entry.timestamp);
+            var node = FS.lookupPath(c.path).node;
+            node.ms_stored_chunks = f.num_chunks;
+            node.ms_stored_chunk_size = c.entry.ms_chunk_size;
+            // stored with a different chunk size than the current one, so
+            // the next commit rewrites all of it (see commit_chunks)
+            node.ms_dirty_chunks = c.entry.ms_chunk_size === PBMEMFS.chunk_size ? null : 'all';
+          });
+        };
+        transaction.oncomplete = function() { callback(null); };
+        transaction.onerror = function(e) {
+          callback(this.error);
+          e.preventDefault();
+        };
       });
     },
 
-    create_or_delete_node: function(parent, path, create) {
-      IDBFS.getDB(parent.mount.mountpoint, function(err, db) {
-		
+    begin_op: function() {
+      var seq = ++PBMEMFS.next_seq;
+      PBMEMFS.pending_ops[seq] = MSSTATS.now();
+      var depth = 0;
+      for (var s in PBMEMFS.pending_ops)
+        ++depth;
+      PBMEMFS.peak_depth = Math.max(PBMEMFS.peak_depth, depth);
+      return seq;
+    },
+    
+    end_op: function(seq) {
+      delete PBMEMFS.pending_ops[seq];
+      var oldest = Infinity;
+      for (var s in PBMEMFS.pending_ops)
+        oldest = Math.min(oldest, +s);
+      // taken off the list before any are called, since a callback can
+      // start more transactions and add more waiters
+      var ready = [];
+      while (PBMEMFS.flush_waiters.length && PBMEMFS.flush_waiters[0].seq < oldest)
+        ready.push(PBMEMFS.flush_waiters.shift());
+      ready.forEach(function(waiter) { waiter.callback(); });
+    },
+    
+    // for mutantspider::fs_stats.  lag_ms is the age of the oldest change that
+    // hasn't been committed, either as a pending transaction or as a write to
+    // a stream that is still open
+    queue_stats: function(now) {
+      var st = {tasks_queued: PBMEMFS.next_seq, depth: 0, peak_depth: PBMEMFS.peak_depth, lag_ms: 0,
+                commits: PBMEMFS.commits, commit_entries: PBMEMFS.commit_entries, commit_bytes: PBMEMFS.commit_bytes,
+                commit_ms_total: PBMEMFS.commit_ms_total, commit_ms_max: PBMEMFS.commit_ms_max};
+      var oldest = now;
+      for (var s in PBMEMFS.pending_ops) {
+        ++st.depth;
+        oldest = Math.min(oldest, PBMEMFS.pending_ops[s]);
+      }
+      for (var fd in PBMEMFS.dirty_streams)
+        oldest = Math.min(oldest, PBMEMFS.dirty_streams[fd].dirty_since);
+      if (PBMEMFS.commit_timer !== null)
+        oldest = Math.min(oldest, PBMEMFS.changes_since);
+      st.lag_ms = now - oldest;
+      return st;
+    },
+    
+    // like db.transaction on 'store_name', logging errors.  'done' is called
+    // if the transaction completes, 'aborted' if it doesn't
+    begin_transaction: function(db, store_name, done, aborted) {
+      var transaction = db.transaction([store_name], 'readwrite');
+      transaction.onerror = function() { console.log('db.transaction([' + store_name + '], \'readwrite\') failed with err: ' + this.error); };
+      transaction.oncomplete = done;
+      transaction.onabort = aborted;
+      return transaction;
+    },
+    
+    // call 'callback' once every change made before this call has been committed
+    // to IndexedDB, including writes to streams that are still open
+    flush: function(callback) {
+      for (var fd in PBMEMFS.dirty_streams) {
+        var stream = PBMEMFS.dirty_streams[fd];
+        stream.is_dirty = false;
+        PBMEMFS.note_change(stream.node.mount.mountpoint, stream.path, true, false);
+      }
+      PBMEMFS.dirty_streams = {};
+      PBMEMFS.commit();
+      PBMEMFS.flush_waiters.push({seq: PBMEMFS.next_seq, callback: callback});
+      PBMEMFS.end_op(0);
+    },
+    
+    // record that 'path' needs to be stored (or deleted, if 'store' is false)
+    // in the next commit.  A path that is created and then deleted before the
+    // commit is dropped, since IndexedDB never saw it
+    note_change: function(mountpoint, path, store, created) {
+      var changes = PBMEMFS.changes[mountpoint];
+      if (!changes)
+        changes = PBMEMFS.changes[mountpoint] = {};
+      var prev = changes[path];
+      if (prev && prev.created && !store)
+        delete changes[path];
+      else
+        changes[path] = {store: store, created: prev ? prev.created : created};
+      if (PBMEMFS.commit_timer === null) {
+        PBMEMFS.changes_since = MSSTATS.now();
+        PBMEMFS.commit_timer = setTimeout(PBMEMFS.commit, PBMEMFS.commit_delay_ms);
+      }
+    },
+    
+    commit: function() {
+      if (PBMEMFS.commit_timer !== null) {
+        clearTimeout(PBMEMFS.commit_timer);
+        PBMEMFS.commit_timer = null;
+      }
+      var changes = PBMEMFS.changes;
+      PBMEMFS.changes = {};
+      for (var mountpoint in changes) {
+        for (var path in changes[mountpoint]) {
+          PBMEMFS.commit_mount(mountpoint, changes[mountpoint]);
+          break;
+        }
+      }
+    },
+    
+    // write everything in 'changes' to the IndexedDB database for 'mountpoint'
+    // in one transaction.  The nodes being stored are read when the commit
+    // starts, so they include any later changes too.  Commits start in the
+    // order they were made.  For files stored in chunks, the chunks that
+    // changed are written first, in a transaction on the chunk database, and
+    // the entries describing them only once that has completed.  Chunks that
+    // the old entries might still describe -- of deleted files, of files that
+    // shrank, or that were stored at a different chunk size -- are deleted
+    // only once the new entries have been committed, so the two databases
+    // agree whenever the page goes away.  A commit that deletes chunks holds
+    // back the next one until the deletes are started, so they can't remove
+    // chunks that a later commit writes for the same path
+    commit_mount: function(mountpoint, changes) {
+      var seq = PBMEMFS.begin_op();
+      PBMEMFS.commit_queue.push({mountpoint: mountpoint, changes: changes, seq: seq, start: PBMEMFS.pending_ops[seq]});
+      PBMEMFS.next_commit();
+    },
+    
+    next_commit: function() {
+      if (PBMEMFS.commit_busy || !PBMEMFS.commit_queue.length)
+        return;
+      var c = PBMEMFS.commit_queue.shift();
+      PBMEMFS.commit_busy = true;
+      if (PBMEMFS.chunk_size || PBMEMFS.chunks_used)
+        PBMEMFS.commit_chunks(c.mountpoint, c.changes, function(chunked, deletes) {
+          PBMEMFS.write_entries(c, chunked, deletes);
+        });
+      else
+        PBMEMFS.write_entries(c, {}, []);
+    },
+    
+    commit_done: function() {
+      PBMEMFS.commit_busy = false;
+      PBMEMFS.next_commit();
+    },
+    
+    // the IDBFS transaction for commit 'c' (see commit_mount).  'chunked' is
+    // what commit_chunks wrote, 'deletes' the chunk key ranges to delete once
+    // this transaction has completed
+    write_entries: function(c, chunked, deletes) {
+      IDBFS.getDB(c.mountpoint, function(err, db) {
+      
+        if (err) {
+          console.log('IDBFS.getDB(' + c.mountpoint + ') failed with err: ' + err);
+          PBMEMFS.end_op(c.seq);
+          PBMEMFS.commit_done();
+          return;
+        }
+        
+        var entries = 0;
+        var bytes = 0;
+        var transaction = PBMEMFS.begin_transaction(db, IDBFS.DB_STORE_NAME, function() {
+          var ms = MSSTATS.now() - c.start;
+          PBMEMFS.commits++;
+          PBMEMFS.commit_entries += entries;
+          PBMEMFS.commit_bytes += bytes;
+          PBMEMFS.commit_ms_total += ms;
+          PBMEMFS.commit_ms_max = Math.max(PBMEMFS.commit_ms_max, ms);
+          if (deletes.length)
+            PBMEMFS.delete_chunks(c, deletes);
+          else
+            PBMEMFS.end_op(c.seq);
+        }, function() {
+          // the old entries stand, and so must the chunks they describe
+          PBMEMFS.end_op(c.seq);
+          if (deletes.length)
+            PBMEMFS.commit_done();
+        });
+        var store = transaction.objectStore(IDBFS.DB_STORE_NAME);
+        for (var path in c.changes) {
+          if (chunked[path] === null)
+            continue;   // its chunks weren't written, see commit_chunks
+          ++entries;
+          if (c.changes[path].store)
+            bytes += PBMEMFS.store_entry(store, path, chunked[path]);
+          else
+            IDBFS.removeRemoteEntry(store, path, PBMEMFS.log_error('IDBFS.removeRemoteEntry', path));
+        }
+        if (!deletes.length)
+          PBMEMFS.commit_done();
+        
+      });
+    },
+    
+    // delete the chunks in 'deletes' once commit 'c' has been committed.  If
+    // this doesn't happen the chunks are deleted the next time the mount is
+    // loaded instead (see load_chunked)
+    delete_chunks: function(c, deletes) {
+      PBMEMFS.get_chunk_db(c.mountpoint, function(err, db) {
+        if (err) {
+          console.log('opening ' + PBMEMFS.chunk_db_name(c.mountpoint) + ' failed with err: ' + err);
+          PBMEMFS.end_op(c.seq);
+          PBMEMFS.commit_done();
+          return;
+        }
+        var end = function() { PBMEMFS.end_op(c.seq); };
+        var store = PBMEMFS.begin_transaction(db, 'chunks', end, end).objectStore('chunks');
+        deletes.forEach(function(range) { store.delete(range); });
+        PBMEMFS.commit_done();
+      });
+    },
+    
+    // returns the number of bytes of file contents stored.  'chunked', if the
+    // file is stored in chunks, is its {num_chunks, chunk_size, size} as of
+    // the chunks written for this commit
+    store_entry: function(store, path, chunked) {
+      var bytes = 0;
+      IDBFS.loadLocalEntry(path, function (err, entry) {
         if (err)
-          console.log('IDBFS.getDB(' + parent.mount.mountpoint + ') failed with err: ' + err);
+          console.log('IDBFS.loadLocalEntry(' + path + ') failed with err: ' + err);
         else {
-          var transaction = db.transaction([IDBFS.DB_STORE_NAME], 'readwrite');
-          transaction.onerror = function() { console.log('db.transaction([' + IDBFS.DB_STORE_NAME + '], \'readwrite\') failed with err: ' + this.error); };
-          var store = transaction.objectStore(IDBFS.DB_STORE_NAME);
-
-          if (create) {
-            IDBFS.loadLocalEntry(path, function (err, entry) {
-              if (err)
-                console.log('IDBFS.loadLocalEntry(' + path + ') failed with err: ' + err);
-              else
-                IDBFS.storeRemoteEntry(store, path, entry, function(err) {
-                  if (err)
-                    console.log('IDBFS.storeRemoteEntry(' + path + ') failed with err: ' + err);
-                });
-            });
-
-          } else {
-            IDBFS.removeRemoteEntry(store, path, function(err) {
-              if(err)
-                console.log('IDBFS.removeRemoteEntry(' + path + ') failed with err: ' + err);
-            });
+          if (chunked && chunked.num_chunks) {
+            entry = {timestamp: entry.timestamp, mode: entry.mode, contents: new Uint8Array(0),
+                     ms_chunk_size: chunked.chunk_size, ms_size: chunked.size};
+          } else
+            bytes = entry.contents ? entry.contents.length : 0;
+          IDBFS.storeRemoteEntry(store, path, entry, PBMEMFS.log_error('IDBFS.storeRemoteEntry', path));
+        }
+      });
+      return bytes;
+    },
+    
+    // for each file in 'changes' that is stored in chunks, write the chunks
+    // that have changed -- all of them if the file wasn't stored in chunks of
+    // this size before.  Then call 'callback' with an object that has, for
+    // each file, its {num_chunks, chunk_size, size}, and the key ranges of
+    // the chunks that are no longer needed: those of deleted files, those
+    // past the end of files that shrank, and those stored with a different
+    // chunk size.  If the chunks couldn't be written the object has null for
+    // every file, and there is nothing to delete.  Those files' entries then
+    // keep describing the chunks that are still stored, and all of their
+    // chunks are written again the next time they change
+    commit_chunks: function(mountpoint, changes, callback) {
+      var puts = [];
+      var deletes = [];
+      var chunked = {};
+      var files = [];
+      for (var path in changes) {
+        if (!changes[path].store) {
+          deletes = deletes.concat(PBMEMFS.stale_chunk_ranges(path, 0, 0));
+          continue;
+        }
+        var node;
+        try {
+          node = FS.lookupPath(path).node;
+        } catch (e) {
+          continue;
+        }
+        if (!FS.isFile(node.mode))
+          continue;
+        var data = MEMFS.getFileDataAsTypedArray(node);
+        var chunk_size = PBMEMFS.chunk_size;
+        var num_chunks = chunk_size && data.length > chunk_size ? Math.ceil(data.length / chunk_size) : 0;
+        var resized = node.ms_stored_chunks && node.ms_stored_chunk_size !== chunk_size;
+        if (num_chunks) {
+          var all = !node.ms_stored_chunks || resized || node.ms_dirty_chunks === 'all';
+          for (var i = 0; i < num_chunks; i++) {
+            if (all || (node.ms_dirty_chunks && node.ms_dirty_chunks[i]))
+              puts.push({key: [path, chunk_size, i], value: data.slice(i * chunk_size, (i + 1) * chunk_size)});
           }
+          // a file newly stored in chunks can still have some from an
+          // earlier file at the same path
+          if (!node.ms_stored_chunks || resized || node.ms_stored_chunks > num_chunks)
+            deletes = deletes.concat(PBMEMFS.stale_chunk_ranges(path, chunk_size, num_chunks));
+        } else if (node.ms_stored_chunks)
+          deletes = deletes.concat(PBMEMFS.stale_chunk_ranges(path, 0, 0));
+        files.push({path: path, node: node, stored_chunks: node.ms_stored_chunks, stored_chunk_size: node.ms_stored_chunk_size});
+        chunked[path] = {num_chunks: num_chunks, chunk_size: chunk_size, size: data.length};
+        node.ms_stored_chunks = num_chunks;
+        node.ms_stored_chunk_size = chunk_size;
+        node.ms_dirty_chunks = null;
+        if (num_chunks)
+          PBMEMFS.chunks_used = true;
+      }
+      if (!puts.length)
+        return callback(chunked, deletes);
+      
+      var failed = function() {
+        var skip = {};
+        files.forEach(function(f) {
+          f.node.ms_stored_chunks = f.stored_chunks;
+          f.node.ms_stored_chunk_size = f.stored_chunk_size;
+          f.node.ms_dirty_chunks = 'all';
+          skip[f.path] = null;
+        });
+        callback(skip, []);
+      };
+      
+      var seq = PBMEMFS.begin_op();
+      PBMEMFS.get_chunk_db(mountpoint, function(err, db) {
+        if (err) {
+          console.log('opening ' + PBMEMFS.chunk_db_name(mountpoint) + ' failed with err: ' + err);
+          PBMEMFS.end_op(seq);
+          return failed();
         }
-        
+        var transaction = PBMEMFS.begin_transaction(db, 'chunks', function() {
+          callback(chunked, deletes);
+          PBMEMFS.end_op(seq);
+        }, function() {
+          failed();
+          PBMEMFS.end_op(seq);
+        });
+        var store = transaction.objectStore('chunks');
+        puts.forEach(function(put) { store.put(put.value, put.key); });
       });
     },
+    
+    log_error: function(what, path) {
+      return function(err) {
+        if (err)
+          console.log(what + '(' + path + ') failed with err: ' + err);
+      };
+    },
 
     mknod: function(parent, name, mode, dev) {
       var node = MEMFS.createNode(parent, name, mode, dev);
       if (FS.isFile(node.mode)) {
         if (PBMEMFS.recording_changes)
-          PBMEMFS.create_or_delete_node(parent, FS.getPath(node), true);
+          PBMEMFS.note_change(parent.mount.mountpoint, FS.getPath(node), true, true);
         if (!PBMEMFS.file_stream_ops) {
           PBMEMFS.file_stream_ops = {};
           for (var p in node.stream_ops)
             PBMEMFS.file_stream_ops[p] = node.stream_ops[p];
-          PBMEMFS.file_stream_ops.close = PBMEMFS.close;
+          PBMEMFS.file_stream_ops.close = MSSTATS.wrap('pbmemfs_release', PBMEMFS.close);
           PBMEMFS.orig_write = node.stream_ops.write;
-          PBMEMFS.file_stream_ops.write = PBMEMFS.write;
+          PBMEMFS.file_stream_ops.write = MSSTATS.wrap('pbmemfs_write', PBMEMFS.write, true);
+          PBMEMFS.file_stream_ops.read = MSSTATS.wrap('pbmemfs_read', node.stream_ops.read, true);
           
           PBMEMFS.file_node_ops = {}
           for (var p in node.node_ops)
             PBMEMFS.file_node_ops[p] = node.node_ops[p];
           PBMEMFS.orig_file_setattr = node.node_ops.setattr;
-          PBMEMFS.file_node_ops.setattr = PBMEMFS.file_setattr;
+          PBMEMFS.file_node_ops.setattr = MSSTATS.wrap('pbmemfs_setattr', PBMEMFS.file_setattr);
+          PBMEMFS.file_node_ops.getattr = MSSTATS.wrap('pbmemfs_getattr', node.node_ops.getattr);
         }
         node.stream_ops = PBMEMFS.file_stream_ops;
         node.node_ops = PBMEMFS.file_node_ops;
       } else if (FS.isDir(node.mode)) {
         if (PBMEMFS.recording_changes)
-          PBMEMFS.create_or_delete_node(parent, FS.getPath(node), true);
+          PBMEMFS.note_change(parent.mount.mountpoint, FS.getPath(node), true, true);
         node.node_ops = PBMEMFS.dir_node_ops;
       }
       return node;
@@ -102,64 +565,56 @@ mergeInto(LibraryManager.library, {
     rmdir: function(parent, name) {
       var path = FS.getPath(FS.lookupNode(parent,name));
       PBMEMFS.orig_rmdir(parent,name);
-      PBMEMFS.create_or_delete_node(parent, path, false);
+      PBMEMFS.note_change(parent.mount.mountpoint, path, false, false);
     },
 
     unlink: function(parent, name) {
       var path = FS.getPath(FS.lookupNode(parent,name));
       PBMEMFS.orig_unlink(parent,name);
-      PBMEMFS.create_or_delete_node(parent, path, false);
+      PBMEMFS.note_change(parent.mount.mountpoint, path, false, false);
     },
     
     dir_setattr: function(node, attr) {
       PBMEMFS.orig_dir_setattr(node,attr);
       if (PBMEMFS.recording_changes)
-        PBMEMFS.write_file(FS.getPath(node), node.mount.mountpoint);
+        PBMEMFS.note_change(node.mount.mountpoint, FS.getPath(node), true, false);
     },
 
     file_setattr: function(node, attr) {
       PBMEMFS.orig_file_setattr(node,attr);
+      if (attr.size !== undefined)
+        node.ms_dirty_chunks = 'all';
       if (PBMEMFS.recording_changes)
-        PBMEMFS.write_file(FS.getPath(node), node.mount.mountpoint);
+        PBMEMFS.note_change(node.mount.mountpoint, FS.getPath(node), true, false);
     },
 
     write: function(stream, buffer, offset, length, position, canOwn) {
       var bytesWritten = PBMEMFS.orig_write(stream, buffer, offset, length, position, canOwn);
-      if (PBMEMFS.recording_changes && (bytesWritten > 0))
+      if (PBMEMFS.recording_changes && (bytesWritten > 0)) {
+        if (!stream.is_dirty)
+          stream.dirty_since = MSSTATS.now();
         stream.is_dirty = true;
+        PBMEMFS.dirty_streams[stream.fd] = stream;
+        var node = stream.node;
+        if (node.ms_stored_chunks && node.ms_stored_chunk_size !== PBMEMFS.chunk_size)
+          node.ms_dirty_chunks = 'all';
+        else if (node.ms_stored_chunks && node.ms_dirty_chunks !== 'all') {
+          if (!node.ms_dirty_chunks)
+            node.ms_dirty_chunks = {};
+          var last = Math.floor((position + bytesWritten - 1) / PBMEMFS.chunk_size);
+          for (var i = Math.floor(position / PBMEMFS.chunk_size); i <= last; i++)
+            node.ms_dirty_chunks[i] = true;
+        }
+      }
       return bytesWritten;
     },
     
-    write_file: function(path, mountpoint) {
-      IDBFS.getDB(mountpoint, function(err, db) {
-
-        if (err)
-          console.log('IDBFS.getDB(' + mountpoint + ') failed with err: ' + err);
-        else {
-          var transaction = db.transaction([IDBFS.DB_STORE_NAME], 'readwrite');
-          transaction.onerror = function() { console.log('db.transaction([' + IDBFS.DB_STORE_NAME + '], \'readwrite\') failed with error: ' + this.error); };
-          var store = transaction.objectStore(IDBFS.DB_STORE_NAME);
-		  
-          IDBFS.loadLocalEntry(path, function (err, entry) {
-            if (err)
-              console.log('IDBFS.loadLocalEntry(' + path + ') failed with err: ' + err);
-            else
-              IDBFS.storeRemoteEntry(store, path, entry, function(err) {
-                if (err)
-                  console.log('IDBFS.storeRemoteEntry(' + path + ') failed with err: ' + err);
-              });
-          });
-        }
-
-      });
-      
-    },
-	
     close: function(stream) {
+      delete PBMEMFS.dirty_streams[stream.fd];
       if (stream.is_dirty) {
         var lookup = FS.lookupPath(stream.path, { parent: true });
         var parent = lookup.node;
-        PBMEMFS.write_file(stream.path, parent.mount.mountpoint);
+        PBMEMFS.note_change(parent.mount.mountpoint, stream.path, true, false);
       }
     }
     
@@ -1,5 +1,5 @@
 mergeInto(LibraryManager.library, {
-  $REZFS__deps: ['$ERRNO_CODES', '$FS', '$MEMFS'],
+  $REZFS__deps: ['$ERRNO_CODES', '$FS', '$MEMFS', '$MSSTATS'],
   $REZFS: {
   
     ops_table: null,
@@ -9,9 +9,9 @@ mergeInto(LibraryManager.library, {
         REZFS.ops_table = {
           dir: {
             node: {
-              getattr: REZFS.node_ops.getattr,
-              lookup: MEMFS.node_ops.lookup,
-              readdir: REZFS.node_ops.readdir,
+              getattr: MSSTATS.wrap('rezfs_getattr', REZFS.node_ops.getattr),
+              lookup: MSSTATS.wrap('rezfs_lookup', REZFS.node_ops.lookup),
+              readdir: MSSTATS.wrap('rezfs_readdir', REZFS.node_ops.readdir),
               mknod: REZFS.node_ops.mknod,
             },
             stream: {
@@ -19,25 +19,38 @@ mergeInto(LibraryManager.library, {
           },
           file: {
             node: {
-              getattr: REZFS.node_ops.getattr,
+              getattr: MSSTATS.wrap('rezfs_getattr', REZFS.node_ops.getattr),
               setattr: REZFS.node_ops.setattr,
             },
             stream: {
+              open: REZFS.stream_ops.open,
               llseek: MEMFS.stream_ops.llseek,
-              read: REZFS.stream_ops.read,
+              read: MSSTATS.wrap('rezfs_read', REZFS.stream_ops.read, true),
+              mmap: REZFS.stream_ops.mmap,
             }
           },
         };
       }
       
-      var node = FS.createNode(null,'/',{{{ cDefine('S_IFDIR') }}} | 511 /* 0777 */, 0);
+      return REZFS.create_node(null, '/', mount.opts.root_addr, true);
+    },
     
-      node.node_ops = REZFS.ops_table.dir.node;
-      node.stream_ops = REZFS.ops_table.dir.stream; // currently empty (see dir.stream above), but FS needs a non-null stream_ops.
-      node.contents = ['.', '..'];
-      
-      REZFS.recursive_mount_dir(mount.opts.root_addr, node);
-      
+    // nodes are only created when lookup is first asked for them.  A directory
+    // node's contents is the address of its rez_dir, and a file node's is the
+    // address of its rez_file_ent (see mutantspider.h)
+    create_node: function(parent, name, ptr, is_dir) {
+      var node;
+      if (is_dir) {
+        node = FS.createNode(parent, name, {{{ cDefine('S_IFDIR') }}} | 365/*0555*/, 0);
+        node.node_ops = REZFS.ops_table.dir.node;
+        node.stream_ops = REZFS.ops_table.dir.stream; // currently empty (see dir.stream above), but FS needs a non-null stream_ops.
+      } else {
+        node = FS.createNode(parent, name, {{{ cDefine('S_IFREG') }}} | 292/*0444*/, 0);
+        node.node_ops = REZFS.ops_table.file.node;
+        node.stream_ops = REZFS.ops_table.file.stream;
+      }
+      node.contents = ptr;
+      node.is_readonly_fs = true;
       return node;
     },
     
@@ -64,8 +77,42 @@ mergeInto(LibraryManager.library, {
         attr.blocks = Math.ceil(attr.size / attr.blksize);
         return attr;
       },
+      // the entries of a rez_dir are sorted in strcmp order (see rez_tree.js),
+      // so this is a binary search, comparing the utf8 bytes of 'name' with
+      // the d_name's in the heap
+      lookup: function(parent, name) {
+        var bytes = intArrayFromString(name, true);
+        var dir_addr = parent.contents;
+        var ents_addr = {{{ makeGetValue('dir_addr', '4', 'i32') }}};
+        var lo = 0;
+        var hi = {{{ makeGetValue('dir_addr', '0', 'i32') }}};
+        while (lo < hi) {
+          var mid = (lo + hi) >>> 1;
+          var ent_addr = ents_addr + mid*12;
+          var d_name_addr = {{{ makeGetValue('ent_addr', '0', 'i32') }}};
+          var c = 0;
+          for (var i = 0; c == 0; i++) {
+            c = HEAPU8[d_name_addr + i] - (i < bytes.length ? bytes[i] : 0);
+            if (HEAPU8[d_name_addr + i] == 0)
+              break;
+          }
+          if (c == 0)
+            return REZFS.create_node(parent, name, {{{ makeGetValue('ent_addr', '4', 'i32') }}}, {{{ makeGetValue('ent_addr', '8', 'i32') }}} != 0);
+          if (c < 0)
+            lo = mid + 1;
+          else
+            hi = mid;
+        }
+        throw FS.genericErrors[ERRNO_CODES.ENOENT];
+      },
       readdir: function(node) {
-        return node.contents;
+        var dir_addr = node.contents;
+        var num_ents = {{{ makeGetValue('dir_addr', '0', 'i32') }}};
+        var ents_addr = {{{ makeGetValue('dir_addr', '4', 'i32') }}};
+        var entries = ['.', '..'];
+        for (var i = 0; i < num_ents; i++)
+          entries.push(Pointer_stringify({{{ makeGetValue('ents_addr', 'i*12', 'i32') }}}));
+        return entries;
       },
       setattr: function(node, attr) {
         throw new FS.ErrnoError(ERRNO_CODES.EROFS);
@@ -78,10 +125,24 @@ mergeInto(LibraryManager.library, {
     
     stream_ops: {
       
+      // a resource pack file whose contents haven't been fetched can only be
+      // opened when MS_RezOpen can fetch them right now (node), otherwise this
+      // fails with EWOULDBLOCK (see mutantspider::prefetch_rez)
+      open: function(stream) {
+        var contents = stream.node.contents;
+        if ({{{ makeGetValue('contents', '0', 'i32') }}} != 0)
+          return;
+        var err = Module.ccall('MS_RezOpen', 'number', ['number'], [contents]);
+        if (err != 0)
+          throw new FS.ErrnoError(err);
+      },
+      
       read: function(stream, buffer, offset, length, position) {
         var contents = stream.node.contents;
         var ptr = {{{ makeGetValue('contents', '0', 'i32') }}};
         var len = {{{ makeGetValue('contents', '4', 'i32') }}};
+        if (ptr == 0 || {{{ makeGetValue('contents', '8', 'i32') }}} != 0)
+          return REZFS.read_in_c(contents, buffer, offset, length, position);
         if (position >= len)
           return 0;
         var size = length;
@@ -98,44 +159,50 @@ mergeInto(LibraryManager.library, {
         }
         return size;
       },
+      
+      // read-only mappings of uncompressed files point straight at the embedded
+      // data in the heap.  Anything else gets a copy (the original is const).
+      // Resource pack files were fetched by open, so their data is there too
+      mmap: function(stream, buffer, offset, length, position, prot, flags) {
+        var contents = stream.node.contents;
+        var ptr = {{{ makeGetValue('contents', '0', 'i32') }}};
+        var compressed = {{{ makeGetValue('contents', '8', 'i32') }}} != 0;
+        if (!(prot & 2/*PROT_WRITE*/) && !compressed && ptr != 0)
+          return { ptr: ptr + position, allocated: false };
+        if ((prot & 2/*PROT_WRITE*/) && !(flags & {{{ cDefine('MAP_PRIVATE') }}}))
+          throw new FS.ErrnoError(ERRNO_CODES.EACCES);
+        var copy = _malloc(length);
+        if (!copy)
+          throw new FS.ErrnoError(ERRNO_CODES.ENOMEM);
+        var size = REZFS.stream_ops.read(stream, HEAP8, copy, length, position);
+        for (var i = size; i < length; i++)
+          HEAP8[copy + i] = 0;
+        return { ptr: copy, allocated: true };
+      },
     
     },
     
-    recursive_mount_dir: function (dir_addr, parent)  {
-      var num_ents = {{{ makeGetValue('dir_addr', '0', 'i32') }}};
-      var ents_addr = {{{ makeGetValue('dir_addr', '4', 'i32') }}};
-      
-      for (var i = 0; i < num_ents; i++) {
-        var d_name_addr = {{{ makeGetValue('ents_addr', 'i*12', 'i32') }}};
-        var d_name = Pointer_stringify(d_name_addr);
-        var ptr = {{{ makeGetValue('ents_addr', 'i*12+4', 'i32') }}};
-        var is_dir = {{{ makeGetValue('ents_addr', 'i*12+8', 'i32') }}};
-        
-        var mode;
-        if (is_dir != 0)
-          mode = {{{ cDefine('S_IFDIR') }}} | 511/*0777*/;
-        else
-          mode = {{{ cDefine('S_IFREG') }}} | 292/*0444*/;
-        var node = FS.createNode(parent, d_name, mode, 0);
-        if (is_dir != 0)
-        {
-          node.node_ops = REZFS.ops_table.dir.node;
-          node.stream_ops = REZFS.ops_table.dir.stream;
-          node.contents = ['.', '..'];
-          REZFS.recursive_mount_dir(ptr, node);
-        }
-        else
-        {
-          node.node_ops = REZFS.ops_table.file.node;
-          node.stream_ops = REZFS.ops_table.file.stream;
-          node.contents = ptr;
-        }
-        parent.contents.push(d_name);
-        
+    // compressed files (see rez_compress.js) are decompressed, and resource
+    // pack files fetched, by MS_RezRead in mutantspider_fs.cpp, which writes
+    // directly into the heap.  It returns a negative errno value on failure
+    // (EIO for a corrupt compressed block), which is thrown from here
+    read_in_c: function(file_addr, buffer, offset, length, position) {
+      var size;
+      if (buffer.buffer === HEAP8.buffer)
+        size = Module.ccall('MS_RezRead', 'number', ['number', 'number', 'number', 'number'], [file_addr, buffer.byteOffset + offset, length, position]);
+      else {
+        var tmp = _malloc(length);
+        if (!tmp)
+          throw new FS.ErrnoError(ERRNO_CODES.ENOMEM);
+        size = Module.ccall('MS_RezRead', 'number', ['number', 'number', 'number', 'number'], [file_addr, tmp, length, position]);
+        if (size > 0)
+          buffer.set(HEAP8.subarray(tmp, tmp + size), offset);
+        _free(tmp);
       }
-      MEMFS.node_ops.setattr(parent, {mode: {{{ cDefine('S_IFDIR') }}} | 365/*0555*/});
-      parent.is_readonly_fs = true;
-    }
+      if (size < 0)
+        throw new FS.ErrnoError(-size);
+      return size;
+    },
   
   }
 });
@@ -361,6 +361,107 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
       return str;
     }
     
+    // the id of the exported C function 'f', which javascript sends in place of
+    // its name.  All of the generated files come from the same config_file, so
+    // they all agree on these
+    function js_to_c_id(f) {
+      return exported_c_functions.indexOf(f);
+    }
+    
+    // is 'f', one of exported_js_functions, listed in the config file's
+    // batched_js_functions (using the same wildcard rule as the other lists)?
+    // Batched calls are collected and delivered to javascript together, every
+    // js_batch_interval_ms (default 16) milliseconds, so they can only have
+    // int, float, double and const char* parameters
+    function is_batched_js(f) {
+      let batched = (config.batched_js_functions || []).some((fn) => {
+        if (fn[fn.length-1] === '*')
+          return f.name.indexOf(fn.substring(0,fn.length-1)) === 0;
+        return f.name === fn;
+      });
+      do_assert(batched && has_mem_buff_param_to_js(f), 'batched function ' + f.name + ' can\'t have memory buffer parameters');
+      return batched;
+    }
+    
+    function has_batched_js() {
+      return exported_js_functions.some(is_batched_js);
+    }
+    
+    function js_batch_interval_ms() {
+      return config.js_batch_interval_ms === undefined ? 16 : config.js_batch_interval_ms;
+    }
+    
+    // a call to ms_c_to_js_batch_flush, at the start of the functions that
+    // aren't batched, if there are any batched ones
+    function write_c_batch_flush() {
+      if (has_batched_js())
+        console.log('  ms_c_to_js_batch_flush();');
+    }
+    
+    // in library_glue.js, the code that writes a call to 'f', the id'th of
+    // exported_js_functions, to MS_GLUE.out_ring if the ring transport is on,
+    // waiting for room if needed, and returns without posting anything.
+    // Memory buffers are copied straight from the heap (through the <name>_arr_
+    // views write_js_library makes) into the ring.  A call too big for the
+    // ring falls through to being posted, once its mark is in the ring and
+    // 'ms_ring_posted' has been posted ahead of it (see write_ring)
+    function write_js_ring_call(f, id) {
+      console.log('      var r_ = MS_GLUE.out_ring;');
+      console.log('      if (r_) {');
+      let bound = ['4'];
+      let writes = ['r_.i(' + id + ');'];
+      for (let p = 0, arg; arg = f.args[p]; p++) {
+        if (is_mem_buff_param_to_js(f.args, p)) {
+          bound.push('4 + ' + f.args[p+1].name);
+          writes.push('r_.b(' + arg.name + '_arr_);');
+          p += 1;
+        } else if (arg.type === 'const char*') {
+          console.log('        var ' + arg.name + '_str_ = Pointer_stringify(' + arg.name + ');');
+          bound.push('4 + ' + arg.name + '_str_.length * 3 + 1');
+          writes.push('r_.s(' + arg.name + '_str_);');
+        } else if (arg.type === 'int') {
+          bound.push('4');
+          writes.push('r_.i(' + arg.name + ');');
+        } else {
+          bound.push('8');
+          writes.push('r_.d(' + arg.name + ');');
+        }
+      }
+      console.log('        if (r_.wait(' + bound.join(' + ') + ')) {');
+      writes.forEach((w) => console.log('          ' + w));
+      console.log('          r_.commit();');
+      console.log('          return;');
+      console.log('        }');
+      console.log('        postMessage(\'ms_ring_posted\');');
+      console.log('      }');
+    }
+    
+    // and the same in library_glue.js, for workers
+    function write_js_batch_flush(indent) {
+      if (has_batched_js())
+        console.log(indent + 'MS_GLUE.flush();');
+    }
+    
+    // the reader methods (see write_batch_reader) that read the parameters of
+    // 'f', where each memory buffer (the group of parameters is_mem_buff(args, p)
+    // is true for, 'span' long) is read with b()
+    function batch_reads(f, is_mem_buff, span) {
+      let reads = [];
+      for (let p = 0; p < f.args.length; p++) {
+        if (is_mem_buff(f.args, p)) {
+          reads.push('r.b()');
+          p += span - 1;
+        } else
+          reads.push(batch_read(f.args[p].type));
+      }
+      return reads;
+    }
+    
+    // the batch reader method that reads a parameter of type 'type'
+    function batch_read(type) {
+      return type === 'int' ? 'r.i()' : (type === 'const char*' ? 'r.s()' : 'r.d()');
+    }
+    
     function write_c_snippet() {
       console.log('');
       console.log('// auto-generated from - do not edit');
@@ -388,28 +489,21 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
       console.log('}');
       console.log('');
       
-      // write the initDispatchMap function to load all of the
-      // above functions into map_
-      console.log('');
-      console.log('void msinstance::initDispatchMap()');
-      console.log('{');
-      
-      // each function in the map is a lambda that copies a parameter
-      // out of the "d.args" array and passes them to the C function
+      // for each C function, a function that copies its parameters out of
+      // the [id, arg0, arg1, ...] array sent by javascript and calls it
       exported_c_functions.forEach((f) => {
         let pi = 0;
-        console.log('  map_["' + f.name + '"] = [](const pp::VarDictionary& d)');
-        console.log('  {');
-        console.log('    pp::VarArray  args_(d.Get("args"));');
+        console.log('static void ms_js_to_c_' + f.name + '(const pp::VarArray& args_)');
+        console.log('{');
         for (let p = 0; p < f.args.length; p++) {
           let ppv_name = 'pv' + pi;
           if (is_mem_buff_param_to_c(f.args, p)) {
-            console.log('    auto ' + ppv_name + ' = new pp::VarArrayBuffer(args_.Get(' + pi + '));');
-            console.log('    auto p' + pi + ' = ' + ppv_name + '->Map();');
+            console.log('  auto ' + ppv_name + ' = new pp::VarArrayBuffer(args_.Get(' + (pi + 1) + '));');
+            console.log('  auto p' + pi + ' = ' + ppv_name + '->Map();');
             p += 2;
           } else {
-            console.log('    pp::Var ' + ppv_name + '(args_.Get(' + pi + '));');
-            let str =   '    auto p' + pi + ' = ' + ppv_name + '.';
+            console.log('  pp::Var ' + ppv_name + '(args_.Get(' + (pi + 1) + '));');
+            let str =   '  auto p' + pi + ' = ' + ppv_name + '.';
             if (f.args[p].type === 'int')
               str += 'AsInt();';
             else if (f.args[p].type === 'double')
@@ -423,7 +517,7 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
           pi++;
         }
         pi = 0;
-        let str = '    ' + f.name + '(';
+        let str = '  ' + f.name + '(';
         for (let p = 0; p < f.args.length; p++) {
           str += 'p' + pi;
           if (is_mem_buff_param_to_c(f.args, p)) {
@@ -437,17 +531,60 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
         }
         str += ');';
         console.log(str);
-        console.log('  };');
+        console.log('}');
+        console.log('');
       });
-
-      console.log('}');
+      
+      // and for each C function that can be batched, a function that reads
+      // its parameters from an ms_batch_reader and calls it
+      exported_c_functions.forEach((f) => {
+        if (has_mem_buff_param_to_c(f))
+          return;
+        console.log('static bool ms_js_to_c_batch_' + f.name + '(ms_batch_reader& r_)');
+        console.log('{');
+        let reads = [];
+        f.args.forEach((arg, p) => {
+          console.log('  ' + arg.type + ' p' + p + ';');
+          reads.push('r_.read(p' + p + ')');
+        });
+        if (reads.length > 0) {
+          console.log('  if (!' + reads.join(' || !') + ')');
+          console.log('    return false;');
+        }
+        console.log('  ' + f.name + '(' + f.args.map((arg, p) => 'p' + p).join(', ') + ');');
+        console.log('  return true;');
+        console.log('}');
+        console.log('');
+      });
+      
+      // and the tables HandleMessage uses to find them, indexed by the
+      // function's id (see js_to_c_id)
+      console.log('void (* const ms_js_to_c_table[])(const pp::VarArray& args_) = {');
+      if (exported_c_functions.length === 0)
+        console.log('  0');
+      exported_c_functions.forEach((f) => {
+        console.log('  &ms_js_to_c_' + f.name + ',');
+      });
+      console.log('};');
+      console.log('const size_t ms_js_to_c_table_size = ' + exported_c_functions.length + ';');
+      console.log('');
+      console.log('bool (* const ms_js_to_c_batch_table[])(ms_batch_reader& r_) = {');
+      if (exported_c_functions.length === 0)
+        console.log('  0');
+      exported_c_functions.forEach((f) => {
+        console.log('  ' + (has_mem_buff_param_to_c(f) ? '0' : '&ms_js_to_c_batch_' + f.name) + ',');
+      });
+      console.log('};');
+      console.log('');
+      
+      console.log('const int32_t ms_c_to_js_batch_interval_ms = ' + js_batch_interval_ms() + ';');
       console.log('');
       
       // for each javascript function that is callable from C...
       console.log('extern "C" {');
       console.log('');
       
-      exported_js_functions.forEach((f) => {
+      exported_js_functions.forEach((f, id) => {
 
         // the function definition
         let str = 'void ' + f.name + '(';
@@ -461,6 +598,16 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
         // the function body
         console.log('{');
         
+        // batched functions just add themselves to ms_c_to_js_batch
+        if (is_batched_js(f)) {
+          console.log('  ms_c_to_js_batch_call b_(' + id + ');');
+          f.args.forEach((arg) => console.log('  b_.put(' + arg.name + ');'));
+          console.log('}');
+          console.log('');
+          return;
+        }
+        write_c_batch_flush();
+        
         // to start with, for any parameter that is a memory buffer,
         // declare a VarrArrayBuffer for it and copy the supplied memory
         // into it.
@@ -504,6 +651,7 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
       // some boilerplate code
       console.log('void ms_async_startup_complete(const char* err)');
       console.log('{');
+      write_c_batch_flush();
       console.log('  pp::VarArray args;');
       console.log('  args.Set(0,gModuleID);');
       console.log('  if (err)');
@@ -521,6 +669,7 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
       
       console.log('void ms_consolelog(const char* message)');
       console.log('{');
+      write_c_batch_flush();
       console.log('  pp::VarArray args;');
       console.log('  args.Set(0,std::string(message));');
       console.log('');
@@ -544,7 +693,33 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
       console.log('');
       console.log('mergeInto(LibraryManager.library, {');
       
-      exported_js_functions.forEach((f) => {
+      // helpers for the batched transports (see write_batcher), when running
+      // in a worker.  get_batch returns the batch that calls to the functions
+      // in batched_js_functions are added to, which is posted to the page
+      // every js_batch_interval_ms
+      // and when the page turns on the ring transport (see write_bind) it sends
+      // the two SharedArrayBuffers, in_ring holds calls from the page, and
+      // out_ring calls to it
+      console.log('  $MS_GLUE: {');
+      console.log('    batch: null,');
+      console.log('    in_ring: null,');
+      console.log('    in_sab: null,');
+      console.log('    out_ring: null,');
+      write_batcher('batcher: function', '    ', ',');
+      write_batch_reader('reader: function', '    ', ',');
+      write_ring('ring: function', '    ', ',');
+      console.log('    get_batch: function() {');
+      console.log('      if (!MS_GLUE.batch)');
+      console.log('        MS_GLUE.batch = MS_GLUE.batcher(function(out) {postMessage(out, [out]);}, function(f) {setTimeout(f, ' + js_batch_interval_ms() + ');});');
+      console.log('      return MS_GLUE.batch;');
+      console.log('    },');
+      console.log('    flush: function() {');
+      console.log('      if (MS_GLUE.batch)');
+      console.log('        MS_GLUE.batch.flush();');
+      console.log('    }');
+      console.log('  },');
+      
+      exported_js_functions.forEach((f, id) => {
       
         // the function signature
         let str = '  ' + f.name + '__sig:\'v';
@@ -565,11 +740,32 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
             do_assert(true, 'unsupported parameter type: \'' + arg.type + '\'');
         });
         console.log(str + '\',');
+        console.log('  ' + f.name + '__deps: [\'$MS_GLUE\'],');
         
         // now the library function itself
         console.log('  ' + f.name + ': function(' + emit_param_names(f.args, false) + ') {');
 
-        if (has_mem_buff_param_to_js(f)) {
+        if (is_batched_js(f)) {
+        
+          console.log('    if (typeof importScripts === \'function\') {');
+          write_js_ring_call(f, id);
+          console.log('      var b_ = MS_GLUE.get_batch();');
+          console.log('      b_.call(' + id + ');');
+          f.args.forEach((arg) => {
+            if (arg.type === 'int')
+              console.log('      b_.i(' + arg.name + ');');
+            else if (arg.type === 'const char*')
+              console.log('      b_.s(Pointer_stringify(' + arg.name + '));');
+            else
+              console.log('      b_.d(' + arg.name + ');');
+          });
+          // with the ring on, this is the call its mark is waiting for
+          console.log('      if (r_)');
+          console.log('        b_.flush();');
+          console.log('    } else');
+          console.log('      Module.__ms_c_to_js_api__.' + f.name + '.apply(Module.__ms_this__, [' + emit_param_names(f.args, true) + ']);');
+        
+        } else if (has_mem_buff_param_to_js(f)) {
         
           for (let p = 0, arg; arg = f.args[p]; p++) {
             if (is_mem_buff_param_to_js(f.args, p)) {
@@ -579,6 +775,8 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
           }
           
           console.log('    if (typeof importScripts === \'function\') {');
+          write_js_batch_flush('      ');
+          write_js_ring_call(f, id);
           for (let p = 0, arg; arg = f.args[p]; p++) {
             if (is_mem_buff_param_to_js(f.args, p)) {
               console.log('      var ' + arg.name + '_arrb_ = new ArrayBuffer(' + arg.name + '_size);');
@@ -627,9 +825,11 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
         } else {
           
           // the simpler (and more common) case of no memory buffer transfers
-          console.log('    if (typeof importScripts === \'function\')');
+          console.log('    if (typeof importScripts === \'function\') {');
+          write_js_batch_flush('      ');
+          write_js_ring_call(f, id);
           console.log('      postMessage({api:\'' + f.name + '\', args:[' + emit_param_names(f.args, true) + ']});');
-          console.log('    else');
+          console.log('    } else');
           console.log('      Module.__ms_c_to_js_api__.' + f.name + '.apply(Module.__ms_this__, [' + emit_param_names(f.args, true) + ']);');
           
         }
@@ -639,13 +839,15 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
       });
       
       console.log('  ms_async_startup_complete__sig: \'vi\',');
+      console.log('  ms_async_startup_complete__deps: [\'$MS_GLUE\'],');
       console.log('  ms_async_startup_complete: function(err) {');
       
       console.log('    if (err) {');
       console.log('      var reason = Pointer_stringify(err);')
-      console.log('      if (typeof importScripts === \'function\')');
+      console.log('      if (typeof importScripts === \'function\') {');
+      write_js_batch_flush('        ');
       console.log('        postMessage({api:\'ms_async_startup_failed\', args:[Module.__ms_module_id__, reason]});');
-      console.log('      else');
+      console.log('      } else');
       console.log('        Module.__ms_c_to_js_api__.ms_async_startup_failed.apply(Module.__ms_this__, [Module.__ms_module_id__, reason]);');
       console.log('      return;');
       console.log('    }');
@@ -654,7 +856,7 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
       // load the Module's __ms_js_to_c_api__ member with function objects that are the result of calling
       // Module.cwrap for each exported C function
       console.log('    var o = (typeof importScripts === \'function\') ? {} : Module.__ms_js_to_c_api__;');
-      console.log('    var module_malloc = Module.cwrap(\'malloc\', \'number\', [\'number\']);');
+      console.log('    var staging_alloc = Module.cwrap(\'MS_StagingAlloc\', \'number\', [\'number\']);');
       
       exported_c_functions.forEach((f) => {
         if (has_mem_buff_param_to_c(f)) {
@@ -681,9 +883,9 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
           
           for (let p = 0, arg; arg = f.args[p]; p++) {
             if (is_mem_buff_param_to_c(f.args, p)) {
-              console.log('      var ' + arg.name + '_ptr = module_malloc(' + arg.name + '.byteLength);');
+              console.log('      var ' + arg.name + '_ptr = staging_alloc(' + arg.name + '.byteLength);');
               console.log('      var ' + arg.name + '_array = new Uint8Array(Module.HEAPU8.buffer, ' + arg.name + '_ptr, ' + arg.name + '.byteLength);');
-              console.log('      ' + arg.name + '_array.set(new Uint8Array(' + arg.name + '));');
+              console.log('      ' + arg.name + '_array.set(ArrayBuffer.isView(' + arg.name + ') ? ' + arg.name + ' : new Uint8Array(' + arg.name + '));');
               p += 2;
             }
           }
@@ -711,8 +913,79 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
         }
       });
       
+      // in a worker, calls arrive as [id, arg0, arg1, ...], and 'tbl' holds a
+      // function for each id that calls the matching function in 'o'
       console.log('    if (typeof importScripts === \'function\') {');
-      console.log('      self.addEventListener(\'message\', function(e) {o[e.data.api].apply(this, e.data.args);}, false);');
+      console.log('      var tbl = [');
+      exported_c_functions.forEach((f) => {
+        let str = '        function(a) {o.' + f.name + '(';
+        let ai = 1;
+        for (let p = 0; p < f.args.length; p++) {
+          str += 'a[' + (ai++) + ']';
+          if (is_mem_buff_param_to_c(f.args, p))
+            p += 2;
+          if (p < f.args.length - 1)
+            str += ', ';
+        }
+        console.log(str + ');},');
+      });
+      console.log('      ];');
+      
+      // and when batching or the ring transport is turned on (see write_bind),
+      // calls arrive packed in an ArrayBuffer or the ring, and 'btbl' holds a
+      // function for each id that reads the arguments from 'r'.  Memory buffers
+      // only come through the ring, and are copied from it to the heap by the
+      // function in 'o'
+      console.log('      var btbl = [');
+      exported_c_functions.forEach((f) => {
+        let reads = batch_reads(f, is_mem_buff_param_to_c, 3);
+        console.log('        function(r) {o.' + f.name + '(' + reads.join(', ') + ');},');
+      });
+      console.log('      ];');
+      console.log('      var run_batch = function(buf) {');
+      console.log('        var r = MS_GLUE.reader(buf);');
+      console.log('        while (!r.done()) {');
+      console.log('          var fn = btbl[r.i()];');
+      console.log('          if (!fn)');
+      console.log('            break;');
+      console.log('          fn(r);');
+      console.log('        }');
+      console.log('      };');
+      console.log('      var run_ring = function(pos, end) {');
+      console.log('        var r = MS_GLUE.reader(MS_GLUE.in_sab, pos, end);');
+      console.log('        var fn = btbl[r.i()];');
+      console.log('        if (fn)');
+      console.log('          fn(r);');
+      console.log('      };');
+      
+      // the page sends {ms_ring: [in, out]} to turn on the ring transport,
+      // 'ms_ring' (the doorbell) when it has written to the ring, and
+      // 'ms_ring_posted' ahead of a call that didn't fit in it.  Anything
+      // still waiting to be batched is posted before the ring is used
+      console.log('      var ring_posted = false;');
+      console.log('      self.addEventListener(\'message\', function(e) {');
+      console.log('        if (e.data === \'ms_ring\')');
+      console.log('          return MS_GLUE.in_ring.drain(run_ring);');
+      console.log('        if (e.data === \'ms_ring_posted\')');
+      console.log('          return ring_posted = true;');
+      console.log('        if (e.data.ms_ring) {');
+      write_js_batch_flush('          ');
+      console.log('          MS_GLUE.in_sab = e.data.ms_ring[0];');
+      console.log('          MS_GLUE.in_ring = MS_GLUE.ring(e.data.ms_ring[0], null);');
+      console.log('          MS_GLUE.out_ring = MS_GLUE.ring(e.data.ms_ring[1], function() {postMessage(\'ms_ring\');});');
+      console.log('          return;');
+      console.log('        }');
+      console.log('        if (e.data instanceof ArrayBuffer)');
+      console.log('          return run_batch(e.data);');
+      console.log('        var fn = tbl[e.data[0]];');
+      console.log('        if (ring_posted) {');
+      console.log('          ring_posted = false;');
+      console.log('          return MS_GLUE.in_ring.posted(run_ring, function() {if (fn) fn(e.data);});');
+      console.log('        }');
+      console.log('        if (fn)');
+      console.log('          fn(e.data);');
+      console.log('      }, false);');
+      write_js_batch_flush('      ');
       console.log('      self.postMessage({api:\'ms_async_startup_complete\', args:[Module.__ms_module_id__]});');
       console.log('    } else');
       console.log('      Module.__ms_c_to_js_api__.ms_async_startup_complete.apply(Module.__ms_this__, [Module.__ms_module_id__]);');
@@ -734,7 +1007,9 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
     }
     
     function create_postMessage(f) {
-      let str = 'mod_obj.postMessage({api:\'' + f.name + '\', args:[';
+      let str = 'mod_obj.postMessage([' + js_to_c_id(f);
+      if (f.args.length > 0)
+        str += ', ';
       for (let p = 0, arg; arg = f.args[p]; p++) {
         str += arg.name;
         if (arg.type === 'int')
@@ -746,19 +1021,399 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
         if (p < f.args.length - 1)
           str += ', ';
       }
-      return str + ']}';
+      return str + ']';
     }
     
     function create_postMessage_call(f) {
       return create_postMessage(f) + ');';
     }
     
+    // adds, to 'out', the lines of a function that writes the utf8 encoding
+    // of 'v' to bytes[pos...] and returns the position after it.  'bytes' must
+    // have room for 3 bytes per character of 'v'
+    function write_utf8_put(out) {
+      out.push('  function utf8_put(bytes, pos, v) {');
+      out.push('    for (var i = 0; i < v.length; i++) {');
+      out.push('      var c = v.charCodeAt(i);');
+      out.push('      if (c >= 0xd800 && c <= 0xdbff && i + 1 < v.length)');
+      out.push('        c = 0x10000 + ((c & 0x3ff) << 10) + (v.charCodeAt(++i) & 0x3ff);');
+      out.push('      if (c < 0x80)');
+      out.push('        bytes[pos++] = c;');
+      out.push('      else if (c < 0x800) {');
+      out.push('        bytes[pos++] = 0xc0 | (c >> 6);');
+      out.push('        bytes[pos++] = 0x80 | (c & 0x3f);');
+      out.push('      } else if (c < 0x10000) {');
+      out.push('        bytes[pos++] = 0xe0 | (c >> 12);');
+      out.push('        bytes[pos++] = 0x80 | ((c >> 6) & 0x3f);');
+      out.push('        bytes[pos++] = 0x80 | (c & 0x3f);');
+      out.push('      } else {');
+      out.push('        bytes[pos++] = 0xf0 | (c >> 18);');
+      out.push('        bytes[pos++] = 0x80 | ((c >> 12) & 0x3f);');
+      out.push('        bytes[pos++] = 0x80 | ((c >> 6) & 0x3f);');
+      out.push('        bytes[pos++] = 0x80 | (c & 0x3f);');
+      out.push('      }');
+      out.push('    }');
+      out.push('    return pos;');
+      out.push('  }');
+    }
+    
+    // the code that packs batched calls into an ArrayBuffer (see ms_batch_reader in
+    // mutantspider_js_to_c_dispatch_stub.cpp for the format).  It is a function
+    // taking 'post', called with each filled ArrayBuffer, and 'schedule', called
+    // with the function that posts what has been queued so far.  'decl' is how
+    // the function starts, and each line is written with 'indent' in front of it
+    // ('end' is added after the closing brace)
+    function write_batcher(decl, indent, end) {
+      let out = [decl + '(post, schedule) {'];
+      out.push('  var buf = new ArrayBuffer(4096);');
+      out.push('  var view = new DataView(buf);');
+      out.push('  var bytes = new Uint8Array(buf);');
+      out.push('  var len = 0;');
+      out.push('  var scheduled = false;');
+      write_utf8_put(out);
+      out.push('  function reserve(n) {');
+      out.push('    if (len + n <= buf.byteLength)');
+      out.push('      return;');
+      out.push('    var nbuf = new ArrayBuffer(Math.max(buf.byteLength * 2, len + n));');
+      out.push('    new Uint8Array(nbuf).set(bytes.subarray(0, len));');
+      out.push('    buf = nbuf;');
+      out.push('    view = new DataView(buf);');
+      out.push('    bytes = new Uint8Array(buf);');
+      out.push('  }');
+      out.push('  var b = {');
+      out.push('    i: function(v) { reserve(4); view.setInt32(len, v, true); len += 4; },');
+      out.push('    d: function(v) { reserve(8); view.setFloat64(len, v, true); len += 8; },');
+      out.push('    s: function(v) {');
+      out.push('      v = String(v);');
+      out.push('      reserve(4 + v.length * 3 + 1);');
+      out.push('      var start = len;');
+      out.push('      len = utf8_put(bytes, len + 4, v);');
+      out.push('      view.setUint32(start, len - start - 4, true);');
+      out.push('      bytes[len++] = 0;');
+      out.push('    },');
+      out.push('    b: function(v) {');
+      out.push('      reserve(4 + v.length);');
+      out.push('      view.setUint32(len, v.length, true);');
+      out.push('      bytes.set(v, len + 4);');
+      out.push('      len += 4 + v.length;');
+      out.push('    },');
+      out.push('    call: function(id) {');
+      out.push('      b.i(id);');
+      out.push('      if (!scheduled) {');
+      out.push('        scheduled = true;');
+      out.push('        schedule(b.flush);');
+      out.push('      }');
+      out.push('    },');
+      out.push('    flush: function() {');
+      out.push('      scheduled = false;');
+      out.push('      if (len === 0)');
+      out.push('        return;');
+      out.push('      var out = buf.slice(0, len);');
+      out.push('      len = 0;');
+      out.push('      post(out);');
+      out.push('    }');
+      out.push('  };');
+      out.push('  return b;');
+      out.push('}' + (end || ''));
+      out.forEach((line) => console.log(indent + line));
+    }
+    
+    // and the code that reads them back, a function that takes the ArrayBuffer
+    // (or SharedArrayBuffer, see write_ring) and optionally the range of it to
+    // read, and returns an object whose i(), d(), s() and b() read the next
+    // int, double, string and memory buffer.  b() returns a view of the buffer,
+    // not a copy.  Strings are decoded here since this also runs in pages,
+    // where emscripten's UTF8ArrayToString isn't available
+    function write_batch_reader(decl, indent, end) {
+      let out = [decl + '(buf, pos, end) {'];
+      out.push('  var view = new DataView(buf);');
+      out.push('  var bytes = new Uint8Array(buf);');
+      out.push('  var r = {pos: pos || 0};');
+      out.push('  if (end === undefined)');
+      out.push('    end = buf.byteLength;');
+      out.push('  r.i = function() { var v = view.getInt32(r.pos, true); r.pos += 4; return v; };');
+      out.push('  r.d = function() { var v = view.getFloat64(r.pos, true); r.pos += 8; return v; };');
+      out.push('  r.s = function() {');
+      out.push('    var stop = r.pos + 4 + r.i();');
+      out.push('    var v = \'\';');
+      out.push('    while (r.pos < stop) {');
+      out.push('      var c = bytes[r.pos++];');
+      out.push('      if (c >= 0xf0) {');
+      out.push('        c = ((c & 0x07) << 18) | ((bytes[r.pos] & 0x3f) << 12) | ((bytes[r.pos + 1] & 0x3f) << 6) | (bytes[r.pos + 2] & 0x3f);');
+      out.push('        r.pos += 3;');
+      out.push('      } else if (c >= 0xe0) {');
+      out.push('        c = ((c & 0x0f) << 12) | ((bytes[r.pos] & 0x3f) << 6) | (bytes[r.pos + 1] & 0x3f);');
+      out.push('        r.pos += 2;');
+      out.push('      } else if (c >= 0xc0)');
+      out.push('        c = ((c & 0x1f) << 6) | (bytes[r.pos++] & 0x3f);');
+      out.push('      if (c >= 0x10000) {');
+      out.push('        c -= 0x10000;');
+      out.push('        v += String.fromCharCode(0xd800 | (c >> 10), 0xdc00 | (c & 0x3ff));');
+      out.push('      } else');
+      out.push('        v += String.fromCharCode(c);');
+      out.push('    }');
+      out.push('    r.pos = stop + 1;');
+      out.push('    return v;');
+      out.push('  };');
+      out.push('  r.b = function() { var n = r.i(); var v = new Uint8Array(buf, r.pos, n); r.pos += n; return v; };');
+      out.push('  r.done = function() { return r.pos >= end; };');
+      out.push('  return r;');
+      out.push('}' + (end || ''));
+      out.forEach((line) => console.log(indent + line));
+    }
+    
+    // the code for one direction of the optional SharedArrayBuffer transport
+    // between a page and a worker (see the 'ring' option in write_bind).  It is
+    // a function taking the SharedArrayBuffer and 'doorbell', which is called
+    // when the reader might be waiting for a message before looking at the ring.
+    // The first 16 bytes of the SharedArrayBuffer are an Int32Array holding the
+    // number of bytes ever written, the number ever read, and a flag the reader
+    // sets when it finds the ring empty.  The rest, whose size must be a power
+    // of 2, holds the calls, each as an int32 length followed by the call in
+    // the write_batcher format and padded to 4 bytes.  A length of -1 means the
+    // rest of the ring is unused and the next call is at its start, and -2
+    // marks where a call that was posted instead belongs.
+    //
+    // The writer calls begin(bound) with the most bytes the call can take.  If
+    // that returns true the call is written with i(), d(), s() and b(), and
+    // published with commit().  If it returns false the ring doesn't have room
+    // yet.  Calls that don't fit(bound) never will, and are posted instead, once
+    // mark() has returned true, after posting 'ms_ring_posted' so the reader
+    // knows the next call is one of them.  In a worker, wait(bound) blocks until
+    // begin(bound) succeeds (returning true), or the call doesn't fit and mark()
+    // succeeds (returning false).  The reader calls drain(handle) when the
+    // doorbell arrives, which calls handle(pos, end) with the range of the
+    // SharedArrayBuffer holding each waiting call, in order, stopping at a
+    // mark.  That range is reused once handle returns.  A posted call is run
+    // with posted(handle, run), which drains the calls ahead of its mark,
+    // calls run(), and goes on past the mark.  Without the mark a doorbell that
+    // was sent before the call was posted, but whose calls were already read,
+    // could read calls made after it before the posted one arrived
+    function write_ring(decl, indent, end) {
+      let out = [decl + '(sab, doorbell) {'];
+      out.push('  var hdr = new Int32Array(sab, 0, 4);');
+      out.push('  var cap = sab.byteLength - 16;');
+      out.push('  var bytes = new Uint8Array(sab, 16, cap);');
+      out.push('  var view = new DataView(sab, 16, cap);');
+      out.push('  var wpos = Atomics.load(hdr, 0);');
+      out.push('  var start = 0;');
+      out.push('  var len = 0;');
+      write_utf8_put(out);
+      out.push('  var ring = {');
+      out.push('    fits: function(bound) { return bound + 8 <= cap / 2; },');
+      out.push('    begin: function(bound) {');
+      out.push('      var need = (bound + 4 + 3) & ~3;');
+      out.push('      if (!ring.fits(bound))');
+      out.push('        return false;');
+      out.push('      var off = wpos & (cap - 1);');
+      out.push('      var skip = (off + need > cap) ? cap - off : 0;');
+      out.push('      if (((wpos - Atomics.load(hdr, 1)) | 0) + skip + need > cap)');
+      out.push('        return false;');
+      out.push('      if (skip) {');
+      out.push('        view.setInt32(off, -1, true);');
+      out.push('        wpos = (wpos + skip) | 0;');
+      out.push('        off = 0;');
+      out.push('      }');
+      out.push('      start = off;');
+      out.push('      len = off + 4;');
+      out.push('      return true;');
+      out.push('    },');
+      out.push('    i: function(v) { view.setInt32(len, v, true); len += 4; },');
+      out.push('    d: function(v) { view.setFloat64(len, v, true); len += 8; },');
+      out.push('    s: function(v) {');
+      out.push('      var p = len + 4;');
+      out.push('      len = utf8_put(bytes, p, String(v));');
+      out.push('      view.setUint32(p - 4, len - p, true);');
+      out.push('      bytes[len++] = 0;');
+      out.push('    },');
+      out.push('    b: function(v) {');
+      out.push('      view.setUint32(len, v.length, true);');
+      out.push('      bytes.set(v, len + 4);');
+      out.push('      len += 4 + v.length;');
+      out.push('    },');
+      out.push('    commit: function() { publish(len - start - 4); },');
+      out.push('    mark: function() {');
+      out.push('      if (!ring.begin(0))');
+      out.push('        return false;');
+      out.push('      publish(-2);');
+      out.push('      return true;');
+      out.push('    },');
+      out.push('    wait: function(bound) {');
+      out.push('      for (;;) {');
+      out.push('        var fits = ring.fits(bound);');
+      out.push('        if (fits ? ring.begin(bound) : ring.mark())');
+      out.push('          return fits;');
+      out.push('        Atomics.wait(hdr, 1, Atomics.load(hdr, 1));');
+      out.push('      }');
+      out.push('    },');
+      out.push('    drain: function(handle) {');
+      out.push('      for (;;) {');
+      out.push('        var rpos = Atomics.load(hdr, 1);');
+      out.push('        if (rpos === Atomics.load(hdr, 0)) {');
+      out.push('          // say we are waiting for the doorbell, then check again in');
+      out.push('          // case something was written before the writer could see that');
+      out.push('          Atomics.store(hdr, 2, 1);');
+      out.push('          if (rpos === Atomics.load(hdr, 0))');
+      out.push('            return;');
+      out.push('          Atomics.store(hdr, 2, 0);');
+      out.push('          continue;');
+      out.push('        }');
+      out.push('        var off = rpos & (cap - 1);');
+      out.push('        var n = view.getInt32(off, true);');
+      out.push('        if (n === -2)');
+      out.push('          return;');
+      out.push('        if (n < 0) {');
+      out.push('          Atomics.store(hdr, 1, (rpos + cap - off) | 0);');
+      out.push('          continue;');
+      out.push('        }');
+      out.push('        handle(16 + off + 4, 16 + off + 4 + n);');
+      out.push('        Atomics.store(hdr, 1, (rpos + ((n + 4 + 3) & ~3)) | 0);');
+      out.push('        Atomics.notify(hdr, 1);');
+      out.push('      }');
+      out.push('    },');
+      out.push('    posted: function(handle, run) {');
+      out.push('      ring.drain(handle);');
+      out.push('      run();');
+      out.push('      Atomics.store(hdr, 1, (Atomics.load(hdr, 1) + 4) | 0);');
+      out.push('      Atomics.notify(hdr, 1);');
+      out.push('      ring.drain(handle);');
+      out.push('    }');
+      out.push('  };');
+      out.push('  var publish = function(n) {');
+      out.push('    view.setInt32(start, n, true);');
+      out.push('    wpos = (wpos + ((len - start + 3) & ~3)) | 0;');
+      out.push('    Atomics.store(hdr, 0, wpos);');
+      out.push('    if (Atomics.load(hdr, 2)) {');
+      out.push('      Atomics.store(hdr, 2, 0);');
+      out.push('      doorbell();');
+      out.push('    }');
+      out.push('  };');
+      out.push('  return ring;');
+      out.push('}' + (end || ''));
+      out.forEach((line) => console.log(indent + line));
+    }
+    
+    // the part of bind() that sets up the ring transport, once the worker has
+    // started, and sends calls to C through it
+    function write_bind_ring() {
+      console.log('    var out_ring = null;');
+      console.log('    var in_ring = null;');
+      console.log('    var in_sab = null;');
+      console.log('    var start_rings = function() {');
+      console.log('      var out_sab = new SharedArrayBuffer(16 + ring_size);');
+      console.log('      in_sab = new SharedArrayBuffer(16 + ring_size);');
+      console.log('      new Int32Array(out_sab, 0, 4)[2] = 1;');
+      console.log('      new Int32Array(in_sab, 0, 4)[2] = 1;');
+      console.log('      mod_obj.postMessage({ms_ring: [out_sab, in_sab]});');
+      console.log('      out_ring = ms_ring(out_sab, function() {mod_obj.postMessage(\'ms_ring\');});');
+      console.log('      in_ring = ms_ring(in_sab, null);');
+      console.log('    };');
+      
+      // the page can't wait for room in the ring, so calls that don't have
+      // room yet wait in 'pending', and are retried (in order) every
+      // millisecond.  Each is a function that tries to write the call to the
+      // ring, returning 1 if it did, 0 if there wasn't room, or -1 if it can
+      // never fit and its mark was written, and the function that posts the
+      // call instead
+      console.log('    var pending = [];');
+      console.log('    var retry = function() {');
+      console.log('      while (pending.length) {');
+      console.log('        var res = pending[0][0]();');
+      console.log('        if (res === 0)');
+      console.log('          return setTimeout(retry, 1);');
+      console.log('        if (res < 0) {');
+      console.log('          mod_obj.postMessage(\'ms_ring_posted\');');
+      console.log('          pending[0][1]();');
+      console.log('        }');
+      console.log('        pending.shift();');
+      console.log('      }');
+      console.log('    };');
+      console.log('    var ring_send = function(write, post) {');
+      console.log('      pending.push([write, post]);');
+      console.log('      if (pending.length === 1)');
+      console.log('        retry();');
+      console.log('    };');
+      exported_c_functions.forEach((f) => {
+        let bound = ['4'];
+        let writes = ['out_ring.i(' + js_to_c_id(f) + ');'];
+        let pre = [];
+        for (let p = 0, arg; arg = f.args[p]; p++) {
+          if (is_mem_buff_param_to_c(f.args, p)) {
+            pre.push('var ' + arg.name + '_arr_ = new Uint8Array(' + arg.name + ');');
+            bound.push('4 + ' + arg.name + '_arr_.length');
+            writes.push('out_ring.b(' + arg.name + '_arr_);');
+            p += 2;
+          } else if (arg.type === 'const char*') {
+            pre.push(arg.name + ' = String(' + arg.name + ');');
+            bound.push('4 + ' + arg.name + '.length * 3 + 1');
+            writes.push('out_ring.s(' + arg.name + ');');
+          } else if (arg.type === 'int') {
+            bound.push('4');
+            writes.push('out_ring.i(' + arg.name + ');');
+          } else {
+            bound.push('8');
+            writes.push('out_ring.d(' + arg.name + ');');
+          }
+        }
+        let names = [];
+        for (let p = 0, arg; arg = f.args[p]; p++) {
+          names.push(arg.name);
+          if (is_mem_buff_param_to_c(f.args, p))
+            p += 2;
+        }
+        console.log('    if (ring_size) {');
+        console.log('      var ' + f.name + '_posted_ = js_to_c[\'' + f.name + '\'];');
+        console.log('      js_to_c[\'' + f.name + '\'] = ' + create_function_def(f));
+        console.log('        if (!out_ring)');
+        console.log('          return ' + f.name + '_posted_(' + names.join(', ') + ');');
+        console.log('        ring_send(function() {');
+        pre.forEach((line) => console.log('          ' + line));
+        console.log('          var bound = ' + bound.join(' + ') + ';');
+        console.log('          if (!out_ring.fits(bound))');
+        console.log('            return out_ring.mark() ? -1 : 0;');
+        console.log('          if (!out_ring.begin(bound))');
+        console.log('            return 0;');
+        writes.forEach((w) => console.log('          ' + w));
+        console.log('          out_ring.commit();');
+        console.log('          return 1;');
+        console.log('        }, function() {');
+        console.log('          ' + f.name + '_posted_(' + names.join(', ') + ');');
+        console.log('        });');
+        console.log('      };');
+        console.log('    }');
+      });
+      console.log('');
+    }
+    
     function write_bind() {
       console.log('');
       console.log('// auto-generated - do not edit');
       console.log('');
       
-      console.log('module.exports.bind = function(c_to_js, mod_obj, ths) {');
+      write_batcher('function ms_batcher', '');
+      console.log('');
+      write_batch_reader('function ms_batch_reader', '');
+      console.log('');
+      write_ring('function ms_ring', '');
+      console.log('');
+      
+      // options.batch, if set to \'microtask\' or \'frame\', turns on batching:
+      // calls to C are queued and sent together at the end of the current
+      // microtask, or before the next animation frame.  js_to_c.ms_flush sends
+      // whatever is queued right away (without batching it does nothing, so
+      // it can always be called).  Calls that transfer memory buffers are
+      // never batched, they send what is queued ahead of them first.
+      //
+      // options.ring, if set to a number of bytes, and mod_obj is a Worker and
+      // the browser has SharedArrayBuffer, turns on the ring transport once the
+      // worker has started: calls in both directions, and the memory buffers
+      // passed with them, are written to one of two SharedArrayBuffer rings of
+      // (about) that size instead of being posted, and a message is only posted
+      // when the other side may have stopped looking at its ring.  Calls that
+      // don't fit in the ring are posted as usual.  Memory buffers passed to
+      // c_to_js functions are then views of the ring, only valid until the
+      // function returns.  options.ring takes the place of options.batch
+      console.log('module.exports.bind = function(c_to_js, mod_obj, ths, options) {');
       
       console.log('');
       
@@ -812,12 +1467,103 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
       });
       
       console.log('');
+      console.log('    var ring_size = 0;');
+      console.log('    if (options && options.ring && (mod_obj instanceof Worker) && (typeof SharedArrayBuffer !== \'undefined\')) {');
+      console.log('      ring_size = 65536;');
+      console.log('      while (ring_size < options.ring)');
+      console.log('        ring_size *= 2;');
+      console.log('    }');
+      console.log('');
+      // with the ring transport, calls are written to the ring (or wait, in
+      // order, for room in it) as soon as they are made, so nothing is queued
+      console.log('    js_to_c.ms_flush = function() {};');
+      console.log('');
+      console.log('    if (options && options.batch && !ring_size) {');
+      console.log('      var batch = ms_batcher(function(out) {');
+      console.log('        if (mod_obj instanceof Worker)');
+      console.log('          mod_obj.postMessage(out, [out]);');
+      console.log('        else');
+      console.log('          mod_obj.postMessage(out);');
+      console.log('      }, function(f) {');
+      console.log('        if (options.batch === \'frame\')');
+      console.log('          requestAnimationFrame(f);');
+      console.log('        else');
+      console.log('          Promise.resolve().then(f);');
+      console.log('      });');
+      exported_c_functions.forEach((f) => {
+        if (has_mem_buff_param_to_c(f)) {
+          console.log('      var ' + f.name + '_unbatched_ = js_to_c[\'' + f.name + '\'];');
+          console.log('      js_to_c[\'' + f.name + '\'] = ' + create_function_def(f));
+          str = '        ' + f.name + '_unbatched_(';
+          for (let p = 0, arg; arg = f.args[p]; p++) {
+            str += arg.name;
+            if (is_mem_buff_param_to_c(f.args, p))
+              p += 2;
+            if (p < f.args.length - 1)
+              str += ', ';
+          }
+          console.log('        batch.flush();');
+          console.log(str + ');');
+          console.log('      };');
+        } else {
+          console.log('      js_to_c[\'' + f.name + '\'] = ' + create_function_def(f));
+          console.log('        batch.call(' + js_to_c_id(f) + ');');
+          f.args.forEach((arg) => {
+            console.log('        batch.' + (arg.type === 'int' ? 'i' : arg.type === 'double' ? 'd' : 's') + '(' + arg.name + ');');
+          });
+          console.log('      };');
+        }
+      });
+      console.log('      js_to_c.ms_flush = batch.flush;');
+      console.log('    }');
+      console.log('');
+      // calls to the functions in batched_js_functions arrive packed in an
+      // ArrayBuffer, and are replayed in order through 'c_to_js_batch',
+      // indexed by their position in exported_js_functions.  With the ring
+      // transport, calls to the other functions are read with it too.  A
+      // memory buffer read from the ring is a view of it, so it is only valid
+      // until the function returns
+      console.log('    var c_to_js_batch = [');
+      exported_js_functions.forEach((f) => {
+        let reads = batch_reads(f, is_mem_buff_param_to_js, 2);
+        console.log('      function(r) {c_to_js[\'' + f.name + '\'].call(' + ['ths'].concat(reads).join(', ') + ');},');
+      });
+      console.log('    ];');
+      console.log('    var run_batch = function(r) {');
+      console.log('      while (!r.done()) {');
+      console.log('        var fn = c_to_js_batch[r.i()];');
+      console.log('        if (!fn)');
+      console.log('          break;');
+      console.log('        fn(r);');
+      console.log('      }');
+      console.log('    };');
+      console.log('');
+      write_bind_ring();
+      // 'ms_ring_posted' says the next call was posted because it didn't fit
+      // in the ring, and is run in its place there (see write_ring)
       console.log('    var obj = (mod_obj instanceof Worker) ? mod_obj : mod_obj.parentNode;');
+      console.log('    var ring_read = function(pos, end) {run_batch(ms_batch_reader(in_sab, pos, end));};');
+      console.log('    var ring_posted = false;');
+      console.log('    var run_posted = function(data) {');
+      console.log('      if (data instanceof ArrayBuffer)');
+      console.log('        run_batch(ms_batch_reader(data));');
+      console.log('      else');
+      console.log('        c_to_js[data.api].apply(ths, data.args);');
+      console.log('    };');
       console.log('    obj.addEventListener(\'message\', function(e) {');
-      console.log('      if (e.data.api === \'consolelog\')');
+      console.log('      if (ring_size && e.data.api === \'ms_async_startup_complete\')');
+      console.log('        start_rings();');
+      console.log('      if (e.data === \'ms_ring\')');
+      console.log('        in_ring.drain(ring_read);');
+      console.log('      else if (e.data === \'ms_ring_posted\')');
+      console.log('        ring_posted = true;');
+      console.log('      else if (e.data.api === \'consolelog\')');
       console.log('        console.log(e.data.args[0]);');
-      console.log('      else');
-      console.log('        c_to_js[e.data.api].apply(ths, e.data.args);');
+      console.log('      else if (ring_posted) {');
+      console.log('        ring_posted = false;');
+      console.log('        in_ring.posted(ring_read, function() {run_posted(e.data);});');
+      console.log('      } else');
+      console.log('        run_posted(e.data);');
       console.log('    }, true);');
       console.log('    obj.addEventListener(\'error\', function(e) {c_to_js[\'ms_error\'](e.message);}, true);');
       console.log('    obj.addEventListener(\'crash\', function(e) {c_to_js[\'ms_crash\'](e.message);}, true);');
@@ -839,6 +1585,14 @@ ms.read_file_and_start(argv.config_file, first_pass_make, (config_str) => {
       
       console.log('module.exports.submodules = ' + JSON.stringify(config.submodules) + ';');
       console.log('');
+      
+      // the ring, and the encoding it shares with batching, don't depend on
+      // anything in the page, so they can be driven directly -- for example
+      // from both ends of node's worker_threads, sharing the SharedArrayBuffer
+      console.log('module.exports.ms_ring = ms_ring;');
+      console.log('module.exports.ms_batcher = ms_batcher;');
+      console.log('module.exports.ms_batch_reader = ms_batch_reader;');
+      console.log('');
     }
     
     function write_make_rules() {
@@ -42,6 +42,126 @@ extern "C" void MS_Callback(ms_callback_base* cb)
   delete cb;
 }
 
+// the staging buffer pool (see mutantspider::set_staging_pool_limit).  asm.js
+// code only runs on the one thread, so none of this needs a lock.  Each block
+// starts with a staging_header recording its size class and its size, so
+// ms_staging_free can tell which free list it goes back on.  Blocks that
+// aren't pooled -- too large, or malloc'ed at their exact size because the
+// rounded-up one didn't fit -- have a class of staging_classes.  The classes
+// double up to 4MB and then go up in quarter steps (5, 6, 7, 8, 10, 12 ...
+// 64MB) so a large buffer doesn't waste up to half of the block it gets.
+namespace {
+
+  const int staging_min_shift = 12;
+  const int staging_pow2_classes = 11;
+  const int staging_classes = staging_pow2_classes + 16;
+  const size_t staging_header_size = 16;
+
+  struct staging_header
+  {
+    size_t  cls_;
+    size_t  size_;
+  };
+  static_assert(sizeof(staging_header) <= staging_header_size, "staging_header doesn't fit");
+
+  std::vector<void*> staging_free_lists[staging_classes];
+  mutantspider::staging_pool_stats staging_stats = { 0, 0, 0, 0, 8 * 1024 * 1024 };
+
+  size_t staging_class_size(int cls)
+  {
+    if (cls < staging_pow2_classes)
+      return (size_t)1 << (cls + staging_min_shift);
+    int step = cls - staging_pow2_classes;
+    size_t octave = (size_t)1 << (staging_pow2_classes - 1 + staging_min_shift + step / 4);
+    return octave + (octave / 4) * (step % 4 + 1);
+  }
+
+  void staging_trim(size_t limit)
+  {
+    for (int cls = staging_classes - 1; cls >= 0 && staging_stats.held_bytes > limit; cls--) {
+      auto& fl = staging_free_lists[cls];
+      while (!fl.empty() && staging_stats.held_bytes > limit) {
+        free(fl.back());
+        fl.pop_back();
+        staging_stats.held_bytes -= staging_class_size(cls);
+      }
+    }
+  }
+
+}
+
+extern "C" void* MS_StagingAlloc(size_t size)
+{
+  int cls = 0;
+  while (cls < staging_classes && staging_class_size(cls) < size)
+    ++cls;
+  size_t block_size = cls < staging_classes ? staging_class_size(cls) : size;
+
+  char* block;
+  if (cls < staging_classes && !staging_free_lists[cls].empty()) {
+    block = (char*)staging_free_lists[cls].back();
+    staging_free_lists[cls].pop_back();
+    staging_stats.held_bytes -= block_size;
+    ++staging_stats.hits;
+  } else {
+    block = (char*)malloc(staging_header_size + block_size);
+    if (!block && staging_stats.held_bytes) {
+      staging_trim(0);
+      block = (char*)malloc(staging_header_size + block_size);
+    }
+    if (!block && block_size > size) {
+      // the rounded-up size doesn't fit, but the size asked for might
+      block = (char*)malloc(staging_header_size + size);
+      if (block) {
+        cls = staging_classes;
+        block_size = size;
+      }
+    }
+    if (!block) {
+      fprintf(stderr, "MS_StagingAlloc(%d) failed\n", (int)size);
+      return 0;
+    }
+    ++staging_stats.misses;
+  }
+  auto hdr = (staging_header*)block;
+  hdr->cls_ = cls;
+  hdr->size_ = block_size;
+  staging_stats.in_use_bytes += block_size;
+  return block + staging_header_size;
+}
+
+void ms_staging_free(void* ptr)
+{
+  if (!ptr)
+    return;
+  char* block = (char*)ptr - staging_header_size;
+  auto hdr = (staging_header*)block;
+  int cls = (int)hdr->cls_;
+  size_t block_size = hdr->size_;
+  staging_stats.in_use_bytes -= block_size;
+  if (cls < staging_classes && staging_stats.held_bytes + block_size <= staging_stats.limit) {
+    staging_free_lists[cls].push_back(block);
+    staging_stats.held_bytes += block_size;
+  } else
+    free(block);
+}
+
+namespace mutantspider
+{
+
+  void set_staging_pool_limit(size_t bytes)
+  {
+    staging_stats.limit = bytes;
+    staging_trim(bytes);
+  }
+
+  staging_pool_stats get_staging_pool_stats()
+  {
+    return staging_stats;
+  }
+
+}
+
 #endif
 
 #if defined(__native_client__)
@@ -49,6 +169,23 @@ extern "C" void MS_Callback(ms_callback_base* cb)
 pp::Instance* gGlobalPPInstance;
 int gModuleID;
 
+// ms_free_transfered_buffer unmaps the ArrayBuffer the arguments arrived in,
+// nothing is copied, so there is no staging pool
+namespace mutantspider
+{
+
+  void set_staging_pool_limit(size_t bytes)
+  {
+  }
+
+  staging_pool_stats get_staging_pool_stats()
+  {
+    staging_pool_stats st = {};
+    return st;
+  }
+
+}
+
 #if 0
 
 #include "ppapi/cpp/var.h"
@@ -4,6 +4,8 @@
 #include <sstream>
 #include <iomanip>
 #include <vector>
+#include <functional>
+#include <stdint.h>
 
 #if defined(__native_client__)
   #include "ppapi/cpp/module.h"
@@ -65,6 +67,18 @@ struct ms_callback_struct : public ms_callback_base
 };
 
 extern "C" void ms_timed_callback_js(int milli, ms_callback_base* cb);
+extern "C" void ms_persist_flush_js(ms_callback_base* cb);
+extern "C" void ms_persist_chunk_size_js(int bytes);
+extern "C" void ms_fs_stats_enable_js();
+extern "C" int ms_rez_fetch_js(const char* url, int offset, int size, void* dst);
+extern "C" int ms_rez_fetch_sync_js();
+extern "C" void ms_rez_fetch_async_js(const char* url, int offset, int size, void* dst, int* ok, ms_callback_base* cb);
+extern "C" void ms_rez_set_root_js(const mutantspider::rez_dir* root_addr);
+extern "C" int ms_fs_stats_js(double* vals, int max_ops, char* names, int names_size);
+
+// the staging buffer pool, see mutantspider::set_staging_pool_limit
+extern "C" void* MS_StagingAlloc(size_t size);
+void ms_staging_free(void* ptr);
 
 // after, "milli" milliseconds, call function "f" with remaining args.
 // for example:
@@ -135,9 +149,11 @@ namespace mutantspider
     different mechanisms to let the user grant or deny permission to store data this way.  You can read about these
     issues by searching for documentation for IndexedDB.
 
-    In the current implementation, the /persistent/... files are all read into memory at start up, and stay there.
-    These files are essentially a memory-based file system.  So there can be performance issues if you store enormous
-    amounts of data this way.
+    By default the /persistent/... files are all read into memory at start up, and stay there.  These files are
+    essentially a memory-based file system, so there can be performance issues if you store enormous amounts of data
+    this way.  nacl builds can instead load each file the first time it is opened (set_persist_lazy_load), load some
+    files before startup completes and the rest in the background (set_persist_priority_paths), and drop the
+    contents of files that haven't been used recently once a memory budget is exceeded (set_persist_memory_budget).
 
     Loading the data in /persistent/..., and in fact the general preperation of the /persistent directory, is done
     asynchronously. The call to fs_init simply initiates this logic.  When the directories and data are avaiable your
@@ -173,6 +189,236 @@ namespace mutantspider
   */
   void init_fs();
   void mount_fs(const std::vector<std::string>& persistent_dirs = std::vector<std::string>());
+
+  /*
+    By default, mount_fs reads the contents of every file in the /persistent directories into memory before
+    MS_AsyncStartupComplete is called.  Calling set_persist_lazy_load(true) prior to mount_fs changes this, in nacl
+    builds, so that startup only loads the directory structure and the file sizes.  The contents of a file are then
+    read the first time it is opened (or renamed, or truncated to a non-zero size), and that call blocks until they
+    have been read.  The underlying html5fs storage can't be read on the main thread, so if that first access happens
+    on the main thread it fails with EWOULDBLOCK.
+
+    asm.js builds always load everything at startup and ignore this setting.
+  */
+  void set_persist_lazy_load(bool lazy);
+
+  /*
+    When not in lazy mode, nacl builds load the /persistent files at startup using 'num_threads' threads (the default
+    is 4).  If set_persist_priority_paths is given a non-empty list of paths (relative to /persistent, in the same
+    form as the 'persistent_dirs' given to mount_fs), then the files at or below those paths are loaded first, and
+    MS_AsyncStartupComplete is called as soon as they have been.  The remaining files continue to load in the
+    background, and any of them that is opened before that happens is loaded right then, as in lazy mode (including
+    failing with EWOULDBLOCK on the main thread).  Without a priority list, startup completes once everything has been
+    loaded.  In lazy mode the priority files are still loaded before startup completes, but nothing else is.
+
+    Both must be called prior to mount_fs.  asm.js builds ignore them.
+  */
+  void set_persist_sync_threads(int num_threads);
+  void set_persist_priority_paths(const std::vector<std::string>& paths);
+
+  /*
+    By default every file in /persistent is kept in memory once it has been loaded.  set_persist_memory_budget gives
+    nacl builds a limit, in bytes, on how much file data to keep there.  When the files in memory add up to more than
+    that, the contents of the least recently used ones that aren't open are dropped, and read back from html5fs the
+    next time they are opened.  That reload can't happen on the main thread, so a file that was last opened on the
+    main thread is never dropped, and keeps counting toward the budget until it is next opened on another thread.
+    With a budget set, startup only loads the files given to set_persist_priority_paths, so as with
+    set_persist_lazy_load, the first open of any other file fails with EWOULDBLOCK on the main thread.  0 (the default) means
+    no limit.  Must be called prior to mount_fs.  Journal mode (below) and asm.js builds ignore this setting, since
+    neither can read a single file back on demand.
+
+    get_persist_cache_stats reports how many opens found the file already in memory ('hits') or had to read it back
+    ('misses'), how many files have been dropped and how many bytes that freed, and how many bytes of file data are
+    currently in memory.  All of these are 0 when there is no budget.
+  */
+  void set_persist_memory_budget(size_t bytes);
+
+  struct persist_cache_stats
+  {
+    uint64_t  hits;
+    uint64_t  misses;
+    uint64_t  evictions;
+    uint64_t  evicted_bytes;
+    size_t    resident_bytes;
+    size_t    budget;
+  };
+  persist_cache_stats get_persist_cache_stats();
+
+  /*
+    Normally nacl builds mirror every change made in /persistent by making the same change to a matching file or
+    directory in html5fs, and each of those html5fs operations is fairly expensive.  Calling set_persist_journal(true)
+    prior to mount_fs instead records each change as a small binary record, appended (in large writes) to a few
+    journal files in html5fs.  Once enough has been appended the journal is compacted into a single packed image of
+    the whole tree, and at startup that image and the journal files written after it are replayed to rebuild
+    /persistent.  The first time a page mounts in journal mode, whatever the normal mode stored is imported into it.
+    Compaction reads all of /persistent on the background thread while other file operations carry on, and starts
+    over if they rename, delete or create anything in the meantime.  After a few of those retries it instead makes
+    them wait until it has finished reading.  Journal mode always loads everything at startup, so set_persist_lazy_load and set_persist_priority_paths are
+    ignored.  The journal isn't readable by the normal mode, so don't switch back after using it.
+
+    asm.js builds ignore this setting.
+  */
+  void set_persist_journal(bool journal);
+
+  /*
+    In nacl builds, data written to files in /persistent is copied out to html5fs in the background.  Writes are
+    collected per open file, with adjacent and overlapping writes merged together, and copied when the file is
+    closed, when fsync is called on it, when enough data has built up, or when the oldest of them has waited 'milli'
+    milliseconds -- whichever comes first.  The default is 500 milliseconds.  Passing 0 turns the timer off, so data is
+    only copied for the other reasons.
+
+    asm.js builds always write a modified file to IndexedDB when it is closed, and ignore this setting.
+  */
+  void set_persist_flush_interval(int milli);
+
+  /*
+    Calls 'callback', on the main thread, once every change made in /persistent before the call to persist_flush has
+    been written to the underlying storage (html5fs in nacl builds, IndexedDB in asm.js builds).  This includes writes
+    to files that are still open.  Use this when you need to know your data is safe, for example before telling the
+    user that something has been saved.  In asm.js builds the callback is always made asynchronously, in nacl builds
+    it is made asynchronously unless mount_fs was called without any persistent directories.
+  */
+  void persist_flush(std::function<void()> callback);
+
+  /*
+    By default fsync on a file in /persistent only queues its writes to be copied to the underlying storage, and
+    returns without waiting for that to happen.  After set_persist_blocking_fsync(true), nacl builds instead wait
+    until this file's writes have been committed -- except when fsync is called on the main thread, which the copy
+    needs in order to make progress.  asm.js builds can't block and ignore this setting, use persist_flush instead.
+  */
+  void set_persist_blocking_fsync(bool block);
+
+  /*
+    Writes to /persistent land in memory immediately and are copied to the underlying storage afterwards, so a
+    burst of writes can leave a lot of data waiting to be copied -- data that would be lost if the page went away.
+    set_persist_queue_limit caps the number of those waiting bytes ('queued_bytes' in persist_queue_stats).  Once
+    the cap is reached, nacl builds immediately queue a copy of every open file's pending writes, and then:
+
+      persist_queue_block     the writing thread waits until the total is back under the cap.  Writes made on
+                              the main thread never wait (the copy needs the main thread), they act like spill.
+      persist_queue_coalesce  the writer doesn't wait, and no more per-file copies are queued while over the cap,
+                              so further writes merge with the ones already pending and are copied together.
+      persist_queue_spill     the writer doesn't wait, and per-file copies are queued as usual.
+
+    A limit of 0 (the default) means no limit.  In journal mode (see set_persist_journal) the journal records
+    waiting to be written count toward the cap too.  asm.js builds ignore this setting.
+  */
+  enum persist_queue_policy
+  {
+    persist_queue_block,
+    persist_queue_coalesce,
+    persist_queue_spill
+  };
+  void set_persist_queue_limit(size_t bytes, persist_queue_policy policy = persist_queue_block);
+
+  /*
+    asm.js builds store each file in /persistent as a single IndexedDB record, so changing a few bytes of a large
+    file rewrites all of it.  After set_persist_chunk_size(bytes), called prior to mount_fs, files larger than
+    'bytes' are instead stored as a series of 'bytes' sized chunks, and only the chunks that were written to since
+    the file was last stored are written again.  The chunks are put back together when /persistent is loaded at
+    startup.  Files that were stored in chunks are still loaded correctly after the setting is changed or turned
+    off, and are stored the new way the next time they change.  0 (the default) means files are never chunked.
+
+    nacl builds already copy only the parts of a file that were written, and ignore this setting.
+  */
+  void set_persist_chunk_size(size_t bytes);
+
+  /*
+    Counters describing the queue of background tasks that mirror changes made in /persistent out to html5fs.
+    Every mutating file operation in /persistent queues one of these tasks, so 'enqueue_ns_total' and
+    'enqueue_ns_max' show how much time the calling threads are spending on that.  'depth' is the number of
+    tasks that have been queued but not yet run, and 'peak_depth' is the largest that has ever been.
+    'queued_bytes' is the number of written bytes that haven't been copied yet, 'queued_bytes_peak' the largest
+    that has ever been (use it to size TOTAL_MEMORY and set_persist_queue_limit), and 'queue_limit_waits' the
+    number of times a writer has waited because of persist_queue_block.
+
+    This queue only exists in nacl builds.  In asm.js builds all of these values are always 0.
+
+    asm.js builds instead collect the changes made in /persistent for a short time and then commit them all to
+    IndexedDB in one transaction.  'commits' is the number of those transactions that have completed,
+    'commit_entries' and 'commit_bytes' the total number of files and directories, and bytes of file contents,
+    they stored or deleted, and 'commit_ns_total' and 'commit_ns_max' how long they took.  These are always 0 in
+    nacl builds.
+  */
+  struct persist_queue_stats
+  {
+    uint64_t  tasks_queued;
+    uint64_t  enqueue_ns_total;
+    uint64_t  enqueue_ns_max;
+    size_t    depth;
+    size_t    peak_depth;
+    size_t    queued_bytes;
+    size_t    queued_bytes_peak;
+    uint64_t  queue_limit_waits;
+    uint64_t  commits;
+    uint64_t  commit_entries;
+    uint64_t  commit_bytes;
+    uint64_t  commit_ns_total;
+    uint64_t  commit_ns_max;
+  };
+  persist_queue_stats get_persist_queue_stats();
+
+  /*
+    Counters for the file system code itself.  Every operation the /persistent and /resources file systems implement
+    (the nacl fuse callbacks, or the asm.js node and stream ops) counts its calls, the calls that failed, the bytes it
+    read or wrote, and how long the calls took.  'latency' is a histogram of those times: latency[0] counts calls that
+    took less than 1 microsecond, latency[i] counts calls that took at least 2^(i-1) and less than 2^i microseconds,
+    and the last bucket also counts everything slower than that.
+
+    'queue' describes the work waiting to be copied to the underlying persistent storage (see get_persist_queue_stats,
+    in asm.js builds it describes the IndexedDB transactions that haven't completed).  'mirror_lag_ns' is how long the
+    oldest change that hasn't reached that storage has been waiting, or 0 if there aren't any.
+
+    The same information is readable as text in the file /.ms/stats.  Building with -DMS_NO_FS_STATS (FS_STATS=0 with
+    mutantspider.mk) compiles all of this out, in which case 'ops' is always empty and /.ms/stats doesn't exist.
+  */
+  const int fs_latency_buckets = 16;
+
+  struct fs_op_stats
+  {
+    std::string name;
+    uint64_t    calls;
+    uint64_t    errors;
+    uint64_t    bytes;
+    uint64_t    ns_total;
+    uint64_t    ns_max;
+    uint64_t    latency[fs_latency_buckets];
+  };
+
+  struct fs_stats_snapshot
+  {
+    std::vector<fs_op_stats>  ops;
+    persist_queue_stats       queue;
+    uint64_t                  mirror_lag_ns;
+  };
+  fs_stats_snapshot fs_stats();
+
+  /*
+    asm.js builds copy each memory buffer argument that javascript passes to an exported C function into the
+    module's heap, and ms_free_transfered_buffer releases that copy.  Rather than malloc and free a new copy for
+    every call, these staging buffers come from a pool of size classes and are put back in the pool when freed, so
+    a stream of similar sized buffers reuses the same few blocks of the heap.  The classes are powers of 2 from 4K
+    to 4MB, and above that go up in quarter steps (5MB, 6MB, 7MB, 8MB, 10MB ...) to 64MB.  set_staging_pool_limit
+    caps the number of bytes the pool holds on to while they are not in use; buffers freed once the pool is at the
+    cap, and buffers larger than 64MB, go back to malloc instead.  The default is 8MB, and 0 turns the pool off.  If
+    malloc fails the pool is emptied and the malloc is tried again, and if the rounded-up size still doesn't fit, a
+    buffer of exactly the requested size is malloc'ed and not pooled.
+
+    'hits' counts the buffers handed out from the pool, 'misses' the ones that had to be malloc'ed.  'held_bytes'
+    is the size of the free buffers the pool is keeping, 'in_use_bytes' the size of the ones that have been handed
+    out and not yet freed.  nacl builds map the ArrayBuffer itself instead of copying it, so there is no pool and
+    these are always 0.
+  */
+  struct staging_pool_stats
+  {
+    uint64_t  hits;
+    uint64_t  misses;
+    size_t    held_bytes;
+    size_t    in_use_bytes;
+    size_t    limit;
+  };
+  void set_staging_pool_limit(size_t bytes);
+  staging_pool_stats get_staging_pool_stats();
 }
 
 #define ms_log(_body) mutantspider::output(__FILE__, __LINE__, [&](std::ostream& formatter) {formatter << _body;})
@@ -236,7 +482,13 @@ namespace mutantspider
 struct rez_file_ent
 {
   const unsigned char*  file_data;
-  size_t                file_data_sz;
+  size_t                file_data_sz;   // the uncompressed size
+  
+  // null unless the file was built with <file>_COMPRESS (see rez_compress.js).
+  // In that case file_data holds block_size blocks, each compressed on its own,
+  // and block i is file_data[block_index[i], block_index[i+1])
+  const uint32_t*       block_index;
+  size_t                block_size;
 };
 
 struct rez_dir_ent
@@ -256,6 +508,120 @@ struct rez_dir {
 
 extern const rez_dir rez_root_dir;
 extern const rez_dir_ent rez_root_dir_ent;
+
+// every file and directory in /resources, by full path (for example
+// "/my_subdir/startup.conf"), sorted in strcmp order.  The nacl code
+// binary searches this instead of walking rez_root_dir
+struct rez_path_ent
+{
+  const char* path;
+  rez_dir_ent ent;
+};
+
+extern const rez_path_ent rez_path_index[];
+extern const size_t rez_path_index_sz;
+
+/*
+  Returns a pointer directly to the embedded contents of the resource file at 'path' (for example
+  "/resources/my_subdir/startup.conf") and, if 'size' isn't null, sets *size to its length.  Nothing is copied,
+  so this is the cheap way to parse a large resource in place.  The memory is read-only and stays valid for the
+  life of the module.  Returns null if 'path' isn't a file in /resources.  Compressed resources are decompressed
+  (once) into memory that is kept for the life of the module.
+*/
+const unsigned char* rez_map(const char* path, size_t* size);
+
+/*
+  Resource packs are sets of resource files that are built into separate files (see RESOURCE_PACKS in
+  README.makefile) instead of into the module, so they don't have to be downloaded before main() runs.
+  mount_rez_pack downloads the index at the start of the pack file at 'url', and then makes the pack's files
+  visible in /resources/<name>, calling 'callback' on the main thread with true if that worked.  The contents of
+  each file are downloaded the first time it is opened or read, using http range requests (or, when running in
+  node, by reading the file).  A server that ignores the range and sends the whole pack is only asked once, and
+  the rest of the pack's files are taken from that copy.
+
+  prefetch_rez starts downloading the given files (full paths, like "/resources/<name>/big.dat") in the
+  background, and calls 'callback' (if given) on the main thread once they have all finished, whether or not
+  that worked.  Code that can't wait for a download -- the main thread in nacl builds, and all of an asm.js build
+  running in a browser -- can only open the pack files that have already been fetched this way.  Opening one that
+  hasn't fails with EWOULDBLOCK.
+*/
+void mount_rez_pack(const std::string& name, const std::string& url, std::function<void(bool)> callback);
+void prefetch_rez(const std::vector<std::string>& paths, std::function<void()> callback = nullptr);
+
+/*
+  MS_REZ("shaders/blit.glsl") is the contents of the resource file /resources/shaders/blit.glsl, found at compile
+  time, as a rez_span.  It compiles down to reading the address and size of the embedded data out of the file's
+  rez_file_ent -- no fopen, no file system and no path lookup at runtime -- and the build fails if there is no such
+  resource.  The path can also be given as "/shaders/blit.glsl" or "/resources/shaders/blit.glsl".  It needs the
+  generated header that lists your resources, so files that use it must:
+
+    #include <ms_resources.h>
+
+  Compressed resources (<file>_COMPRESS) don't have their contents in memory, so they can't be used with MS_REZ.
+  Neither can resource packs.  Use rez_map for those.
+*/
+struct rez_span
+{
+  const unsigned char*  data;
+  size_t                size;
+};
+
+namespace rez_detail
+{
+  constexpr int path_cmp(const char* a, const char* b)
+  {
+    while (*a && *a == *b) {
+      ++a;
+      ++b;
+    }
+    return (int)(unsigned char)*a - (int)(unsigned char)*b;
+  }
+  
+  constexpr bool has_prefix(const char* path, const char* prefix)
+  {
+    while (*prefix && *path == *prefix) {
+      ++path;
+      ++prefix;
+    }
+    return *prefix == 0 && (*path == '/' || *path == 0);
+  }
+  
+  // binary search the (sorted) paths in Table for 'path', returning
+  // Table::size() if it isn't there.  The paths in Table start with a
+  // '/' that MS_REZ's argument doesn't need to
+  template<typename Table>
+  constexpr size_t find(const char* path)
+  {
+    if (has_prefix(path, "/resources"))
+      path += 10;
+    if (*path == '/')
+      ++path;
+    size_t lo = 0;
+    size_t hi = Table::size();
+    while (lo < hi) {
+      auto mid = lo + (hi - lo) / 2;
+      auto c = path_cmp(Table::path(mid) + 1, path);
+      if (c == 0)
+        return mid;
+      if (c < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return Table::size();
+  }
+  
+  template<typename Table, size_t I>
+  inline rez_span span()
+  {
+    static_assert(I < Table::size(), "MS_REZ: no such resource file");
+    static_assert(I >= Table::size() || !Table::compressed(I), "MS_REZ: resource file is compressed, use rez_map");
+    auto file = Table::file(I < Table::size() ? I : 0);
+    return rez_span{file->file_data, file->file_data_sz};
+  }
+}
+
+#define MS_REZ(path) (::mutantspider::rez_detail::span< ::mutantspider::rez_table, ::mutantspider::rez_detail::find< ::mutantspider::rez_table>(path)>())
 }
 
 #endif
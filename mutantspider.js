@@ -43,5 +43,39 @@ module.exports.read_file_and_start = (file_name, first_pass_make, start_func) =>
 
 };
 
+// write 'bytes' to 'fd' as the lines of a C string literal (adjacent literals,
+// which the compiler concatenates).  Compilers parse a string literal as a
+// single token, so this builds much faster, and in much less memory, than
+// an initializer list with one element per byte.  Printable characters are
+// written as-is and everything else as a 3 digit octal escape, which (unlike
+// \x) can't swallow a following digit.  The literal has an implied 0 at the
+// end, so an array initialized from it must be one byte longer than 'bytes'
+module.exports.write_c_string = (fd, bytes) => {
+  const per_line = 64;
+  let out = [];
+  let out_len = 0;
+  for (let i = 0; i < bytes.length; i += per_line) {
+    let line = '"';
+    let end = Math.min(i + per_line, bytes.length);
+    for (let j = i; j < end; j++) {
+      let b = bytes[j];
+      if (b >= 0x20 && b < 0x7f && b != 0x22/*"*/ && b != 0x5c/*\*/ && b != 0x3f/*? (trigraphs)*/)
+        line += String.fromCharCode(b);
+      else
+        line += '\\' + (b >> 6) + ((b >> 3) & 7) + (b & 7);
+    }
+    line += '"\n';
+    out.push(line);
+    out_len += line.length;
+    if (out_len >= 1 << 20 || end == bytes.length) {
+      fs.writeSync(fd, out.join(''));
+      out = [];
+      out_len = 0;
+    }
+  }
+  if (bytes.length == 0)
+    fs.writeSync(fd, '""\n');
+};
+
 // the root directory named used in the s3 buckets for items we put in there
 module.exports.root_dir = 'code/';
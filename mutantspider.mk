@@ -366,7 +366,7 @@ endif
 
 ##############################################################################
 
-ms.EM_EXPORTS+=main malloc free MS_Callback MS_AsyncStartupComplete
+ms.EM_EXPORTS+=main malloc free MS_StagingAlloc MS_Callback MS_AsyncStartupComplete
 
 #
 # If your build needs additional emcc libraries you can add them by defining them in
@@ -407,8 +407,18 @@ ms.additional_inc_dirs=$(ms.this_make_dir)
 #
 # before the compiler options check logic
 #
-ifneq (,$(RESOURCES))
+ifneq (,$(RESOURCES)$(RESOURCE_PACKS))
 CFLAGS+=-DMS_HAS_RESOURCES
+ms.EM_EXPORTS+=MS_RezOpen MS_RezRead
+endif
+
+#
+# FS_STATS=0 compiles out the file system counters (see mutantspider::fs_stats)
+#
+ifeq (0,$(FS_STATS))
+CFLAGS+=-DMS_NO_FS_STATS
+else
+ms.EM_EXPORTS+=MS_FsStatsText
 endif
 
 ifneq (,$(ms.c_sources))
@@ -523,10 +533,10 @@ define ms.cxx_compile_rule
 -include $(call ms.src_to_dep,$(1),_pnacl)
 -include $(call ms.src_to_dep,$(1),_js)
 
-$(call ms.src_to_obj,$(1),_pnacl): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_pnacl.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp
+$(call ms.src_to_obj,$(1),_pnacl): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_pnacl.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp $(ms.rez_header)
 	$(call ms.CALL_TOOL,$(ms.pnacl_cxx),-o $$@ -c $$< -MD -MF $(call ms.src_to_dep,$(1),_pnacl) -I$(ms.nacl_sdk_root)/include $(2) -std=gnu++14 $(CFLAGS) $(CFLAGS_pnacl) $(CFLAGS_$(CONFIG)) $(CFLAGS_pnacl_$(CONFIG)) $(CFLAGS_pnacl_$(1)),$$@)
 
-$(call ms.src_to_obj,$(1),_js): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_emcc.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp
+$(call ms.src_to_obj,$(1),_js): $(1) $(ms.INTERMEDIATE_DIR)/$(CONFIG)/compiler_emcc.opts | $(dir $(call ms.src_to_obj,$(1)))dir.stamp $(ms.rez_header)
 	$(call ms.CALL_TOOL,$(ms.em_cxx),-o $$@ $$< -MD -MF $(call ms.src_to_dep,$(1),_js) $(2) -std=c++14 $(CFLAGS) $(CFLAGS_$(CONFIG)) $(CFLAGS_emcc) $(CFLAGS_emcc_$(CONFIG)) $(CFLAGS_emcc_$(1)),$$@)
 
 endef
@@ -636,11 +646,12 @@ endef
 
 ###############################################################################################
 #
-#   Resource Handling -- only evaluated if $(RESOURCES) contains at least one file
+#   Resource Handling -- only evaluated if $(RESOURCES) or $(RESOURCE_PACKS) contains at
+#   least one file
 #
 ###############################################################################################
 
-ifneq (,$(RESOURCES))
+ifneq (,$(RESOURCES)$(RESOURCE_PACKS))
 
 #
 #	$1 the path/file name to "sanitize" (make it a legal C token)
@@ -654,41 +665,24 @@ ifneq (,$(RESOURCES))
 ms.sanitize_rez_name=rezRec_$(subst /,XS,$(subst -,X__,$(subst .,X_,$(subst X,XX,$(1)))))
 
 
-#
-# Get the size of a given file.
-#
-# $1 = File Name
-#
-ifeq (linux,$(ms.osname))
- ms.file_size=`stat -c %s $(1)`
-endif
-ifeq (mac,$(ms.osname))
- ms.file_size=`stat -f %z $(1)`
- ms.nlescape=\'$$'
-endif
-
 #
 # $1 file name of path/file to be treated as a resource.  The recipe for this
-# runs the contents of the file, $(1), through od (and then sed) to generate
-# a text file that contains a C-like array of hex values -- as in "0x54, 0x2f, ..."
-# with the contents of the file.
+# runs rez_embed.js, which generates a C++ file with the contents of the file,
+# $(1), as one big string literal (which compiles far faster, and in far less
+# memory, than an array initializer with an element per byte).  If
+# $(1)_COMPRESS is set then rez_compress.js generates the file instead, storing
+# the contents compressed in blocks of REZ_BLOCK_SIZE bytes.
 #
+REZ_BLOCK_SIZE?=65536
+
 define ms.resource_rule
-$(call ms.resrc_to_auto_gen,$(1)): $(1) | $(dir $(call ms.resrc_to_auto_gen,$(1)))dir.stamp
-	@echo "// AUTO-GENERATED by mutantspider.mk, based on the contents of $(notdir $(1))" > $$@
-	@echo "// DO NOT EDIT" >> $$@
-	@echo "" >> $$@
-	@echo "#include <mutantspider.h>" >> $$@
-	@echo "" >> $$@
-	@echo "namespace mutantspider {" >> $$@
-	@printf "const unsigned char $(call ms.sanitize_rez_name,$(1))_[" >> $$@
-	@printf "$(call ms.file_size,$(1))" >> $$@
-	@echo "] = {" >> $$@
-	@cat $$< | od -vt x1 -An | sed 's/\(\ \)\([0-9a-f][0-9a-f]\)/0x\2,/g' >> $$@
-	@echo "};" >> $$@
-	@echo "extern const rez_file_ent $(call ms.sanitize_rez_name,$(1));" >> $$@
-	@echo "const rez_file_ent $(call ms.sanitize_rez_name,$(1)) = { &$(call ms.sanitize_rez_name,$(1))_[0], $(call ms.file_size,$(1)) };" >> $$@
-	@echo "}" >> $$@
+ifneq (,$($(1)_COMPRESS))
+$(call ms.resrc_to_auto_gen,$(1)): $(1) $(ms.this_make_dir)rez_compress.js | $(dir $(call ms.resrc_to_auto_gen,$(1)))dir.stamp $(ms.this_make_dir)node_modules/.ms_stamp
+	@export NODE_PATH=$(ms.node_path) && node $(ms.this_make_dir)rez_compress.js --input=$$< --name=$(call ms.sanitize_rez_name,$(1)) --block_size=$(REZ_BLOCK_SIZE) > $$@
+else
+$(call ms.resrc_to_auto_gen,$(1)): $(1) $(ms.this_make_dir)rez_embed.js | $(dir $(call ms.resrc_to_auto_gen,$(1)))dir.stamp $(ms.this_make_dir)node_modules/.ms_stamp
+	@export NODE_PATH=$(ms.node_path) && node $(ms.this_make_dir)rez_embed.js --input=$$< --name=$(call ms.sanitize_rez_name,$(1)) > $$@
+endif
 
 endef
 
@@ -697,110 +691,63 @@ endef
 #
 $(foreach rez,$(RESOURCES),$(eval $(call ms.resource_rule,$(rez))))
 
-ms.rez_decl=$(foreach rez,$(RESOURCES),extern const rez_file_ent $(call ms.sanitize_rez_name,$(rez));)
-ms.rez_files=$(foreach rez,$(RESOURCES),$(call ms.resrc_to_auto_gen,$(rez)))
-
 #
-# this list of all directories listed as parent of any RESOURCE file
+# $1 the name of a resource pack.  The pack file, <name>.msrp, is built from
+# the files listed in $(1)_RESOURCES (each of which can have a _DST_DIR, like
+# ordinary resources) by rez_pack.js, and ends up next to the other targets so
+# it can be deployed with them.  See mutantspider::mount_rez_pack
 #
-ms.rez_dirs=$(sort $(foreach rez,$(RESOURCES),$($(rez)_DST_DIR)))
+define ms.pack_rule
+$(ms.OUT_DIR)/$(CONFIG)/$(1).msrp: $($(1)_RESOURCES) $(ms.this_make_dir)rez_pack.js | $(ms.this_make_dir)node_modules/.ms_stamp
+	$(ms.mkdir) -p $$(@D)
+	@echo "packing           $$@"
+	@export NODE_PATH=$(ms.node_path) && node $(ms.this_make_dir)rez_pack.js --output=$$@ $(foreach rez,$($(1)_RESOURCES),$($(rez)_DST_DIR)/$(notdir $(rez))=$(rez))
 
-#
-# some crazy helper functions
-#
-ms.reverse_1 = $(if $(1),$(call ms.reverse_1,$(wordlist 2,$(words $(1)),$(1)))) $(firstword $(1))
-ms.reverse = $(strip $(call ms.reverse_1,$(1)))
-ms.reverse_s1=$(if $(1),$(call ms.reverse_s1,$(wordlist 2,$(words $(1)),$(1))))/$(firstword $(1))
-ms.reverse_s2=$(patsubst //%,/%,$(call ms.reverse_s1,$(1)))
-ms.reverse_s=$(filter-out /,$(call ms.reverse_s2,$(1)))
-ms.parent_dir_helper=$(call ms.reverse_s,$(wordlist 2,$(words $(1)),$(1)))
-ms.parent_dir=$(call ms.parent_dir_helper,$(call ms.reverse,$(subst /, ,$(1))))
+endef
 
-#
-# helper
-#
-ms.dir_init={\"$(notdir $(1))\"{{COMMA}}{(rez_file_ent*)&$(call ms.sanitize_rez_name,$(1))XS}{{COMMA}}true}{{COMMAN}}
+$(foreach pack,$(RESOURCE_PACKS),$(eval $(call ms.pack_rule,$(pack))))
 
-#
-# If this directory, $(1), has a parent, then add an initialization snippet referencing
-# this directory (ms.dir_init,$(1)), to the parent's initialization list.  If not, then
-# add this snippet to the root initializer.  Regardless of whether $(1) has a parent
-# or not, add the name of this directory's initialization list to ms.initializer_list
-#
-define ms.add_dir_initializer
-$(if $(call ms.parent_dir,$(1)),ms.initializer_$(call ms.sanitize_rez_name,$(call ms.parent_dir,$(1)))XS+=$(call ms.dir_init,$(1)),ms.root_initializer+=$(call ms.dir_init,$(1)))
-ms.initializer_list+=ms.initializer_$(call ms.sanitize_rez_name,$(1))XS
-$(if $(call ms.parent_dir,$(1)),$(call ms.add_dir_initializer,$(call ms.parent_dir,$(1))))
-endef
+ms.rez_files=$(foreach rez,$(RESOURCES),$(call ms.resrc_to_auto_gen,$(rez)))
 
 #
-# loop through all of the resource directories, calling ms.add_dir_initializer
-# on each one, this can produce repeated initializer snippets in some of the
-# initializer lists because, for example:
+# The directory tree of /resources and the path index that get_dir_ent
+# searches (see resource_list.cpp), and the table that MS_REZ searches (see
+# ms_resources.h) are built by rez_tree.js from a manifest listing every
+# resource, one per line, as:
 #
-#   foo/bar/dir1
-#   foo/bar/dir2
+#   <path in /resources> <C name of its rez_file_ent> <source file> <1 if compressed, else 0>
 #
-# will both end up putting bar's snippet in foo's list.  So we finish by
-# calling 'sort' on the list.  This removes the duplicates.  Note that because
-# of this sort call, it is important that the snippets added by ms.add_dir_initializer
-# do not have any spaces in them.
+# The manifest is rewritten each time make runs, but its time stamp only
+# changes when its contents do, so these are only regenerated when the set
+# of resources changes, not when their contents do.  It is written
+# ms.manifest_chunk words (4 per resource) per shell command, so that no
+# one command line gets too long however many resources there are
 #
-$(eval $(foreach rezd,$(ms.rez_dirs),$(call ms.add_dir_initializer,$(rezd))))
-ms.initializer_list:=$(call ms.reverse,$(sort $(ms.initializer_list)))
-ms.root_initializer:=$(sort $(ms.root_initializer))
+ms.rez_manifest:=$(ms.INTERMEDIATE_DIR)/auto_gen/resources.manifest
+ms.manifest_words:=$(foreach rez,$(RESOURCES),'$($(rez)_DST_DIR)/$(notdir $(rez))' $(call ms.sanitize_rez_name,$(rez)) '$(rez)' $(if $($(rez)_COMPRESS),1,0))
+ms.manifest_chunk=600
+ms.manifest_next_chunk=601
+ms.write_manifest=$(if $(1),$(shell printf '%s %s %s %s\n' $(wordlist 1,$(ms.manifest_chunk),$(1)) >> $(ms.rez_manifest).tmp)$(call ms.write_manifest,$(wordlist $(ms.manifest_next_chunk),$(words $(1)),$(1))))
 
-#
-# helper
-#
-ms.file_init={\"$(notdir $(1))\"{{COMMA}}{&$(call ms.sanitize_rez_name,$(1))}{{COMMA}}false}{{COMMAN}}
+ifneq (clean,$(MAKECMDGOALS))
+ms.m:=$(shell mkdir -p $(dir $(ms.rez_manifest)) && rm -f $(ms.rez_manifest).tmp && touch $(ms.rez_manifest).tmp)
+ms.m:=$(call ms.write_manifest,$(ms.manifest_words))
+ms.m:=$(shell cmp -s $(ms.rez_manifest).tmp $(ms.rez_manifest) && rm $(ms.rez_manifest).tmp || mv $(ms.rez_manifest).tmp $(ms.rez_manifest))
+endif
+
+$(ms.INTERMEDIATE_DIR)/auto_gen/resource_list.cpp: $(ms.rez_manifest) $(ms.this_make_dir)rez_tree.js | $(ms.this_make_dir)node_modules/.ms_stamp
+	@export NODE_PATH=$(ms.node_path) && node $(ms.this_make_dir)rez_tree.js --manifest=$(ms.rez_manifest) --output=$@
 
 #
-# Add an initialization snippet, referencing this file - $(1) - to
-# this file's parent's initialization list
+# ms_resources.h, for MS_REZ.  Every compile waits for it (see ms.rez_header
+# in ms.cxx_compile_rule), since there is no way to know which files include
+# it until they have been compiled once
 #
-define ms.add_file_initializer
-$(if $($(1)_DST_DIR),ms.initializer_$(call ms.sanitize_rez_name,$($(1)_DST_DIR))XS+=$(call ms.file_init,$(1)),ms.root_initializer+=$(call ms.file_init,$(1)))
-endef
+ms.rez_header:=$(ms.INTERMEDIATE_DIR)/auto_gen/ms_resources.h
+ms.additional_inc_dirs+=$(ms.INTERMEDIATE_DIR)/auto_gen
 
-$(foreach rez,$(RESOURCES),$(eval $(call ms.add_file_initializer,$(rez))))
-
-#
-# finally, ms.dir_init_code will contain all of the C/C++ code that initializes
-# the directory structures -- other than, it will have a set of {{xx}} tokens in
-# it that will need to be swapped out for legal C characters.  These are used for
-# a variety of reasons.  But one is that some places that would otherwise need to
-# add a ',' character are in places where make itself would attempt to intperpret
-# that character as meaningful in the expression.  So ','  ','-followed by newline,
-# and newline are all written in as symbols for later substitution.
-#
-ms.construct_init_code=const rez_dir_ent $(2)_ents[] = {{{NL}}$(1)};{{NL}}rez_dir $(2) = {$(words $(1)){{COMMA}}&$(2)_ents[0]};
-
-ms.dir_init_code:=$(foreach init,$(ms.initializer_list),$(call ms.construct_init_code,$($(init)),$(subst ms.initializer_,,$(init))))
-
-
-###############
-
-$(ms.INTERMEDIATE_DIR)/auto_gen/resource_list.cpp: $(RESOURCES)
-	@echo "// AUTO-GENERATED by mutantspider.mk, based on the value of the make variable RESOURCES" > $@
-	@echo "// DO NOT EDIT" >> $@
-	@echo "" >> $@
-	@echo "#include <mutantspider.h>" >> $@
-	@echo "" >> $@
-	@echo "namespace mutantspider {" >> $@
-	@echo "" >> $@
-	@echo "$(ms.rez_decl)" | sed 's/; /;/g' | sed G >> $@
-	@echo "" >> $@
-	@echo "$(ms.dir_init_code)" | sed 's/; /;/g' | sed 's/{{COMMA}}/,/g' | sed 's/{{COMMAN}}/,$(ms.nlescape)\n/g' | sed 's/{{NL}}/$(ms.nlescape)\n/g' | sed 's/;/;$(ms.nlescape)\n/g' | sed 's/^ *//g' >> $@
-	@echo "const rez_dir_ent rez_root_dir_ents[] = {" >> $@
-	@echo "$(ms.root_initializer)" | sed 's/; /;/g' | sed 's/{{COMMA}}/,/g' | sed 's/{{COMMAN}}/,$(ms.nlescape)\n/g' | sed 's/;/;$(ms.nlescape)\n/g' >> $@
-	@echo "};" >> $@
-	@echo "" >> $@
-	@echo "const rez_dir rez_root_dir = { $(words $(ms.root_initializer)), &rez_root_dir_ents[0] };" >> $@
-	@echo "" >> $@
-	@echo "const rez_dir_ent rez_root_dir_ent = { \"\", (const rez_file_ent*)&rez_root_dir, true };" >> $@
-	@echo "" >> $@
-	@echo "}" >> $@
+$(ms.rez_header): $(ms.rez_manifest) $(ms.this_make_dir)rez_tree.js | $(ms.this_make_dir)node_modules/.ms_stamp
+	@export NODE_PATH=$(ms.node_path) && node $(ms.this_make_dir)rez_tree.js --manifest=$(ms.rez_manifest) --header=$@
 	
 #
 # add all of the resource C++, plus this resource_list.cpp file to the compile list
@@ -809,29 +756,15 @@ ms.additional_sources+=$(ms.rez_files) $(ms.INTERMEDIATE_DIR)/auto_gen/resource_
 
 #################
 
-ms.display_parent_dir=$(if $($(1)_DST_DIR),/resources$($(1)_DST_DIR),/resources)
-
-$(foreach rez,$(sort $(RESOURCES)),$(eval ms.display_rez_fmt_string+=%-40s%s\n))
-$(foreach rez,$(sort $(RESOURCES)),$(eval ms.display_rez_data_string+=$(call ms.display_parent_dir,$(rez))/$(notdir $(rez)) $(rez)))
-
-ms.display_rez_fmt_string:= $(subst $(ms.space),,$(ms.display_rez_fmt_string))
-
 #
 # the 'display_rez' target lets you see what resources are being built into
 # the project, where they will be available in the file system at run time
 # and where the source files come from
 #
 .PHONY: display_rez
-display_rez:
-	@echo ""
-	@echo "List of resource files that will be available to open/fopen"
-	@echo "at runtime, and where their contents come from, relative to"
-	@echo "the current directory:"
-	@echo ""
-	@printf "%-40s%s\n" "Resource File:" "Original File:"
-	@echo "==============                          =============="
-	@printf "$(ms.display_rez_fmt_string)" $(ms.display_rez_data_string)
-	@echo ""
+display_rez: | $(ms.this_make_dir)node_modules/.ms_stamp
+	@export NODE_PATH=$(ms.node_path) && node $(ms.this_make_dir)rez_tree.js --manifest=$(ms.rez_manifest) --display
+
 
 #
 # the case of an empty RESOURCE list, just add the display_rez target
@@ -868,7 +801,8 @@ ms.c_target_list=\
 $(ms.OUT_DIR)/$(CONFIG)/$(1).$(ms.nacl_ext)\
 $(ms.OUT_DIR)/$(CONFIG)/$(1).nmf\
 $(ms.OUT_DIR)/$(CONFIG)/$(1).js\
-$(ms.OUT_DIR)/$(CONFIG)/$(1).js.mem
+$(ms.OUT_DIR)/$(CONFIG)/$(1).js.mem\
+$(foreach pack,$(RESOURCE_PACKS),$(ms.OUT_DIR)/$(CONFIG)/$(pack).msrp)
 
 #
 # the target file we would produce from js6 sources
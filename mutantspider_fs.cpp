@@ -26,151 +26,2715 @@ static void mkdir_p(const std::string& path)
   }
 }
 
+#if defined(MS_HAS_RESOURCES)
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <vector>
+
+// a resource pack (see mutantspider::mount_rez_pack).  Everything here is
+// built when the pack's index is loaded and doesn't change after that, except
+// for the file contents, which are fetched the first time each file is
+// opened or read.  data_ and loading_ are protected by mtx_
+struct rez_pack
+{
+  std::string                                           name_;    // "/<name>"
+  std::string                                           url_;
+  std::vector<mutantspider::rez_file_ent>               files_;
+  std::vector<uint32_t>                                 offsets_; // of each file's data in the pack
+  std::vector<std::vector<unsigned char>>               data_;
+  std::vector<char>                                     loading_;
+  std::deque<std::string>                               strings_; // paths and d_names
+  std::deque<std::vector<mutantspider::rez_dir_ent>>    dir_ents_;
+  std::deque<mutantspider::rez_dir>                     dirs_;
+  std::vector<mutantspider::rez_path_ent>               index_;   // sorted like rez_path_index
+  mutantspider::rez_dir_ent                             root_;
+  std::mutex                                            mtx_;
+  std::condition_variable                               cnd_;
+};
+
+// the mounted packs, and the root directory listing them along with the
+// entries of rez_root_dir.  Mounting a pack replaces these (under
+// rez_packs_mtx) rather than modifying them, and the old ones are never
+// freed, so lookups can use them without taking any lock
+std::atomic<const std::vector<rez_pack*>*>      rez_packs(nullptr);
+std::atomic<const mutantspider::rez_dir_ent*>   rez_root(nullptr);
+std::mutex                                      rez_packs_mtx;
+
+const mutantspider::rez_dir_ent* find_path(const mutantspider::rez_path_ent* begin, size_t num_ents, const char* path)
+{
+  auto end = begin + num_ents;
+  auto it = std::lower_bound(begin, end, path, [](const mutantspider::rez_path_ent& ent, const char* path)
+                                                { return strcmp(ent.path, path) < 0; });
+  if (it != end && !strcmp(it->path, path))
+    return &it->ent;
+  return 0;
+}
+
+// find 'path' (which always starts with a '/') in the table that the
+// makefile generates for us, or in the index of a mounted pack, without
+// allocating anything
+const mutantspider::rez_dir_ent* get_dir_ent(const char* path)
+{
+  if (!strcmp(path, "/")) {
+    auto root = rez_root.load(std::memory_order_acquire);
+    return root ? root : &mutantspider::rez_root_dir_ent;
+  }
+  auto ent = find_path(&mutantspider::rez_path_index[0], mutantspider::rez_path_index_sz, path);
+  if (ent)
+    return ent;
+  auto packs = rez_packs.load(std::memory_order_acquire);
+  if (packs) {
+    for (auto pack : *packs) {
+      auto len = pack->name_.size();
+      if (!strncmp(path, pack->name_.c_str(), len) && (path[len] == 0 || path[len] == '/'))
+        return find_path(&pack->index_[0], pack->index_.size(), path);
+    }
+  }
+  return 0;
+}
+
+// same, but for a full path like "/resources/foo.txt"
+const mutantspider::rez_dir_ent* get_rez_ent(const char* path)
+{
+  static const char rez_mount_name[] = "/resources";
+  const size_t rez_mount_len = sizeof(rez_mount_name) - 1;
+  if (strncmp(path, rez_mount_name, rez_mount_len) != 0 || path[rez_mount_len] != '/')
+    return 0;
+  return get_dir_ent(path + rez_mount_len);
+}
+
+int rez_pack_load(const mutantspider::rez_file_ent* file);
+
+// decode one block in the LZ4 block format (see rez_compress.js) from
+// src[0, src_len) into dst, which it must fill exactly.  Returns false
+// if the block is malformed
+bool lz4_decode(const unsigned char* src, size_t src_len, unsigned char* dst, size_t dst_len)
+{
+  auto s = src;
+  auto s_end = src + src_len;
+  auto d = dst;
+  auto d_end = dst + dst_len;
+  while (s < s_end) {
+    auto token = *s++;
+    size_t len = token >> 4;
+    if (len == 15) {
+      unsigned char b;
+      do {
+        if (s == s_end)
+          return false;
+        len += (b = *s++);
+      } while (b == 255);
+    }
+    if ((size_t)(s_end - s) < len || (size_t)(d_end - d) < len)
+      return false;
+    memcpy(d, s, len);
+    d += len;
+    s += len;
+    
+    // the last sequence is just literals
+    if (s == s_end)
+      break;
+    
+    if (s_end - s < 2)
+      return false;
+    size_t offset = s[0] | (s[1] << 8);
+    s += 2;
+    if (offset == 0 || offset > (size_t)(d - dst))
+      return false;
+    len = token & 15;
+    if (len == 15) {
+      unsigned char b;
+      do {
+        if (s == s_end)
+          return false;
+        len += (b = *s++);
+      } while (b == 255);
+    }
+    len += 4;
+    if ((size_t)(d_end - d) < len)
+      return false;
+    
+    // the match can overlap what it is writing, so byte at a time
+    auto m = d - offset;
+    while (len--)
+      *d++ = *m++;
+  }
+  return d == d_end;
+}
+
+// the last few blocks decompressed by rez_read, so that sequential
+// reads smaller than a block don't decompress it over and over
+struct rez_cached_block
+{
+  const mutantspider::rez_file_ent* file_;
+  size_t                            block_;
+  std::vector<unsigned char>        data_;
+  uint64_t                          used_;
+};
+
+const int                 rez_block_cache_size = 4;
+rez_cached_block          rez_block_cache[rez_block_cache_size];
+uint64_t                  rez_block_cache_clock;
+std::mutex                rez_block_cache_mtx;
+
+size_t rez_block_len(const mutantspider::rez_file_ent* file, size_t block)
+{
+  return std::min(file->block_size, file->file_data_sz - block * file->block_size);
+}
+
+// decompress 'block' of 'file' into dst (which holds rez_block_len bytes)
+bool rez_decode_block(const mutantspider::rez_file_ent* file, size_t block, unsigned char* dst)
+{
+  auto src = &file->file_data[file->block_index[block]];
+  auto src_len = file->block_index[block+1] - file->block_index[block];
+  auto len = rez_block_len(file, block);
+  
+  // blocks that didn't get smaller are stored as-is
+  if (src_len == len) {
+    memcpy(dst, src, len);
+    return true;
+  }
+  if (!lz4_decode(src, src_len, dst, len)) {
+    fprintf(stderr, "corrupt compressed resource block %d\n", (int)block);
+    return false;
+  }
+  return true;
+}
+
+// the uncompressed contents of 'block', either straight out of
+// file_data or from rez_block_cache.  Caller must hold rez_block_cache_mtx
+const unsigned char* rez_get_block(const mutantspider::rez_file_ent* file, size_t block)
+{
+  auto len = rez_block_len(file, block);
+  if (file->block_index[block+1] - file->block_index[block] == len)
+    return &file->file_data[file->block_index[block]];
+  
+  auto oldest = &rez_block_cache[0];
+  for (auto& c : rez_block_cache) {
+    if (c.file_ == file && c.block_ == block) {
+      c.used_ = ++rez_block_cache_clock;
+      return &c.data_[0];
+    }
+    if (c.used_ < oldest->used_)
+      oldest = &c;
+  }
+  oldest->file_ = 0;
+  oldest->data_.resize(len);
+  if (!rez_decode_block(file, block, &oldest->data_[0]))
+    return 0;
+  oldest->file_ = file;
+  oldest->block_ = block;
+  oldest->used_ = ++rez_block_cache_clock;
+  return &oldest->data_[0];
+}
+
+// copy up to 'count' bytes, starting at 'pos', of the uncompressed
+// contents of 'file' into buf, returning the number copied, or a
+// negative errno value -- rez_pack_load's error if the file's pack data
+// can't be had, -EIO if a compressed block is corrupt.  For compressed
+// files only the blocks the read touches are decompressed
+ssize_t rez_read(const mutantspider::rez_file_ent* file, char* buf, size_t count, size_t pos)
+{
+  if (pos >= file->file_data_sz)
+    return 0;
+  auto err = rez_pack_load(file);
+  if (err != 0)
+    return -err;
+  count = std::min(count, file->file_data_sz - pos);
+  if (!file->block_index) {
+    memcpy(buf, &file->file_data[pos], count);
+    return count;
+  }
+  
+  std::lock_guard<std::mutex> lk(rez_block_cache_mtx);
+  size_t done = 0;
+  while (done < count) {
+    auto block = (pos + done) / file->block_size;
+    auto offset = (pos + done) % file->block_size;
+    auto len = rez_block_len(file, block);
+    
+    // whole blocks go straight into buf, without using the cache
+    if (offset == 0 && count - done >= len) {
+      if (!rez_decode_block(file, block, reinterpret_cast<unsigned char*>(buf + done)))
+        return -EIO;
+      done += len;
+      continue;
+    }
+    auto data = rez_get_block(file, block);
+    if (!data)
+      return -EIO;
+    auto n = std::min(count - done, len - offset);
+    memcpy(buf + done, data + offset, n);
+    done += n;
+  }
+  return done;
+}
+
+#if defined(__native_client__)
+
+#include "ppapi/cpp/url_loader.h"
+#include "ppapi/cpp/url_request_info.h"
+#include "ppapi/cpp/url_response_info.h"
+
+// the whole contents of the packs whose server ignored our Range header, by
+// url.  That server sends the whole pack in answer to every request, so it is
+// kept the first time, and the later requests are answered from it
+std::map<std::string, std::shared_ptr<const std::vector<unsigned char>>>  rez_whole_packs;
+std::mutex                                                                rez_whole_packs_mtx;
+
+bool rez_copy_whole(const std::vector<unsigned char>& whole, const std::string& url, uint32_t offset, uint32_t size, unsigned char* dst)
+{
+  if ((uint64_t)offset + size > whole.size()) {
+    fprintf(stderr, "\"%s\" is shorter than its index says\n", url.c_str());
+    return false;
+  }
+  memcpy(dst, whole.data() + offset, size);
+  return true;
+}
+
+// read 'size' bytes, starting at 'offset', of the file at 'url' into dst.
+// This blocks, so it must not be called on the main thread
+bool rez_fetch(const std::string& url, uint32_t offset, uint32_t size, unsigned char* dst)
+{
+  {
+    std::lock_guard<std::mutex> lk(rez_whole_packs_mtx);
+    auto it = rez_whole_packs.find(url);
+    if (it != rez_whole_packs.end())
+      return rez_copy_whole(*it->second, url, offset, size, dst);
+  }
+  
+  pp::URLRequestInfo req(gGlobalPPInstance);
+  req.SetURL(url);
+  req.SetMethod("GET");
+  std::ostringstream range;
+  range << "Range: bytes=" << offset << "-" << (offset + size - 1);
+  req.SetHeaders(range.str());
+  
+  pp::URLLoader loader(gGlobalPPInstance);
+  int32_t ret;
+  if ((ret = loader.Open(req, pp::BlockUntilComplete())) != PP_OK) {
+    fprintf(stderr, "URLLoader::Open(\"%s\") failed with error: %d\n", url.c_str(), (int)ret);
+    return false;
+  }
+  
+  auto status = loader.GetResponseInfo().GetStatusCode();
+  if (status != 200 && status != 206) {
+    fprintf(stderr, "fetching \"%s\" failed with http status: %d\n", url.c_str(), (int)status);
+    return false;
+  }
+  if (status == 200) {
+    auto whole = std::make_shared<std::vector<unsigned char>>();
+    std::vector<unsigned char> buf(65536);
+    while ((ret = loader.ReadResponseBody(&buf[0], (int32_t)buf.size(), pp::BlockUntilComplete())) > 0)
+      whole->insert(whole->end(), buf.begin(), buf.begin() + ret);
+    if (ret < 0) {
+      fprintf(stderr, "reading \"%s\" failed with error: %d\n", url.c_str(), (int)ret);
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lk(rez_whole_packs_mtx);
+      rez_whole_packs[url] = whole;
+    }
+    return rez_copy_whole(*whole, url, offset, size, dst);
+  }
+  
+  uint32_t done = 0;
+  while (done < size) {
+    ret = loader.ReadResponseBody(dst + done, size - done, pp::BlockUntilComplete());
+    if (ret <= 0) {
+      fprintf(stderr, "reading \"%s\" failed with error: %d\n", url.c_str(), (int)ret);
+      return false;
+    }
+    done += ret;
+  }
+  return true;
+}
+
+#else
+
+// only possible in node, where the pack is a local file (see ms_rez_fetch_sync_js)
+bool rez_fetch(const std::string& url, uint32_t offset, uint32_t size, unsigned char* dst)
+{
+  return ms_rez_fetch_js(url.c_str(), (int)offset, (int)size, dst) != 0;
+}
+
+// asm.js code can't wait for a download, so the browser fetches with
+// ms_rez_fetch_async_js, which calls exec() once 'data_' has been filled in
+struct rez_fetch_req : public ms_callback_base
+{
+  std::vector<unsigned char>                              data_;
+  int                                                     ok_;
+  std::function<void(std::vector<unsigned char>&, bool)>  done_;
+  
+  virtual void exec() { done_(data_, ok_ != 0); }
+};
+
+void rez_fetch_async(const std::string& url, uint32_t offset, uint32_t size,
+                     std::function<void(std::vector<unsigned char>&, bool)> done)
+{
+  auto req = new rez_fetch_req;
+  req->data_.resize(size);
+  req->ok_ = 0;
+  req->done_ = std::move(done);
+  ms_rez_fetch_async_js(url.c_str(), (int)offset, (int)size, req->data_.data(), &req->ok_, req);
+}
+
+#endif
+
+// the pack that 'file' belongs to, or null
+rez_pack* rez_file_pack(const mutantspider::rez_file_ent* file)
+{
+  auto packs = rez_packs.load(std::memory_order_acquire);
+  if (packs) {
+    for (auto pack : *packs) {
+      if (!pack->files_.empty() && file >= &pack->files_[0] && file < &pack->files_[0] + pack->files_.size())
+        return pack;
+    }
+  }
+  return 0;
+}
+
+// make sure 'file' has its contents, fetching them if it belongs to a pack
+// and hasn't been fetched yet.  Returns 0, or an errno value.  nacl builds
+// can't wait for the network on the main thread, and asm.js builds running
+// in a browser can't wait for it at all, so there this fails with
+// EWOULDBLOCK unless the file has already been fetched (see prefetch_rez)
+int rez_pack_load(const mutantspider::rez_file_ent* file)
+{
+  auto pack = rez_file_pack(file);
+  if (pack) {
+    auto i = file - &pack->files_[0];
+    std::unique_lock<std::mutex> lk(pack->mtx_);
+    #if defined(__native_client__)
+      while (pack->loading_[i])
+        pack->cnd_.wait(lk);
+    #endif
+    if (file->file_data || file->file_data_sz == 0)
+      return 0;
+    #if defined(__native_client__)
+      if (pp::Module::Get()->core()->IsMainThread())
+        return EWOULDBLOCK;
+    #else
+      // node reads the pack synchronously, even while a prefetch of
+      // the same file is under way (which then finds it already done)
+      if (!ms_rez_fetch_sync_js())
+        return EWOULDBLOCK;
+    #endif
+    pack->loading_[i] = 1;
+    lk.unlock();
+    
+    std::vector<unsigned char> data(file->file_data_sz);
+    auto ok = rez_fetch(pack->url_, pack->offsets_[i], (uint32_t)data.size(), &data[0]);
+    
+    lk.lock();
+    pack->loading_[i] = 0;
+    if (ok) {
+      pack->data_[i].swap(data);
+      pack->files_[i].file_data = &pack->data_[i][0];
+    }
+    pack->cnd_.notify_all();
+    return ok ? 0 : EIO;
+  }
+  return 0;
+}
+
+uint32_t get_le32(const unsigned char* p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// add the rez_dir for 'dir' (a path within the pack, "" for its root) and
+// everything below it to 'pack', returning it.  'children' lists the names
+// in each directory and 'file_of' maps file paths to their index in files_
+const mutantspider::rez_dir* build_pack_dir(rez_pack* pack, const std::string& dir,
+                                            const std::map<std::string, std::set<std::string>>& children,
+                                            const std::map<std::string, size_t>& file_of)
+{
+  std::vector<mutantspider::rez_dir_ent> ents;
+  for (auto& name : children.at(dir)) {
+    auto path = dir + "/" + name;
+    pack->strings_.push_back(name);
+    mutantspider::rez_dir_ent ent;
+    ent.d_name = pack->strings_.back().c_str();
+    auto f = file_of.find(path);
+    if (f != file_of.end()) {
+      ent.ptr.file = &pack->files_[f->second];
+      ent.is_dir = 0;
+    } else {
+      ent.ptr.dir = build_pack_dir(pack, path, children, file_of);
+      ent.is_dir = 1;
+    }
+    ents.push_back(ent);
+    pack->strings_.push_back(pack->name_ + path);
+    pack->index_.push_back(mutantspider::rez_path_ent{pack->strings_.back().c_str(), ent});
+  }
+  pack->dir_ents_.push_back(std::move(ents));
+  auto& dir_ents = pack->dir_ents_.back();
+  pack->dirs_.push_back(mutantspider::rez_dir{dir_ents.size(), dir_ents.empty() ? 0 : &dir_ents[0]});
+  return &pack->dirs_.back();
+}
+
+// the pack file at 'url' (written by rez_pack.js) starts with this header,
+// followed by the index
+const uint32_t rez_pack_hdr_size = 12;
+
+bool rez_pack_name_ok(const std::string& name)
+{
+  if (name.empty() || name.find('/') != std::string::npos || get_dir_ent(("/" + name).c_str())) {
+    fprintf(stderr, "can't mount resource pack \"%s\", bad name or already exists\n", name.c_str());
+    return false;
+  }
+  return true;
+}
+
+// check the header, and return the size of the index that follows it, or 0
+uint32_t rez_pack_index_size(const std::string& url, const unsigned char* hdr)
+{
+  if (memcmp(&hdr[0], "MSRP", 4) != 0 || get_le32(&hdr[4]) != 1) {
+    fprintf(stderr, "\"%s\" is not a resource pack\n", url.c_str());
+    return 0;
+  }
+  auto size = get_le32(&hdr[8]);
+  if (size < 4) {
+    fprintf(stderr, "resource pack \"%s\" has a corrupt index\n", url.c_str());
+    return 0;
+  }
+  return size;
+}
+
+// parse the pack's 'index', and make its files visible in /resources/<name>
+bool add_rez_pack(const std::string& name, const std::string& url, const std::vector<unsigned char>& index)
+{
+  if (!rez_pack_name_ok(name))
+    return false;
+  
+  auto pack = new rez_pack;
+  pack->name_ = "/" + name;
+  pack->url_ = url;
+  auto num_files = get_le32(&index[0]);
+  pack->files_.reserve(num_files);
+  std::map<std::string, std::set<std::string>> children;
+  std::map<std::string, size_t> file_of;
+  children[""];
+  size_t pos = 4;
+  for (uint32_t i = 0; i < num_files; i++) {
+    if (pos + 10 > index.size() || pos + 10 + (index[pos+8] | (index[pos+9] << 8)) > index.size()) {
+      fprintf(stderr, "resource pack \"%s\" has a corrupt index\n", url.c_str());
+      delete pack;
+      return false;
+    }
+    auto offset = get_le32(&index[pos]);
+    auto size = get_le32(&index[pos+4]);
+    std::string path((const char*)&index[pos+10], index[pos+8] | (index[pos+9] << 8));
+    pos += 10 + path.size();
+    
+    file_of[path] = pack->files_.size();
+    pack->files_.push_back(mutantspider::rez_file_ent{0, size, 0, 0});
+    pack->offsets_.push_back(offset);
+    for (auto slash = path.rfind('/'); slash != std::string::npos; slash = path.rfind('/', slash - 1)) {
+      children[path.substr(0, slash)].insert(path.substr(slash + 1, path.find('/', slash + 1) - slash - 1));
+      if (slash == 0)
+        break;
+    }
+  }
+  pack->data_.resize(num_files);
+  pack->loading_.resize(num_files);
+  
+  pack->root_.d_name = pack->name_.c_str() + 1;
+  pack->root_.ptr.dir = build_pack_dir(pack, "", children, file_of);
+  pack->root_.is_dir = 1;
+  pack->index_.push_back(mutantspider::rez_path_ent{pack->name_.c_str(), pack->root_});
+  std::sort(pack->index_.begin(), pack->index_.end(), [](const mutantspider::rez_path_ent& a, const mutantspider::rez_path_ent& b)
+                                                      { return strcmp(a.path, b.path) < 0; });
+  
+  // publish the new pack list and root directory
+  {
+    std::lock_guard<std::mutex> lk(rez_packs_mtx);
+    auto old_packs = rez_packs.load();
+    auto packs = old_packs ? new std::vector<rez_pack*>(*old_packs) : new std::vector<rez_pack*>();
+    packs->push_back(pack);
+    
+    auto root_dir = get_dir_ent("/")->ptr.dir;
+    auto ents = new mutantspider::rez_dir_ent[root_dir->num_ents + 1];
+    std::copy(root_dir->ents, root_dir->ents + root_dir->num_ents, ents);
+    ents[root_dir->num_ents] = pack->root_;
+    
+    // kept in strcmp order, like every other rez_dir, so REZFS.node_ops.lookup
+    // (library_rezfs.js) can binary search it
+    std::sort(ents, ents + root_dir->num_ents + 1, [](const mutantspider::rez_dir_ent& a, const mutantspider::rez_dir_ent& b)
+                                                    { return strcmp(a.d_name, b.d_name) < 0; });
+    auto root = new mutantspider::rez_dir_ent(mutantspider::rez_root_dir_ent);
+    root->ptr.dir = new mutantspider::rez_dir{root_dir->num_ents + 1, ents};
+    
+    rez_packs.store(packs, std::memory_order_release);
+    rez_root.store(root, std::memory_order_release);
+  }
+  
+  #if defined(EMSCRIPTEN)
+    ms_rez_set_root_js(get_dir_ent("/")->ptr.dir);
+  #endif
+  return true;
+}
+
+#if defined(__native_client__)
+
+// fetch the header and index of the pack at 'url', and add it.  This
+// blocks, so it must not be called on the main thread
+bool load_rez_pack(const std::string& name, const std::string& url)
+{
+  if (!rez_pack_name_ok(name))
+    return false;
+  unsigned char hdr[rez_pack_hdr_size];
+  if (!rez_fetch(url, 0, sizeof(hdr), &hdr[0]))
+    return false;
+  std::vector<unsigned char> index(rez_pack_index_size(url, &hdr[0]));
+  if (index.empty() || !rez_fetch(url, sizeof(hdr), (uint32_t)index.size(), &index[0]))
+    return false;
+  return add_rez_pack(name, url, index);
+}
+
+void prefetch_rez_files(const std::vector<std::string>& paths)
+{
+  for (auto& path : paths) {
+    auto ent = get_rez_ent(path.c_str());
+    if (ent && !ent->is_dir)
+      rez_pack_load(ent->ptr.file);
+  }
+}
+
+#else
+
+// the same thing, without blocking, calling 'callback' with the result
+void load_rez_pack(const std::string& name, const std::string& url, std::function<void(bool)> callback)
+{
+  if (!rez_pack_name_ok(name)) {
+    ms_timed_callback(0, callback, false);
+    return;
+  }
+  rez_fetch_async(url, 0, rez_pack_hdr_size, [name, url, callback](std::vector<unsigned char>& hdr, bool ok)
+                  {
+                    uint32_t size = ok ? rez_pack_index_size(url, &hdr[0]) : 0;
+                    if (size == 0) {
+                      callback(false);
+                      return;
+                    }
+                    rez_fetch_async(url, rez_pack_hdr_size, size, [name, url, callback](std::vector<unsigned char>& index, bool ok)
+                                    {
+                                      callback(ok && add_rez_pack(name, url, index));
+                                    });
+                  });
+}
+
+// start fetching each of the files that isn't already in memory, and call
+// 'callback' once they have all finished.  Everything here runs on the one
+// asm.js thread, so loading_ doesn't need pack->mtx_
+void prefetch_rez_files(const std::vector<std::string>& paths, std::function<void()> callback)
+{
+  // one for each fetch, plus one until they have all been started
+  auto outstanding = std::make_shared<int>(1);
+  auto finished = [outstanding, callback]
+                  {
+                    if (--*outstanding == 0 && callback)
+                      callback();
+                  };
+  for (auto& path : paths) {
+    auto ent = get_rez_ent(path.c_str());
+    auto pack = ent && !ent->is_dir ? rez_file_pack(ent->ptr.file) : 0;
+    if (!pack)
+      continue;
+    auto i = ent->ptr.file - &pack->files_[0];
+    if (pack->files_[i].file_data || pack->files_[i].file_data_sz == 0 || pack->loading_[i])
+      continue;
+    pack->loading_[i] = 1;
+    ++*outstanding;
+    rez_fetch_async(pack->url_, pack->offsets_[i], (uint32_t)pack->files_[i].file_data_sz,
+                    [pack, i, finished](std::vector<unsigned char>& data, bool ok)
+                    {
+                      pack->loading_[i] = 0;
+                      if (ok && !pack->files_[i].file_data) {
+                        pack->data_[i].swap(data);
+                        pack->files_[i].file_data = &pack->data_[i][0];
+                      }
+                      finished();
+                    });
+  }
+  ms_timed_callback(0, finished);
+}
+
+#endif
+
+#if defined(EMSCRIPTEN)
+// called by REZFS.stream_ops.open (library_rezfs.js) for files in resource
+// packs that haven't been fetched yet.  Returns 0, or an errno value
+extern "C" int MS_RezOpen(const mutantspider::rez_file_ent* file)
+{
+  return rez_pack_load(file);
+}
+
+// called by REZFS.stream_ops.read (library_rezfs.js) for compressed files
+// and for files in resource packs.  Returns the number of bytes read, or a
+// negative errno value
+extern "C" int MS_RezRead(const mutantspider::rez_file_ent* file, char* buf, int count, int pos)
+{
+  return (int)rez_read(file, buf, (size_t)count, (size_t)pos);
+}
+#endif
+
+namespace mutantspider
+{
+
+void mount_rez_pack(const std::string& name, const std::string& url, std::function<void(bool)> callback)
+{
+  #if defined(__native_client__)
+    std::thread([name, url, callback]
+                {
+                  auto ok = load_rez_pack(name, url);
+                  ms_on_main_thread([callback, ok]{ callback(ok); });
+                }).detach();
+  #else
+    load_rez_pack(name, url, callback);
+  #endif
+}
+
+void prefetch_rez(const std::vector<std::string>& paths, std::function<void()> callback)
+{
+  #if defined(__native_client__)
+    std::thread([paths, callback]
+                {
+                  prefetch_rez_files(paths);
+                  if (callback)
+                    ms_on_main_thread([callback]{ callback(); });
+                }).detach();
+  #else
+    prefetch_rez_files(paths, callback);
+  #endif
+}
+
+const unsigned char* rez_map(const char* path, size_t* size)
+{
+  auto ent = get_rez_ent(path);
+  if (!ent || ent->is_dir)
+    return 0;
+  auto file = ent->ptr.file;
+  if (size)
+    *size = file->file_data_sz;
+  if (rez_pack_load(file) != 0)
+    return 0;
+  if (!file->block_index)
+    return file->file_data;
+  
+  static std::map<const rez_file_ent*, std::vector<unsigned char>> decompressed;
+  static std::mutex decompressed_mtx;
+  std::lock_guard<std::mutex> lk(decompressed_mtx);
+  auto& data = decompressed[file];
+  if (data.empty() && file->file_data_sz != 0) {
+    data.resize(file->file_data_sz);
+    if (rez_read(file, (char*)&data[0], data.size(), 0) != (ssize_t)data.size()) {
+      decompressed.erase(file);
+      return 0;
+    }
+  }
+  return data.empty() ? file->file_data : &data[0];
+}
+
+}
+
+#endif
+
+#if !defined(MS_NO_FS_STATS)
+
+// the contents of /.ms/stats
+static std::string fs_stats_text()
+{
+  auto st = mutantspider::fs_stats();
+  std::ostringstream out;
+  out << "queue tasks_queued=" << st.queue.tasks_queued << " depth=" << st.queue.depth
+      << " peak_depth=" << st.queue.peak_depth << " enqueue_ns_total=" << st.queue.enqueue_ns_total
+      << " enqueue_ns_max=" << st.queue.enqueue_ns_max << " queued_bytes=" << st.queue.queued_bytes
+      << " queued_bytes_peak=" << st.queue.queued_bytes_peak << " queue_limit_waits=" << st.queue.queue_limit_waits
+      << " mirror_lag_ns=" << st.mirror_lag_ns << "\n";
+  if (st.queue.commits != 0)
+    out << "commits count=" << st.queue.commits << " entries=" << st.queue.commit_entries
+        << " bytes=" << st.queue.commit_bytes << " ns_total=" << st.queue.commit_ns_total
+        << " ns_max=" << st.queue.commit_ns_max << "\n";
+  for (auto& o : st.ops) {
+    if (o.calls == 0)
+      continue;
+    out << o.name << " calls=" << o.calls << " errors=" << o.errors << " bytes=" << o.bytes
+        << " ns_total=" << o.ns_total << " ns_max=" << o.ns_max << " latency=";
+    for (int b = 0; b < mutantspider::fs_latency_buckets; b++)
+      out << (b ? "," : "") << o.latency[b];
+    out << "\n";
+  }
+  return out.str();
+}
+
+#if defined(EMSCRIPTEN)
+// called by the js code that implements /.ms/stats
+extern "C" const char* MS_FsStatsText()
+{
+  static std::string text;
+  text = fs_stats_text();
+  return text.c_str();
+}
+#endif
+
+#endif
+
 #if defined(__native_client__)
 
 #include "ppapi/cpp/instance.h"
 #include "ppapi/cpp/module.h"
 
-#include <sys/mount.h>
-#include <nacl_io/nacl_io.h>
-#include <nacl_io/fuse.h>
-#include <future>
-#include <list>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/time.h>
-#include <ppapi/c/pp_macros.h>
+#include <sys/mount.h>
+#include <nacl_io/nacl_io.h>
+#include <nacl_io/fuse.h>
+#include <future>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <set>
+#include <list>
+#include <algorithm>
+#include <shared_mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <ppapi/c/pp_macros.h>
+
+namespace {
+
+// where we mount the html5fs file system
+std::string html5_shadow_name = "/.html5fs_shadow";
+
+// the file data itself for /persistent is actually mounted here.
+// our fuse-based code supporting the /persistent directory is a
+// redirect to this location, and then a background thread mirrors
+// everything to /.html5fs_shadow
+std::string mem_shadow_name = "/.memfs_shadow";
+
+// the number of task records in pbmemfs_ring.  Must be a power of 2
+const size_t pbmemfs_ring_size = 1024;
+
+// one slot in pbmemfs_ring.  bkg_call constructs its bound function
+// object directly in args_, so queuing a task never allocates.  seq_
+// is the slot's sequence number, used to coordinate the (possibly
+// many) threads calling bkg_call with the single pbmemfs_worker thread.
+// A slot is free for the producer claiming position 'pos' when
+// seq_ == pos, and holds a task ready for the worker when seq_ == pos + 1.
+struct pbmemfs_task
+{
+  std::atomic<size_t>                       seq_;
+  std::atomic<uint64_t>                     queued_ns_;   // see mirror_lag_ns
+  void                                      (*run_)(void*);
+  std::aligned_storage<120>::type           args_;
+};
+
+// data structures we use to coordinate tasks on the background thread
+pbmemfs_task                                pbmemfs_ring[pbmemfs_ring_size];
+std::atomic<size_t>                         pbmemfs_enqueue_pos(0);
+std::atomic<size_t>                         pbmemfs_dequeue_pos(0);
+std::atomic<bool>                           pbmemfs_sleeping(false);
+std::atomic<int>                            pbmemfs_full_waiters(0);
+std::mutex                                  pbmemfs_mtx;
+std::condition_variable                     pbmemfs_cnd;
+std::condition_variable                     pbmemfs_space_cnd;
+
+// counters reported by mutantspider::get_persist_queue_stats
+std::atomic<uint64_t>                       pbmemfs_tasks_queued(0);
+std::atomic<uint64_t>                       pbmemfs_enqueue_ns_total(0);
+std::atomic<uint64_t>                       pbmemfs_enqueue_ns_max(0);
+std::atomic<size_t>                         pbmemfs_peak_depth(0);
+
+uint64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// store 'val' in 'mx' if it is larger than what is currently there
+template<typename T>
+void atomic_max(std::atomic<T>& mx, T val)
+{
+  T cur = mx.load(std::memory_order_relaxed);
+  while (cur < val && !mx.compare_exchange_weak(cur, val, std::memory_order_relaxed))
+    ;
+}
+
+#if !defined(MS_NO_FS_STATS)
+
+// every fuse callback that is instrumented.  Each one gets an fs_op_<name>
+// index into fs_op_counters, and MS_TIMED(<name>) is what goes in its
+// fuse_operations table
+#define MS_FS_OPS(X) \
+  X(pbmemfs_access) X(pbmemfs_create) X(pbmemfs_fgetattr) X(pbmemfs_fsync) \
+  X(pbmemfs_ftruncate) X(pbmemfs_getattr) X(pbmemfs_mkdir) X(pbmemfs_open) \
+  X(pbmemfs_opendir) X(pbmemfs_read) X(pbmemfs_readdir) X(pbmemfs_release) \
+  X(pbmemfs_releasedir) X(pbmemfs_rename) X(pbmemfs_utimens) X(pbmemfs_chmod) \
+  X(pbmemfs_rmdir) X(pbmemfs_truncate) X(pbmemfs_unlink) X(pbmemfs_write) \
+  X(rezfs_access) X(rezfs_create) X(rezfs_fgetattr) X(rezfs_fsync) \
+  X(rezfs_ftruncate) X(rezfs_getattr) X(rezfs_mkdir) X(rezfs_open) \
+  X(rezfs_opendir) X(rezfs_read) X(rezfs_readdir) X(rezfs_release) \
+  X(rezfs_releasedir) X(rezfs_rename) X(rezfs_utimens) X(rezfs_chmod) \
+  X(rezfs_rmdir) X(rezfs_truncate) X(rezfs_unlink) X(rezfs_write)
+
+enum fs_op
+{
+  #define MS_FS_OP_ENUM(_name) fs_op_##_name,
+  MS_FS_OPS(MS_FS_OP_ENUM)
+  #undef MS_FS_OP_ENUM
+  fs_op_count
+};
+
+const char* fs_op_names[fs_op_count] = {
+  #define MS_FS_OP_NAME(_name) #_name,
+  MS_FS_OPS(MS_FS_OP_NAME)
+  #undef MS_FS_OP_NAME
+};
+
+// the ops whose (positive) return value is a number of bytes
+constexpr bool fs_op_counts_bytes(int op)
+{
+  return op == fs_op_pbmemfs_read || op == fs_op_pbmemfs_write
+          || op == fs_op_rezfs_read || op == fs_op_rezfs_write;
+}
+
+struct fs_op_counters
+{
+  std::atomic<uint64_t> calls_;
+  std::atomic<uint64_t> errors_;
+  std::atomic<uint64_t> bytes_;
+  std::atomic<uint64_t> ns_total_;
+  std::atomic<uint64_t> ns_max_;
+  std::atomic<uint64_t> latency_[mutantspider::fs_latency_buckets];
+};
+
+fs_op_counters fs_counters[fs_op_count];
+
+// which latency_ bucket a call that took 'ns' goes in (see mutantspider::fs_op_stats)
+int fs_latency_bucket(uint64_t ns)
+{
+  int b = 0;
+  for (auto us = ns / 1000; us != 0 && b < mutantspider::fs_latency_buckets - 1; us >>= 1)
+    ++b;
+  return b;
+}
+
+void count_fs_op(int op, int ret, uint64_t ns)
+{
+  auto& c = fs_counters[op];
+  c.calls_.fetch_add(1, std::memory_order_relaxed);
+  if (ret < 0)
+    c.errors_.fetch_add(1, std::memory_order_relaxed);
+  else if (fs_op_counts_bytes(op))
+    c.bytes_.fetch_add(ret, std::memory_order_relaxed);
+  c.ns_total_.fetch_add(ns, std::memory_order_relaxed);
+  atomic_max(c.ns_max_, ns);
+  c.latency_[fs_latency_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+// timed_op<op, decltype(&f), &f>::call has the same signature as the fuse
+// callback 'f', and calls it, counting the call in fs_counters[op]
+template<int Op, typename F, F f>
+struct timed_op;
+
+template<int Op, typename... Args, int (*f)(Args...)>
+struct timed_op<Op, int (*)(Args...), f>
+{
+  static int call(Args... args)
+  {
+    auto start = now_ns();
+    auto ret = f(args...);
+    count_fs_op(Op, ret, now_ns() - start);
+    return ret;
+  }
+};
+
+#define MS_TIMED(_name) timed_op<fs_op_##_name, decltype(&_name), &_name>::call
+
+#else
+
+#define MS_TIMED(_name) _name
+
+#endif
+
+// must be called once, before any call to bkg_call
+void init_pbmemfs_ring()
+{
+  for (size_t i = 0; i < pbmemfs_ring_size; i++)
+    pbmemfs_ring[i].seq_.store(i, std::memory_order_relaxed);
+}
+
+// is the slot at the worker's current read position ready to run?
+bool pbmemfs_task_ready()
+{
+  auto pos = pbmemfs_dequeue_pos.load(std::memory_order_relaxed);
+  return pbmemfs_ring[pos & (pbmemfs_ring_size-1)].seq_.load(std::memory_order_acquire) == pos + 1;
+}
+
+// run every task that is currently ready, in order.  Returns false
+// if there wasn't anything to run.
+bool pbmemfs_drain()
+{
+  auto pos = pbmemfs_dequeue_pos.load(std::memory_order_relaxed);
+  auto start = pos;
+  while (true) {
+    auto& task = pbmemfs_ring[pos & (pbmemfs_ring_size-1)];
+    if (task.seq_.load(std::memory_order_acquire) != pos + 1)
+      break;
+    task.run_(&task.args_);
+    task.seq_.store(pos + pbmemfs_ring_size, std::memory_order_release);
+    pbmemfs_dequeue_pos.store(++pos, std::memory_order_relaxed);
+    
+    // let any producer that found the ring full know there is room now
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pbmemfs_full_waiters.load() != 0) {
+      std::lock_guard<std::mutex> lk(pbmemfs_mtx);
+      pbmemfs_space_cnd.notify_all();
+    }
+  }
+  return pos != start;
+}
+
+// number of open files that currently have written data that
+// hasn't been copied to /.html5fs_shadow yet, and how long (in
+// milliseconds) such data is allowed to wait before the worker
+// copies it on its own (see mutantspider::set_persist_flush_interval)
+std::atomic<int>                            pbmemfs_dirty_files(0);
+std::atomic<int>                            pbmemfs_flush_interval_ms(500);
+
+// see mutantspider::set_persist_journal and journal_record
+std::atomic<bool>                           pbmemfs_journal(false);
+
+// bytes written to /persistent (plus journal records) that haven't been
+// copied out yet, and the limit set by mutantspider::set_persist_queue_limit.
+// Writers that hit the limit with persist_queue_block wait on pbmemfs_queue_cnd
+std::atomic<size_t>                         pbmemfs_queued_bytes(0);
+std::atomic<size_t>                         pbmemfs_queued_bytes_peak(0);
+std::atomic<size_t>                         pbmemfs_queue_limit(0);
+std::atomic<int>                            pbmemfs_queue_policy(mutantspider::persist_queue_block);
+std::atomic<uint64_t>                       pbmemfs_queue_limit_waits(0);
+std::atomic<bool>                           pbmemfs_flush_all_queued(false);
+std::atomic<int>                            pbmemfs_queue_waiters(0);
+std::mutex                                  pbmemfs_queue_mtx;
+std::condition_variable                     pbmemfs_queue_cnd;
+
+// account for something that was queued for copying having grown from
+// 'before' to 'after' bytes, waking any blocked writers once the total
+// drops back under the limit
+void count_queued_bytes(size_t before, size_t after)
+{
+  if (after > before) {
+    auto total = pbmemfs_queued_bytes.fetch_add(after - before) + (after - before);
+    atomic_max(pbmemfs_queued_bytes_peak, total);
+  } else if (after < before) {
+    auto total = pbmemfs_queued_bytes.fetch_sub(before - after) - (before - after);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (pbmemfs_queue_waiters.load() != 0 && total < pbmemfs_queue_limit.load()) {
+      std::lock_guard<std::mutex> lk(pbmemfs_queue_mtx);
+      pbmemfs_queue_cnd.notify_all();
+    }
+  }
+}
+
+void flush_expired_files();
+void journal_idle();
+void evict_cold_files();
+extern std::atomic<bool> pbmemfs_evict_wanted;
+
+// wake pbmemfs_worker if it is sleeping.  Callers must have already
+// published whatever it is they want the worker to see.
+void pbmemfs_wake_worker()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (pbmemfs_sleeping.load()) {
+    std::lock_guard<std::mutex> lk(pbmemfs_mtx);
+    pbmemfs_cnd.notify_one();
+  }
+}
+
+// thread proc that runs forever, waiting for new "tasks"
+// to show up in pbmemfs_ring.  It executes them in batches
+// and only sleeps when the ring is empty.  While any open
+// file has unflushed writes it also wakes up periodically
+// to flush the ones that have waited too long.
+void pbmemfs_worker()
+{
+  while (true) {
+    if (pbmemfs_drain()) {
+      flush_expired_files();
+      continue;
+    }
+    
+    if (pbmemfs_journal.load()) {
+      journal_idle();
+      if (pbmemfs_task_ready())
+        continue;
+    }
+    if (pbmemfs_evict_wanted.exchange(false)) {
+      evict_cold_files();
+      continue;
+    }
+    
+    // announce that we are going to sleep, and then check one more time
+    // so that a producer who published a task just before seeing
+    // pbmemfs_sleeping set doesn't get lost (see pbmemfs_wake_worker)
+    {
+      std::unique_lock<std::mutex> lk(pbmemfs_mtx);
+      pbmemfs_sleeping.store(true);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (!pbmemfs_task_ready() && !pbmemfs_evict_wanted.load()) {
+        auto interval = pbmemfs_flush_interval_ms.load();
+        if (pbmemfs_dirty_files.load() == 0 || interval <= 0)
+          pbmemfs_cnd.wait(lk);
+        else if (pbmemfs_cnd.wait_for(lk, std::chrono::milliseconds(interval)) == std::cv_status::timeout)
+          break;
+      }
+      pbmemfs_sleeping.store(false);
+    }
+    flush_expired_files();
+  }
+}
+
+// claim the next free slot in pbmemfs_ring, waiting for the worker to
+// make room if the ring is currently full.  Returns the slot and sets
+// 'pos' to the sequence number the caller must publish it with.
+pbmemfs_task* pbmemfs_claim_task(size_t& pos)
+{
+  pos = pbmemfs_enqueue_pos.load(std::memory_order_relaxed);
+  while (true) {
+    auto task = &pbmemfs_ring[pos & (pbmemfs_ring_size-1)];
+    auto seq = task->seq_.load(std::memory_order_acquire);
+    auto dif = (intptr_t)seq - (intptr_t)pos;
+    if (dif == 0) {
+      if (pbmemfs_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        return task;
+    } else if (dif < 0) {
+      // the ring is full
+      std::unique_lock<std::mutex> lk(pbmemfs_mtx);
+      ++pbmemfs_full_waiters;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      while (task->seq_.load(std::memory_order_acquire) != pos)
+        pbmemfs_space_cnd.wait(lk);
+      --pbmemfs_full_waiters;
+      pos = pbmemfs_enqueue_pos.load(std::memory_order_relaxed);
+    } else
+      pos = pbmemfs_enqueue_pos.load(std::memory_order_relaxed);
+  }
+}
+
+// make a claimed slot visible to the worker and wake it if it is asleep
+void pbmemfs_publish_task(pbmemfs_task* task, size_t pos, uint64_t start_ns)
+{
+  task->queued_ns_.store(start_ns, std::memory_order_relaxed);
+  task->seq_.store(pos + 1, std::memory_order_release);
+  pbmemfs_wake_worker();
+  
+  auto elapsed = now_ns() - start_ns;
+  ++pbmemfs_tasks_queued;
+  pbmemfs_enqueue_ns_total += elapsed;
+  atomic_max(pbmemfs_enqueue_ns_max, elapsed);
+  atomic_max(pbmemfs_peak_depth, pos + 1 - pbmemfs_dequeue_pos.load(std::memory_order_relaxed));
+}
+
+// given an arbitrary callable function 'f', along with an arbitrary
+// list of (copyable) arguments, add a task that will execute
+// "f(args...)", to pbmemfs_ring and then signal pbmemfs_worker
+// to pick up and execute that task.
+//
+// for example:
+//
+//    bkg_call(foo,100,j);
+//
+// causes "foo(100,j)" to execute in the background thread
+//
+template<typename F, typename ...Args>
+void bkg_call(F&& f, Args&&... args)
+{
+  auto start_ns = now_ns();
+  auto b = std::bind(f, std::forward<Args>(args)...);
+  using function_type = decltype(b);
+  static_assert(sizeof(function_type) <= sizeof(pbmemfs_task::args_), "bkg_call arguments too large to fit in a pbmemfs_task");
+  
+  size_t pos;
+  auto task = pbmemfs_claim_task(pos);
+  new (&task->args_) function_type(std::move(b));
+  task->run_ = [] (void* _f)
+    {
+      function_type* f = static_cast<function_type*>(_f);
+      (*f)();
+      f->~function_type();
+    };
+  pbmemfs_publish_task(task, pos, start_ns);
+}
+
+// simple data structure for when we need to keep track
+// of both the file descriptor in /.memfs_shadow as well
+// as the one in /.html5fs_shadow.  Writes are made to the
+// memfs file immediately, but only the byte ranges they
+// touched are recorded here (in dirty_).  Those ranges are
+// merged as they come in and copied from the memfs file to
+// the html5fs file later by flush_file_ref.
+struct file_ref
+{
+  int	memfs_fd_;
+  int html5fs_fd_;
+  int flags_;
+  
+  // mutable state below is guarded by mtx_.  path_ is the
+  // path (within /persistent) that the file currently has
+  std::mutex              mtx_;
+  std::string             path_;
+  std::map<off_t, off_t>  dirty_;           // start offset -> end offset, never overlapping or touching
+  size_t                  dirty_bytes_;
+  uint64_t                dirty_since_ns_;  // when dirty_ last became non-empty
+  bool                    flush_queued_;
+  bool                    unlinked_;
+  
+  // ordering with respect to pbmemfs_op_seq, see unlink_open_files
+  uint64_t                opened_seq_;
+    
+  file_ref(int memfs_fd, int flags, const std::string& path, uint64_t opened_seq)
+    : memfs_fd_(memfs_fd),
+      html5fs_fd_(-1),
+      flags_(flags),
+      path_(path),
+      dirty_bytes_(0),
+      dirty_since_ns_(0),
+      flush_queued_(false),
+      unlinked_(false),
+      opened_seq_(opened_seq)
+  {}
+};
+
+// every file_ref that has been created by set_fh, but not yet
+// released.  file_ref's are only ever deleted on pbmemfs_worker,
+// so that thread can safely use any pointer it finds in here
+// even after releasing pbmemfs_files_mtx.
+std::set<file_ref*>   pbmemfs_files;
+std::mutex            pbmemfs_files_mtx;
+
+// incremented each time a file is opened, renamed or unlinked
+std::atomic<uint64_t> pbmemfs_op_seq(0);
+
+// once a file has this many unflushed bytes we queue a flush
+// without waiting for release/fsync or the flush interval
+const size_t pbmemfs_flush_bytes = 1024 * 1024;
+
+// When mounted with mutantspider::set_persist_journal(true), changes made in
+// /persistent are not mirrored to matching files and directories in
+// /.html5fs_shadow.  Instead each change is described by a compact binary
+// record, and pbmemfs_worker appends those records, in large writes, to
+// numbered segment files in pbmemfs_journal_dir ("seg.<n>").  Once enough
+// has been written, compact_journal writes a packed image of the whole tree,
+// in the same record format, to "image.<n>" and deletes the older segments
+// and images.  At startup replay_journal rebuilds /.memfs_shadow from the
+// newest image and every segment numbered at or above it.
+//
+// Each record is:
+//
+//    uint32_t  length      of the whole record, including this header
+//    uint32_t  checksum    FNV-1a of everything after this field
+//    uint8_t   type        one of journal_op
+//    fields...             int64_t numbers, and strings (or data) stored
+//                          as a uint32_t length followed by the bytes
+//
+// replay stops at the first record that is truncated or fails its checksum,
+// which is what a write interrupted by the page closing leaves behind.
+enum journal_op : uint8_t
+{
+  jr_image = 1,   // int64_t first_seg
+  jr_mkdir,       // path, int64_t mode
+  jr_create,      // path, int64_t mode
+  jr_write,       // path, int64_t pos, data
+  jr_truncate,    // path, int64_t size
+  jr_rename,      // path, new_path
+  jr_unlink,      // path
+  jr_rmdir,       // path
+  jr_chmod,       // path, int64_t mode
+  jr_utimes       // path, int64_t atime, int64_t mtime
+};
+
+uint32_t fnv1a(const char* p, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)p[i]) * 16777619u;
+  return h;
+}
+
+// builds one record, for example:
+//
+//    journal_record(jr_rename).str(path).str(new_path).finish()
+//
+struct journal_record
+{
+  std::string buf_;
+  
+  explicit journal_record(journal_op op)
+    : buf_(9, 0)
+  {
+    buf_[8] = (char)op;
+  }
+  
+  journal_record& num(int64_t v)
+  {
+    buf_.append((const char*)&v, sizeof(v));
+    return *this;
+  }
+  
+  journal_record& str(const char* p, size_t len)
+  {
+    uint32_t l = (uint32_t)len;
+    buf_.append((const char*)&l, sizeof(l));
+    buf_.append(p, len);
+    return *this;
+  }
+  
+  journal_record& str(const std::string& s)
+  {
+    return str(s.data(), s.size());
+  }
+  
+  std::string finish()
+  {
+    uint32_t len = (uint32_t)buf_.size();
+    uint32_t sum = fnv1a(&buf_[8], len - 8);
+    memcpy(&buf_[0], &len, sizeof(len));
+    memcpy(&buf_[4], &sum, sizeof(sum));
+    return std::move(buf_);
+  }
+};
+
+// reads the fields of one record.  ok_ goes false if
+// a field would run past the end of the record
+struct journal_reader
+{
+  const char* p_;
+  const char* end_;
+  bool        ok_;
+  
+  journal_reader(const char* p, const char* end)
+    : p_(p),
+      end_(end),
+      ok_(true)
+  {}
+  
+  int64_t num()
+  {
+    int64_t v = 0;
+    if (end_ - p_ < (ptrdiff_t)sizeof(v))
+      ok_ = false;
+    else {
+      memcpy(&v, p_, sizeof(v));
+      p_ += sizeof(v);
+    }
+    return v;
+  }
+  
+  const char* data(size_t& len)
+  {
+    uint32_t l = 0;
+    if (end_ - p_ < (ptrdiff_t)sizeof(l))
+      ok_ = false;
+    else {
+      memcpy(&l, p_, sizeof(l));
+      p_ += sizeof(l);
+      if (end_ - p_ < (ptrdiff_t)l)
+        ok_ = false;
+    }
+    if (!ok_) {
+      len = 0;
+      return p_;
+    }
+    auto ret = p_;
+    p_ += l;
+    len = l;
+    return ret;
+  }
+  
+  std::string str()
+  {
+    size_t len;
+    auto p = data(len);
+    return std::string(p, len);
+  }
+};
+
+// where the journal's segments and images live
+std::string                 pbmemfs_journal_dir = html5_shadow_name + "/.ms_journal";
+
+// segments are started fresh once they reach pbmemfs_journal_seg_bytes.  The
+// journal is compacted once more than pbmemfs_journal_compact_bytes (or the
+// size of the current image, if that is larger) has been written since the
+// last image.  Records are collected in pbmemfs_journal_buf until it reaches
+// pbmemfs_journal_buf_bytes or the worker runs out of tasks.
+const size_t                pbmemfs_journal_buf_bytes = 1024 * 1024;
+const size_t                pbmemfs_journal_seg_bytes = 4 * 1024 * 1024;
+const size_t                pbmemfs_journal_compact_bytes = 8 * 1024 * 1024;
+
+std::vector<std::string>    pbmemfs_journal_dirs;
+
+// state below is only used on pbmemfs_worker (or on the startup
+// thread before that turns into pbmemfs_worker)
+std::string                 pbmemfs_journal_buf;
+int                         pbmemfs_journal_fd = -1;
+uint64_t                    pbmemfs_journal_seg = 0;
+size_t                      pbmemfs_journal_seg_size = 0;
+size_t                      pbmemfs_journal_bytes = 0;
+size_t                      pbmemfs_journal_image_bytes = 0;
+
+// The ops that journal a change hold pbmemfs_journal_mtx shared while they
+// make the change, and call journal_change_gen to count it and read the
+// generation.  compact_journal takes its snapshot of /.memfs_shadow without
+// the lock, and then only keeps it if, with the lock held exclusively, it
+// finds no change was counted in the meantime.  It bumps pbmemfs_journal_gen
+// at that point, and a record is dropped if the generation has moved on by
+// the time the worker gets to it, since the image already has it.  Writes
+// to file contents aren't counted: their records are made from the current
+// contents when the file is flushed, after the snapshot, so they correct
+// anything the snapshot read part way through a write.
+std::shared_timed_mutex     pbmemfs_journal_mtx;
+std::atomic<uint64_t>       pbmemfs_journal_gen(0);
+std::atomic<uint64_t>       pbmemfs_journal_changes(0);
+
+// a snapshot that keeps being thrown away because of changes made while it
+// was taken is retried this many times, after which the next one is taken
+// with the lock held, stalling the ops for as long as it takes to read all
+// of /persistent.  Only used on pbmemfs_worker
+const int                   pbmemfs_journal_compact_tries = 3;
+int                         pbmemfs_journal_compact_misses = 0;
+
+std::shared_lock<std::shared_timed_mutex> journal_shared_lock()
+{
+  std::shared_lock<std::shared_timed_mutex> lk(pbmemfs_journal_mtx, std::defer_lock);
+  if (pbmemfs_journal.load())
+    lk.lock();
+  return lk;
+}
+
+// called, with the lock from journal_shared_lock held, by an op that is
+// about to queue a record.  Returns the generation to queue it with
+uint64_t journal_change_gen()
+{
+  ++pbmemfs_journal_changes;
+  return pbmemfs_journal_gen.load();
+}
+
+std::string journal_file_name(const char* kind, uint64_t n)
+{
+  return pbmemfs_journal_dir + "/" + kind + "." + std::to_string(n);
+}
+
+// close the current segment, if any, and start segment number 'seg'
+void open_journal_segment(uint64_t seg)
+{
+  if (pbmemfs_journal_fd != -1 && close(pbmemfs_journal_fd) != 0)
+    fprintf(stderr, "close(%d) failed, errno: %d\n", pbmemfs_journal_fd, errno);
+  auto name = journal_file_name("seg", seg);
+  pbmemfs_journal_fd = open(name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+  if (pbmemfs_journal_fd == -1)
+    fprintf(stderr, "open(\"%s\", O_CREAT | O_WRONLY | O_TRUNC) failed with errno: %d\n", name.c_str(), errno);
+  pbmemfs_journal_seg = seg;
+  pbmemfs_journal_seg_size = 0;
+}
+
+// write all of 'len' bytes at 'p' to 'fd'
+bool write_all(int fd, const char* p, size_t len)
+{
+  while (len > 0) {
+    auto bytes = write(fd, p, len);
+    if (bytes == -1) {
+      fprintf(stderr, "write(%d, %p, %d) failed with errno: %d\n", fd, p, (int)len, errno);
+      return false;
+    }
+    p += bytes;
+    len -= bytes;
+  }
+  return true;
+}
+
+// append pbmemfs_journal_buf to the current segment
+void journal_write()
+{
+  if (pbmemfs_journal_buf.empty())
+    return;
+  if (pbmemfs_journal_fd != -1 && write_all(pbmemfs_journal_fd, pbmemfs_journal_buf.data(), pbmemfs_journal_buf.size())) {
+    pbmemfs_journal_seg_size += pbmemfs_journal_buf.size();
+    pbmemfs_journal_bytes += pbmemfs_journal_buf.size();
+  }
+  pbmemfs_journal_buf.clear();
+  if (pbmemfs_journal_seg_size >= pbmemfs_journal_seg_bytes)
+    open_journal_segment(pbmemfs_journal_seg + 1);
+}
+
+// write pbmemfs_journal_buf and ask html5fs to commit the current segment
+void journal_commit()
+{
+  journal_write();
+  if (pbmemfs_journal_fd != -1 && fsync(pbmemfs_journal_fd) != 0)
+    fprintf(stderr, "fsync(%d) failed, errno: %d\n", pbmemfs_journal_fd, errno);
+}
+
+void journal_append(const std::string& rec)
+{
+  pbmemfs_journal_buf += rec;
+  if (pbmemfs_journal_buf.size() >= pbmemfs_journal_buf_bytes)
+    journal_write();
+}
+
+// queue 'rec' to be appended to the journal.  'lk' must be the lock
+// returned by journal_shared_lock, held while the change that 'rec'
+// describes was made.  It is released here.
+void queue_journal_record(std::shared_lock<std::shared_timed_mutex>& lk, std::string rec)
+{
+  auto gen = journal_change_gen();
+  lk.unlock();
+  count_queued_bytes(0, rec.size());
+  bkg_call([](const std::string& rec, uint64_t gen)
+          {
+            if (gen == pbmemfs_journal_gen.load())
+              journal_append(rec);
+            count_queued_bytes(rec.size(), 0);
+          },
+          std::move(rec), gen);
+}
+
+// collects the records of an image and writes them to 'fd_', a
+// pbmemfs_journal_buf_bytes sized piece at a time
+struct image_writer
+{
+  int         fd_;
+  bool        ok_;
+  size_t      size_;
+  std::string buf_;
+  
+  explicit image_writer(int fd)
+    : fd_(fd),
+      ok_(true),
+      size_(0)
+  {}
+  
+  void add(const std::string& rec)
+  {
+    buf_ += rec;
+    size_ += rec.size();
+    if (buf_.size() >= pbmemfs_journal_buf_bytes)
+      flush();
+  }
+  
+  void flush()
+  {
+    if (ok_ && !buf_.empty())
+      ok_ = write_all(fd_, buf_.data(), buf_.size());
+    buf_.clear();
+  }
+};
+
+// add records to 'image' that recreate 'path' (a directory within
+// /persistent, starting with '/') and everything below it
+void snapshot_dir(const std::string& path, image_writer& image)
+{
+  struct stat st;
+  if (stat((mem_shadow_name + path).c_str(), &st) != 0)
+    return;
+  image.add(journal_record(jr_mkdir).str(path).num(st.st_mode & 0777).finish());
+  
+  DIR* dir;
+  if ((dir = opendir((mem_shadow_name + path).c_str())) == 0)
+    return;
+  std::vector<char> buf;
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != 0) {
+    if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+      continue;
+    auto ent_path = path + "/" + ent->d_name;
+    auto mem_path = mem_shadow_name + ent_path;
+    if (stat(mem_path.c_str(), &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      snapshot_dir(ent_path, image);
+      continue;
+    }
+    image.add(journal_record(jr_create).str(ent_path).num(st.st_mode & 0777).finish());
+    image.add(journal_record(jr_truncate).str(ent_path).num(0).finish());
+    int fd = open(mem_path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      fprintf(stderr, "open(\"%s\", O_RDONLY) failed with errno: %d\n", mem_path.c_str(), errno);
+      continue;
+    }
+    buf.resize(std::min((size_t)st.st_size, pbmemfs_flush_bytes));
+    off_t pos = 0;
+    while (pos < st.st_size) {
+      auto nread = read(fd, &buf[0], buf.size());
+      if (nread <= 0)
+        break;
+      image.add(journal_record(jr_write).str(ent_path).num(pos).str(&buf[0], nread).finish());
+      pos += nread;
+    }
+    close(fd);
+    image.add(journal_record(jr_utimes).str(ent_path).num(st.st_atime).num(st.st_mtime).finish());
+  }
+  closedir(dir);
+}
+
+// delete every image and segment numbered below 'first_seg'
+void delete_old_journal_files(uint64_t first_seg)
+{
+  DIR* dir;
+  if ((dir = opendir(pbmemfs_journal_dir.c_str())) == 0)
+    return;
+  std::vector<std::string> old;
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != 0) {
+    auto dot = strchr(ent->d_name, '.');
+    if (dot && dot[1] >= '0' && dot[1] <= '9' && strtoull(dot + 1, 0, 10) < first_seg)
+      old.push_back(pbmemfs_journal_dir + "/" + ent->d_name);
+  }
+  closedir(dir);
+  for (auto& name : old) {
+    if (unlink(name.c_str()) != 0)
+      fprintf(stderr, "unlink(%s) failed with errno: %d\n", name.c_str(), errno);
+  }
+}
+
+// write a packed image of everything in /persistent to 'name',
+// setting 'size' to the number of bytes written
+bool write_journal_image(const std::string& name, uint64_t first_seg, size_t& size)
+{
+  int fd = open(name.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0666);
+  if (fd == -1) {
+    fprintf(stderr, "open(\"%s\", O_CREAT | O_WRONLY | O_TRUNC) failed with errno: %d\n", name.c_str(), errno);
+    return false;
+  }
+  image_writer image(fd);
+  image.add(journal_record(jr_image).num(first_seg).finish());
+  for (auto& dir : pbmemfs_journal_dirs)
+    snapshot_dir("/" + dir, image);
+  image.flush();
+  bool ok = image.ok_;
+  if (ok && fsync(fd) != 0) {
+    fprintf(stderr, "fsync(%d) failed, errno: %d\n", fd, errno);
+    ok = false;
+  }
+  close(fd);
+  size = image.size_;
+  return ok;
+}
+
+// write a packed image of everything in /persistent, and delete the
+// segments (and older images) that it replaces.  Records for changes
+// made after the snapshot go to a new segment.  If the image can't be
+// kept the journal is left as it was, and the next call tries again.
+void compact_journal()
+{
+  journal_write();
+  
+  uint64_t first_seg = pbmemfs_journal_seg + 1;
+  
+  // the image only counts once it is complete, so it is written under a
+  // name replay_journal ignores, and then renamed
+  auto tmp_name = pbmemfs_journal_dir + "/image_tmp";
+  auto name = journal_file_name("image", first_seg);
+  
+  std::unique_lock<std::shared_timed_mutex> lk(pbmemfs_journal_mtx, std::defer_lock);
+  bool locked = pbmemfs_journal_compact_misses >= pbmemfs_journal_compact_tries;
+  if (locked)
+    lk.lock();
+  auto changes = pbmemfs_journal_changes.load();
+  size_t size = 0;
+  bool ok = write_journal_image(tmp_name, first_seg, size);
+  if (ok && !locked) {
+    lk.lock();
+    if (changes != pbmemfs_journal_changes.load()) {
+      ++pbmemfs_journal_compact_misses;
+      ok = false;
+    }
+  }
+  if (ok && rename(tmp_name.c_str(), name.c_str()) != 0) {
+    fprintf(stderr, "rename(%s, %s) failed with errno: %d\n", tmp_name.c_str(), name.c_str(), errno);
+    ok = false;
+  }
+  if (ok) {
+    ++pbmemfs_journal_gen;
+    pbmemfs_journal_compact_misses = 0;
+  }
+  if (lk.owns_lock())
+    lk.unlock();
+  
+  if (!ok) {
+    unlink(tmp_name.c_str());
+    return;
+  }
+  open_journal_segment(first_seg);
+  delete_old_journal_files(first_seg);
+  pbmemfs_journal_bytes = 0;
+  pbmemfs_journal_image_bytes = size;
+}
+
+// called by pbmemfs_worker each time it runs out of tasks
+void journal_idle()
+{
+  journal_write();
+  if (pbmemfs_journal_bytes >= std::max(pbmemfs_journal_compact_bytes, pbmemfs_journal_image_bytes))
+    compact_journal();
+}
+
+// apply the records in [p, end) to /.memfs_shadow.  Returns false
+// if it stopped early because of a damaged or truncated record
+bool replay_records(const char* p, const char* end)
+{
+  std::string write_path;
+  int write_fd = -1;
+  auto close_write_fd = [&write_fd]{
+    if (write_fd != -1)
+      close(write_fd);
+    write_fd = -1;
+  };
+  
+  bool ok = true;
+  while (p != end) {
+    uint32_t len = 0, sum = 0;
+    if (end - p >= 9) {
+      memcpy(&len, p, 4);
+      memcpy(&sum, p + 4, 4);
+    }
+    if (len < 9 || (size_t)(end - p) < len || fnv1a(p + 8, len - 8) != sum) {
+      ok = false;
+      break;
+    }
+    auto op = (journal_op)(uint8_t)p[8];
+    journal_reader r(p + 9, p + len);
+    p += len;
+    
+    if (op == jr_image)
+      continue;
+    auto path = r.str();
+    auto mem_path = mem_shadow_name + path;
+    if (op == jr_write) {
+      auto pos = r.num();
+      size_t sz;
+      auto data = r.data(sz);
+      if (!r.ok_)
+        continue;
+      if (path != write_path) {
+        close_write_fd();
+        write_path = path;
+        write_fd = open(mem_path.c_str(), O_WRONLY);
+      }
+      if (write_fd != -1 && pwrite(write_fd, data, sz, pos) != (ssize_t)sz)
+        fprintf(stderr, "pwrite(%d, %p, %d, %d) failed with errno: %d\n", write_fd, data, (int)sz, (int)pos, errno);
+      continue;
+    }
+    close_write_fd();
+    write_path.clear();
+    
+    switch (op) {
+      case jr_mkdir: {
+        auto mode = r.num();
+        if (r.ok_)
+          mkdir(mem_path.c_str(), (mode_t)mode);
+      } break;
+      case jr_create: {
+        auto mode = r.num();
+        int fd;
+        if (r.ok_ && (fd = open(mem_path.c_str(), O_CREAT | O_WRONLY, (mode_t)mode)) != -1)
+          close(fd);
+      } break;
+      case jr_truncate: {
+        auto size = r.num();
+        if (r.ok_)
+          truncate(mem_path.c_str(), size);
+      } break;
+      case jr_rename: {
+        auto new_path = r.str();
+        if (r.ok_)
+          rename(mem_path.c_str(), (mem_shadow_name + new_path).c_str());
+      } break;
+      case jr_unlink:
+        if (r.ok_)
+          unlink(mem_path.c_str());
+        break;
+      case jr_rmdir:
+        if (r.ok_)
+          rmdir(mem_path.c_str());
+        break;
+      case jr_chmod: {
+        auto mode = r.num();
+        if (r.ok_)
+          chmod(mem_path.c_str(), (mode_t)mode);
+      } break;
+      case jr_utimes: {
+        struct timeval tv[2] = {};
+        tv[0].tv_sec = r.num();
+        tv[1].tv_sec = r.num();
+        if (r.ok_)
+          utimes(mem_path.c_str(), tv);
+      } break;
+      default:
+        break;
+    }
+  }
+  close_write_fd();
+  return ok;
+}
+
+// read all of 'name' (with a single read when it isn't enormous)
+// and replay it.  Returns the number of bytes read
+size_t replay_journal_file(const std::string& name)
+{
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    fprintf(stderr, "open(\"%s\", O_RDONLY) failed with errno: %d\n", name.c_str(), errno);
+    return 0;
+  }
+  std::string contents;
+  struct stat st;
+  if (fstat(fd, &st) == 0) {
+    contents.resize(st.st_size);
+    size_t got = 0;
+    while (got < contents.size()) {
+      auto nread = read(fd, &contents[got], contents.size() - got);
+      if (nread <= 0)
+        break;
+      got += nread;
+    }
+    contents.resize(got);
+  }
+  close(fd);
+  if (!replay_records(contents.data(), contents.data() + contents.size()))
+    fprintf(stderr, "stopped replaying \"%s\" at a damaged record\n", name.c_str());
+  return contents.size();
+}
+
+// rebuild /.memfs_shadow from the newest image and the segments after it,
+// and start a new segment for this session.  Returns false if there was
+// no journal at all
+bool replay_journal()
+{
+  mkdir_p(pbmemfs_journal_dir);
+  
+  bool have_image = false;
+  uint64_t image = 0;
+  std::vector<uint64_t> segs;
+  DIR* dir;
+  if ((dir = opendir(pbmemfs_journal_dir.c_str())) != 0) {
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != 0) {
+      if (!strncmp(ent->d_name, "seg.", 4))
+        segs.push_back(strtoull(ent->d_name + 4, 0, 10));
+      else if (!strncmp(ent->d_name, "image.", 6)) {
+        auto n = strtoull(ent->d_name + 6, 0, 10);
+        if (!have_image || n > image)
+          image = n;
+        have_image = true;
+      }
+    }
+    closedir(dir);
+  }
+  if (!have_image && segs.empty())
+    return false;
+  
+  std::sort(segs.begin(), segs.end());
+  uint64_t last_seg = image;
+  if (have_image)
+    pbmemfs_journal_image_bytes = replay_journal_file(journal_file_name("image", image));
+  for (auto seg : segs) {
+    if (seg >= image) {
+      pbmemfs_journal_bytes += replay_journal_file(journal_file_name("seg", seg));
+      last_seg = seg;
+    }
+  }
+  
+  // never append to an existing segment, its last record might be damaged
+  open_journal_segment(last_seg + 1);
+  return true;
+}
+
+void flush_file_ref(file_ref* fr);
+
+// true when a limit has been set and pbmemfs_queued_bytes has reached it
+bool over_queue_limit()
+{
+  auto limit = pbmemfs_queue_limit.load();
+  return limit != 0 && pbmemfs_queued_bytes.load() >= limit;
+}
+
+// copy every open file's recorded ranges.  Only called on pbmemfs_worker
+void flush_all_files()
+{
+  std::vector<file_ref*> files;
+  {
+    std::lock_guard<std::mutex> lk(pbmemfs_files_mtx);
+    files.assign(pbmemfs_files.begin(), pbmemfs_files.end());
+  }
+  for (auto fr : files)
+    flush_file_ref(fr);
+}
+
+// called by writers after recording new dirty bytes.  Once the limit is
+// reached, all three policies queue (at most) one task that copies out
+// every open file's ranges.  persist_queue_block then also waits for that
+// to bring the total back under the limit -- except on the main thread,
+// which must not block.  persist_queue_coalesce differs from
+// persist_queue_spill only in add_dirty, where it stops queuing per-file
+// flushes so that further writes merge into the ranges already recorded
+void apply_queue_limit()
+{
+  if (!over_queue_limit())
+    return;
+  
+  if (!pbmemfs_flush_all_queued.exchange(true))
+    bkg_call([]
+            {
+              pbmemfs_flush_all_queued = false;
+              flush_all_files();
+            });
+  
+  if (pbmemfs_queue_policy.load() != mutantspider::persist_queue_block
+      || pp::Module::Get()->core()->IsMainThread())
+    return;
+  
+  ++pbmemfs_queue_limit_waits;
+  std::unique_lock<std::mutex> lk(pbmemfs_queue_mtx);
+  ++pbmemfs_queue_waiters;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  while (over_queue_limit())
+    pbmemfs_queue_cnd.wait(lk);
+  --pbmemfs_queue_waiters;
+}
+
+// record that [pos, pos+count) has been written in fr's memfs file,
+// merging that with any existing range it overlaps or touches
+void add_dirty(file_ref* fr, off_t pos, size_t count)
+{
+  std::unique_lock<std::mutex> lk(fr->mtx_);
+  if (fr->unlinked_ || count == 0)
+    return;
+  
+  bool was_clean = fr->dirty_.empty();
+  auto dirty_bytes = fr->dirty_bytes_;
+  off_t end = pos + (off_t)count;
+  
+  // find, or create, the range that starts at or before pos and
+  // reaches at least to pos.  In the common case of sequential
+  // writes this just extends the last range without allocating
+  auto it = fr->dirty_.upper_bound(pos);
+  if (it != fr->dirty_.begin() && std::prev(it)->second >= pos)
+    --it;
+  else
+    it = fr->dirty_.emplace_hint(it, pos, pos);
+  fr->dirty_bytes_ -= it->second - it->first;
+  if (it->second < end)
+    it->second = end;
+  
+  // absorb any following ranges that this one now reaches
+  auto next = std::next(it);
+  while (next != fr->dirty_.end() && next->first <= it->second) {
+    if (it->second < next->second)
+      it->second = next->second;
+    fr->dirty_bytes_ -= next->second - next->first;
+    next = fr->dirty_.erase(next);
+  }
+  fr->dirty_bytes_ += it->second - it->first;
+  
+  if (was_clean) {
+    fr->dirty_since_ns_ = now_ns();
+    ++pbmemfs_dirty_files;
+  }
+  count_queued_bytes(dirty_bytes, fr->dirty_bytes_);
+  bool queue_flush = fr->dirty_bytes_ >= pbmemfs_flush_bytes && !fr->flush_queued_
+                      && !(pbmemfs_queue_policy.load() == mutantspider::persist_queue_coalesce && over_queue_limit());
+  if (queue_flush)
+    fr->flush_queued_ = true;
+  
+  // bkg_call can block waiting for the worker, which might itself be
+  // waiting for fr->mtx_ in flush_file_ref, so don't hold that here
+  lk.unlock();
+  if (queue_flush)
+    bkg_call(flush_file_ref, fr);
+  else if (was_clean)
+    pbmemfs_wake_worker();   // so it can start its flush timer
+  apply_queue_limit();
+}
+
+// throw away any recorded ranges at or beyond 'size'.  Caller must hold fr->mtx_
+void clip_dirty(file_ref* fr, off_t size)
+{
+  auto dirty_bytes = fr->dirty_bytes_;
+  auto it = fr->dirty_.lower_bound(size);
+  while (it != fr->dirty_.end()) {
+    fr->dirty_bytes_ -= it->second - it->first;
+    it = fr->dirty_.erase(it);
+  }
+  if (!fr->dirty_.empty()) {
+    auto last = std::prev(fr->dirty_.end());
+    if (last->second > size) {
+      fr->dirty_bytes_ -= last->second - size;
+      last->second = size;
+    }
+  } else if (fr->dirty_bytes_ == 0 && fr->dirty_since_ns_ != 0) {
+    fr->dirty_since_ns_ = 0;
+    --pbmemfs_dirty_files;
+  }
+  count_queued_bytes(dirty_bytes, fr->dirty_bytes_);
+}
+
+// call 'f' on every open file_ref whose path is 'path'.  f is
+// called while holding both pbmemfs_files_mtx and the file_ref's mtx_
+template<typename F>
+void for_each_open_file(const std::string& path, F f)
+{
+  std::lock_guard<std::mutex> lk(pbmemfs_files_mtx);
+  for (auto fr : pbmemfs_files) {
+    std::lock_guard<std::mutex> lk(fr->mtx_);
+    if (fr->path_ == path)
+      f(fr);
+  }
+}
+
+// mark every open file at 'path' as unlinked, so nothing more gets copied
+// out of it.  Only files opened before 'seq' (see pbmemfs_op_seq) are
+// affected.  In journal mode this is done on pbmemfs_worker, in the same
+// order as the journal records, so that file_ref::path_ always names the
+// file as of the last record written
+void unlink_open_files(const std::string& path, uint64_t seq)
+{
+  std::lock_guard<std::mutex> lk(pbmemfs_files_mtx);
+  for (auto fr : pbmemfs_files) {
+    std::lock_guard<std::mutex> lk(fr->mtx_);
+    if (fr->path_ == path && fr->opened_seq_ < seq) {
+      fr->unlinked_ = true;
+      clip_dirty(fr, 0);
+    }
+  }
+}
+
+// anything open at new_path has just been replaced, and anything open
+// at, or below, path is now at, or below, new_path.  'seq' works the
+// same as in unlink_open_files
+void rename_open_files(const std::string& path, const std::string& new_path, uint64_t seq)
+{
+  std::lock_guard<std::mutex> lk(pbmemfs_files_mtx);
+  for (auto fr : pbmemfs_files) {
+    std::lock_guard<std::mutex> lk(fr->mtx_);
+    if (fr->opened_seq_ >= seq)
+      continue;
+    if (fr->path_ == new_path) {
+      fr->unlinked_ = true;
+      clip_dirty(fr, 0);
+    }
+    else if (fr->path_.compare(0, path.size(), path) == 0
+              && (fr->path_.size() == path.size() || fr->path_[path.size()] == '/'))
+      fr->path_ = new_path + fr->path_.substr(path.size());
+  }
+}
+
+// copy every recorded range from fr's memfs file to its html5fs file
+// (or, in journal mode, to the journal).
+// This reads the _current_ contents of the memfs file, so any truncation
+// since the ranges were recorded is automatically honored.  Only called
+// on pbmemfs_worker.
+void flush_file_ref(file_ref* fr)
+{
+  std::map<off_t, off_t> dirty;
+  std::string path;
+  size_t dirty_bytes;
+  {
+    std::lock_guard<std::mutex> lk(fr->mtx_);
+    dirty.swap(fr->dirty_);
+    path = fr->path_;
+    dirty_bytes = fr->dirty_bytes_;
+    fr->dirty_bytes_ = 0;
+    fr->flush_queued_ = false;
+    if (fr->dirty_since_ns_ != 0) {
+      fr->dirty_since_ns_ = 0;
+      --pbmemfs_dirty_files;
+    }
+  }
+  
+  // open failed, which has already been reported
+  bool journal = pbmemfs_journal.load();
+  if (!journal && fr->html5fs_fd_ == -1) {
+    count_queued_bytes(dirty_bytes, 0);
+    return;
+  }
+  
+  std::vector<char> buf;
+  for (auto& r : dirty) {
+    off_t pos = r.first;
+    while (pos < r.second) {
+      size_t sz = std::min((size_t)(r.second - pos), pbmemfs_flush_bytes);
+      if (buf.size() < sz)
+        buf.resize(sz);
+      auto nread = pread(fr->memfs_fd_, &buf[0], sz, pos);
+      if (nread <= 0) {
+        if (nread < 0)
+          fprintf(stderr, "pread(%d, %p, %d, %d) failed with errno: %d\n", fr->memfs_fd_, &buf[0], (int)sz, (int)pos, errno);
+        break;    // nread == 0 means the file has been truncated since this range was written
+      }
+      if (journal) {
+        journal_append(journal_record(jr_write).str(path).num(pos).str(&buf[0], nread).finish());
+        pos += nread;
+        continue;
+      }
+      int ret;
+      if ((ret = pwrite(fr->html5fs_fd_, &buf[0], nread, pos)) != nread)
+        fprintf(stderr, "pwrite(%d, %p, %d, %d) returned unexpected value (%d instead of %d), errno: %d\n",
+                fr->html5fs_fd_, &buf[0], (int)nread, (int)pos, ret, (int)nread, errno);
+      pos += nread;
+    }
+  }
+  
+  // the bytes stay counted in pbmemfs_queued_bytes until they have been copied
+  count_queued_bytes(dirty_bytes, 0);
+}
+
+// flush_file_ref, and then ask html5fs to commit what it wrote.
+// Only called on pbmemfs_worker.
+void sync_file_ref(file_ref* fr)
+{
+  flush_file_ref(fr);
+  if (pbmemfs_journal.load())
+    journal_commit();
+  else if (fr->html5fs_fd_ != -1 && fsync(fr->html5fs_fd_) != 0)
+    fprintf(stderr, "fsync(%d) failed, errno: %d\n", fr->html5fs_fd_, errno);
+}
+
+// when true, fsync on a writable /persistent file waits until
+// pbmemfs_worker has run sync_file_ref on it (see set_persist_blocking_fsync)
+std::atomic<bool> pbmemfs_blocking_fsync(false);
+
+// set once mount_fs has started pbmemfs, so there is a worker
+// to run persist_flush's barrier task
+std::atomic<bool> pbmemfs_mounted(false);
+
+// flush every open file whose oldest unflushed write is older
+// than the flush interval.  Only called on pbmemfs_worker.
+void flush_expired_files()
+{
+  auto interval = pbmemfs_flush_interval_ms.load();
+  if (pbmemfs_dirty_files.load() == 0 || interval <= 0)
+    return;
+    
+  auto cutoff = now_ns() - (uint64_t)interval * 1000000;
+  std::vector<file_ref*> expired;
+  {
+    std::lock_guard<std::mutex> lk(pbmemfs_files_mtx);
+    for (auto fr : pbmemfs_files) {
+      std::lock_guard<std::mutex> lk(fr->mtx_);
+      if (fr->dirty_since_ns_ != 0 && fr->dirty_since_ns_ <= cutoff)
+        expired.push_back(fr);
+    }
+  }
+  for (auto fr : expired)
+    flush_file_ref(fr);
+}
+
+// set the 'fh' field of finfo.  If the file is writable
+// then we use an allocated datastructure (file_ref) to keep
+// track of both the file descriptor in /.memfs_shadow as well
+// as /.html5fs_shadow.  Otherwise we just keep track of the
+// the one in /.memfs_shadow
+bool set_fh(struct fuse_file_info* finfo, int flags, int fd, const std::string& path)
+{
+  if ((flags & O_ACCMODE) != O_RDONLY) {
+    // it is possible that it will be written to
+    auto fr = new file_ref(fd, flags, path, ++pbmemfs_op_seq);
+    finfo->fh = reinterpret_cast<decltype(finfo->fh)>(fr);
+    std::lock_guard<std::mutex> lk(pbmemfs_files_mtx);
+    pbmemfs_files.insert(fr);
+    return true;
+  } else {
+    // malloc'ed pointers can't have 1 in the low bit, so use that
+    // to distinguish between the two cases.
+    finfo->fh = (fd << 1) | 1;
+    return false;
+  }
+}
+
+// get the file_ref if there is one (the file is writable)
+// or 0 if not.
+file_ref* get_fr(struct fuse_file_info* finfo)
+{
+  if (finfo->fh & 1)
+    return 0;
+  return reinterpret_cast<file_ref*>(finfo->fh);
+}
+
+// get the primary file descriptor (for the file in
+// in /.memfs_shadow)
+int get_fd(struct fuse_file_info* finfo)
+{
+  auto fr = get_fr(finfo);
+  return fr ? fr->memfs_fd_ : finfo->fh >> 1;
+}
+
+// the flags we use to open the memfs file.  flush_file_ref needs
+// to read back from that file, so write-only files are opened
+// read-write there.
+int memfs_flags(int flags)
+{
+  return (flags & O_ACCMODE) == O_WRONLY ? (flags & ~O_ACCMODE) | O_RDWR : flags;
+}
+
+// the flags we use to open the html5fs file.  flush_file_ref always
+// writes at explicit offsets, so O_APPEND must not be set there.
+int html5fs_flags(int flags)
+{
+  return flags & ~O_APPEND;
+}
+    
+// the largest single read copy_fd will make
+const size_t pbmemfs_copy_chunk = 4 * 1024 * 1024;
+
+// copy the 'size' bytes of from_f to to_f, reading them in as few calls
+// as possible (files up to pbmemfs_copy_chunk take just one read). 'to'
+// and 'from' are only used in error messages
+bool copy_fd(int to_f, int from_f, off_t size, const char* to, const char* from)
+{
+  std::vector<char> buf(std::min((size_t)size, pbmemfs_copy_chunk));
+  off_t copied = 0;
+  while (copied < size) {
+    auto nread = read(from_f, &buf[0], std::min((size_t)(size - copied), buf.size()));
+    if (nread == 0)
+      return true;
+    if (nread == -1) {
+      fprintf(stderr, "read(%d, %p, %d) failed with errno: %d\n", from_f, &buf[0], (int)buf.size(), errno);
+      return false;
+    }
+    int written = 0;
+    while (written < nread) {
+      auto bytes = write(to_f, &buf[written], nread - written);
+      if (bytes == -1) {
+        fprintf(stderr, "write(%d, %p, %d) failed with errno: %d\n", to_f, &buf[written], (int)(nread-written), errno);
+        return false;
+      }
+      written += bytes;
+    }
+    copied += nread;
+  }
+  return true;
+}
+
+// startup creates empty "placeholder" files in /.memfs_shadow, and records
+// the real size of each one here, keyed by its path within /persistent.  The
+// contents are copied from /.html5fs_shadow by load_lazy_file, either by the
+// threads started in load_startup_files, or the first time the file is opened
+// (or otherwise needs its contents) -- whichever comes first.
+//
+// The mirroring code never queues an operation that would touch the
+// /.html5fs_shadow copy of a file listed here -- anything that would is
+// preceded by either load_lazy_file or drop_lazy_file -- so that copy is
+// always safe to read from any (non-main) thread.
+struct lazy_file
+{
+  off_t size_;
+  bool  loading_;
+};
+
+std::atomic<bool>                   pbmemfs_lazy_load(false);
+std::map<std::string, lazy_file>    pbmemfs_lazy_files;
+std::atomic<size_t>                 pbmemfs_lazy_count(0);
+std::mutex                          pbmemfs_lazy_mtx;
+std::condition_variable             pbmemfs_lazy_cnd;
+
+// record a placeholder created during startup
+void add_lazy_file(const std::string& path, off_t size)
+{
+  std::lock_guard<std::mutex> lk(pbmemfs_lazy_mtx);
+  pbmemfs_lazy_files[path] = lazy_file{size, false};
+  pbmemfs_lazy_count = pbmemfs_lazy_files.size();
+}
+
+// if 'path' is a placeholder, set st->st_size to the size it really has
+void lazy_stat(const std::string& path, struct stat* st)
+{
+  if (pbmemfs_lazy_count.load() == 0 || !S_ISREG(st->st_mode))
+    return;
+  std::lock_guard<std::mutex> lk(pbmemfs_lazy_mtx);
+  auto it = pbmemfs_lazy_files.find(path);
+  if (it != pbmemfs_lazy_files.end())
+    st->st_size = it->second.size_;
+}
+
+// wait until nobody is loading 'path', and return its entry
+// (or end() if it isn't a placeholder).  Caller holds pbmemfs_lazy_mtx
+std::map<std::string, lazy_file>::iterator wait_lazy_file(std::unique_lock<std::mutex>& lk, const std::string& path)
+{
+  while (true) {
+    auto it = pbmemfs_lazy_files.find(path);
+    if (it == pbmemfs_lazy_files.end() || !it->second.loading_)
+      return it;
+    pbmemfs_lazy_cnd.wait(lk);
+  }
+}
+
+void lru_touch(const std::string& path, off_t size);
+
+// if 'path' is a placeholder, copy its contents in from /.html5fs_shadow,
+// blocking until that is done.  html5fs can't be read on the main thread,
+// so that fails with EWOULDBLOCK there.  Returns 0 or -errno.  If 'loaded'
+// is given it is set to whether this call did the copying.
+int load_lazy_file(const std::string& path, bool* loaded = 0)
+{
+  if (loaded)
+    *loaded = false;
+  if (pbmemfs_lazy_count.load() == 0)
+    return 0;
+    
+  std::unique_lock<std::mutex> lk(pbmemfs_lazy_mtx);
+  auto it = wait_lazy_file(lk, path);
+  if (it == pbmemfs_lazy_files.end())
+    return 0;
+  if (pp::Module::Get()->core()->IsMainThread())
+    return -EWOULDBLOCK;
+  it->second.loading_ = true;
+  auto size = it->second.size_;
+  lk.unlock();
+  
+  std::string mem_path = mem_shadow_name + path;
+  std::string html5_path = html5_shadow_name + path;
+  bool ok = false;
+  auto from_f = open(html5_path.c_str(), O_RDONLY);
+  if (from_f != -1) {
+    // the placeholder already has the file's real mode, which might not be writable
+    struct stat st;
+    bool restore_mode = stat(mem_path.c_str(), &st) == 0 && (st.st_mode & S_IWUSR) == 0;
+    if (restore_mode)
+      chmod(mem_path.c_str(), (st.st_mode & 0777) | S_IWUSR);
+    auto to_f = open(mem_path.c_str(), O_WRONLY);
+    if (to_f != -1) {
+      ok = copy_fd(to_f, from_f, size, mem_path.c_str(), html5_path.c_str());
+      close(to_f);
+    } else
+      fprintf(stderr, "open(\"%s\", O_WRONLY) failed with errno: %d\n", mem_path.c_str(), errno);
+    if (restore_mode)
+      chmod(mem_path.c_str(), st.st_mode & 0777);
+    close(from_f);
+  } else
+    fprintf(stderr, "open(\"%s\", O_RDONLY) failed with errno: %d\n", html5_path.c_str(), errno);
+  
+  lk.lock();
+  if (ok)
+    pbmemfs_lazy_files.erase(path);
+  else
+    pbmemfs_lazy_files[path].loading_ = false;
+  pbmemfs_lazy_count = pbmemfs_lazy_files.size();
+  pbmemfs_lazy_cnd.notify_all();
+  lk.unlock();
+  
+  if (!ok)
+    return -EIO;
+  if (loaded)
+    *loaded = true;
+  lru_touch(path, size);
+  return 0;
+}
+
+// load every placeholder at or below 'path'
+int load_lazy_tree(const std::string& path)
+{
+  while (pbmemfs_lazy_count.load() != 0) {
+    std::string next;
+    {
+      std::lock_guard<std::mutex> lk(pbmemfs_lazy_mtx);
+      auto it = pbmemfs_lazy_files.lower_bound(path);
+      while (it != pbmemfs_lazy_files.end() && it->first.compare(0, path.size(), path) == 0) {
+        if (it->first.size() == path.size() || it->first[path.size()] == '/') {
+          next = it->first;
+          break;
+        }
+        ++it;
+      }
+    }
+    if (next.empty())
+      return 0;
+    auto ret = load_lazy_file(next);
+    if (ret != 0)
+      return ret;
+  }
+  return 0;
+}
+
+// 'path' no longer needs its contents from /.html5fs_shadow (it has been
+// deleted, replaced, or truncated to nothing)
+void drop_lazy_file(const std::string& path)
+{
+  if (pbmemfs_lazy_count.load() == 0)
+    return;
+  std::unique_lock<std::mutex> lk(pbmemfs_lazy_mtx);
+  auto it = wait_lazy_file(lk, path);
+  if (it != pbmemfs_lazy_files.end()) {
+    pbmemfs_lazy_files.erase(it);
+    pbmemfs_lazy_count = pbmemfs_lazy_files.size();
+  }
+}
+
+// When mutantspider::set_persist_memory_budget has been given a non-zero
+// budget, closed files are turned back into placeholders (see lazy_file)
+// once the contents of all the files in /.memfs_shadow add up to more than
+// that, least recently used first.  pbmemfs_lru holds the paths of the files
+// whose contents are in memory, most recently used first, and pbmemfs_lru_files
+// finds a path's place in it along with the size the file had when it was last
+// used.  pbmemfs_open_inos counts the opens of each memfs file, by inode so that
+// the count follows the file through renames.  A file that was last opened on
+// the main thread is never evicted, since reading it back would fail there.
+struct lru_file
+{
+  std::list<std::string>::iterator  pos_;
+  off_t                             size_;
+  bool                              main_thread_;
+};
+
+std::atomic<size_t>                 pbmemfs_memory_budget(0);
+std::list<std::string>              pbmemfs_lru;
+std::map<std::string, lru_file>     pbmemfs_lru_files;
+std::map<ino_t, int>                pbmemfs_open_inos;
+size_t                              pbmemfs_resident_bytes = 0;
+std::mutex                          pbmemfs_lru_mtx;
+
+// set when pbmemfs_resident_bytes goes over budget, so that
+// pbmemfs_worker calls evict_cold_files the next time it is idle
+std::atomic<bool>                   pbmemfs_evict_wanted(false);
+
+// the ops that load placeholders, or that change a file's name or size,
+// hold this shared while they run (see evict_shared_lock).  evict_cold_files
+// only runs if it can get it exclusively
+std::shared_timed_mutex             pbmemfs_evict_mtx;
+
+// counters reported by mutantspider::get_persist_cache_stats
+std::atomic<uint64_t>               pbmemfs_cache_hits(0);
+std::atomic<uint64_t>               pbmemfs_cache_misses(0);
+std::atomic<uint64_t>               pbmemfs_evictions(0);
+std::atomic<uint64_t>               pbmemfs_evicted_bytes(0);
+
+std::shared_lock<std::shared_timed_mutex> evict_shared_lock()
+{
+  std::shared_lock<std::shared_timed_mutex> lk(pbmemfs_evict_mtx, std::defer_lock);
+  if (pbmemfs_memory_budget.load() != 0)
+    lk.lock();
+  return lk;
+}
+
+// caller holds pbmemfs_lru_mtx
+void lru_touch_locked(const std::string& path, off_t size)
+{
+  auto it = pbmemfs_lru_files.find(path);
+  if (it != pbmemfs_lru_files.end()) {
+    pbmemfs_resident_bytes -= it->second.size_;
+    pbmemfs_lru.splice(pbmemfs_lru.begin(), pbmemfs_lru, it->second.pos_);
+    it->second.size_ = size;
+  } else {
+    pbmemfs_lru.push_front(path);
+    pbmemfs_lru_files[path] = lru_file{pbmemfs_lru.begin(), size, false};
+  }
+  pbmemfs_resident_bytes += size;
+}
+
+// caller holds pbmemfs_lru_mtx
+void lru_remove_locked(std::map<std::string, lru_file>::iterator it)
+{
+  pbmemfs_resident_bytes -= it->second.size_;
+  pbmemfs_lru.erase(it->second.pos_);
+  pbmemfs_lru_files.erase(it);
+}
+
+void want_eviction()
+{
+  if (!pbmemfs_evict_wanted.exchange(true))
+    pbmemfs_wake_worker();
+}
 
-namespace {
+// 'path' is in memory, with 'size' bytes, and has just been used
+void lru_touch(const std::string& path, off_t size)
+{
+  if (pbmemfs_memory_budget.load() == 0)
+    return;
+  bool over;
+  {
+    std::lock_guard<std::mutex> lk(pbmemfs_lru_mtx);
+    lru_touch_locked(path, size);
+    over = pbmemfs_resident_bytes > pbmemfs_memory_budget.load();
+  }
+  if (over)
+    want_eviction();
+}
 
-// where we mount the html5fs file system
-std::string html5_shadow_name = "/.html5fs_shadow";
+// 'fd' has just been opened on the memfs file for 'path'
+void lru_open(const std::string& path, int fd)
+{
+  struct stat st;
+  if (pbmemfs_memory_budget.load() == 0 || fstat(fd, &st) != 0)
+    return;
+  auto main_thread = pp::Module::Get()->core()->IsMainThread();
+  std::lock_guard<std::mutex> lk(pbmemfs_lru_mtx);
+  ++pbmemfs_open_inos[st.st_ino];
+  if (S_ISREG(st.st_mode)) {
+    lru_touch_locked(path, st.st_size);
+    pbmemfs_lru_files[path].main_thread_ = main_thread;
+  }
+}
 
-// the file data itself for /persistent is actually mounted here.
-// our fuse-based code supporting the /persistent directory is a
-// redirect to this location, and then a background thread mirrors
-// everything to /.html5fs_shadow
-std::string mem_shadow_name = "/.memfs_shadow";
+// 'fd' is about to be closed.  When the file might have been written
+// to, 'path' is its current path, so its size can be updated
+void lru_close(int fd, const std::string* path)
+{
+  struct stat st;
+  if (pbmemfs_memory_budget.load() == 0 || fstat(fd, &st) != 0)
+    return;
+  bool over;
+  {
+    std::lock_guard<std::mutex> lk(pbmemfs_lru_mtx);
+    auto it = pbmemfs_open_inos.find(st.st_ino);
+    if (it != pbmemfs_open_inos.end() && --it->second == 0)
+      pbmemfs_open_inos.erase(it);
+    if (path && pbmemfs_lru_files.count(*path) != 0)
+      lru_touch_locked(*path, st.st_size);
+    over = pbmemfs_resident_bytes > pbmemfs_memory_budget.load();
+  }
+  if (over)
+    want_eviction();
+}
 
-// data structures we use to coordinate tasks on the background thread
-std::list<std::pair<void (*)(void*), void*> >   pbmemfs_task_list;
-std::mutex                                      pbmemfs_mtx;
-std::condition_variable                         pbmemfs_cnd;
+void lru_remove(const std::string& path)
+{
+  if (pbmemfs_memory_budget.load() == 0)
+    return;
+  std::lock_guard<std::mutex> lk(pbmemfs_lru_mtx);
+  auto it = pbmemfs_lru_files.find(path);
+  if (it != pbmemfs_lru_files.end())
+    lru_remove_locked(it);
+}
 
-// thread proc that runs forever, waiting for new "tasks"
-// to show up in the pbmemfs_task_list.  It executes them
-// when it gets them.
-void pbmemfs_worker()
+// anything at new_path has been replaced, and everything at,
+// or below, path is now at, or below, new_path
+void lru_rename(const std::string& path, const std::string& new_path)
 {
-  bool printed_sleep = true;
-  while (true) {
-    std::pair<void (*)(void*), void*> task;
-    {
-      std::unique_lock<std::mutex> lk(pbmemfs_mtx);
-#if 1
-      pbmemfs_cnd.wait(lk, []{return !pbmemfs_task_list.empty();});
-#else
-      while (pbmemfs_task_list.empty()) {
-        if (!printed_sleep) {
-          printed_sleep = true;
-          printf("no more tasks waiting, sleeping\n");
-        }
-        pbmemfs_cnd.wait(lk);
-      }
+  if (pbmemfs_memory_budget.load() == 0)
+    return;
+  std::lock_guard<std::mutex> lk(pbmemfs_lru_mtx);
+  auto it = pbmemfs_lru_files.find(new_path);
+  if (it != pbmemfs_lru_files.end())
+    lru_remove_locked(it);
+  std::vector<std::pair<std::string, lru_file>> moved;
+  it = pbmemfs_lru_files.lower_bound(path);
+  while (it != pbmemfs_lru_files.end() && it->first.compare(0, path.size(), path) == 0) {
+    if (it->first.size() == path.size() || it->first[path.size()] == '/') {
+      moved.emplace_back(new_path + it->first.substr(path.size()), it->second);
+      auto next = std::next(it);
+      lru_remove_locked(it);
+      it = next;
+    } else
+      ++it;
+  }
+  for (auto& m : moved) {
+    lru_touch_locked(m.first, m.second.size_);
+    pbmemfs_lru_files[m.first].main_thread_ = m.second.main_thread_;
+  }
+}
 
-      if (printed_sleep) {
-        printed_sleep = false;
-        printf("tasks queued, working on them\n");
-      }
-#endif
-      task = pbmemfs_task_list.front();
-      pbmemfs_task_list.pop_front();
+// turn closed files back into placeholders, least recently used first,
+// until the files in memory fit in the budget.  Only called on pbmemfs_worker,
+// when it has run out of tasks.  An evicted file must not have any html5fs
+// changes still queued for it, which is why this gives up if it can't get
+// pbmemfs_evict_mtx, or if anything is waiting in pbmemfs_ring -- since
+// the ops hold the lock while queueing their tasks, that means everything
+// done to memfs so far has also been done to html5fs.
+void evict_cold_files()
+{
+  auto budget = pbmemfs_memory_budget.load();
+  if (budget == 0 || pbmemfs_journal.load())
+    return;
+  std::unique_lock<std::shared_timed_mutex> ex(pbmemfs_evict_mtx, std::try_to_lock);
+  if (!ex.owns_lock() || pbmemfs_task_ready())
+    return;
+  
+  std::lock_guard<std::mutex> lk(pbmemfs_lru_mtx);
+  auto it = pbmemfs_lru.end();
+  while (pbmemfs_resident_bytes > budget && it != pbmemfs_lru.begin()) {
+    --it;
+    auto fit = pbmemfs_lru_files.find(*it);
+    auto mem_path = mem_shadow_name + *it;
+    struct stat st;
+    if (stat(mem_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+      // gone, or nothing to evict
+      it = std::next(it);
+      lru_remove_locked(fit);
+      continue;
+    }
+    if (pbmemfs_open_inos.count(st.st_ino) != 0 || fit->second.main_thread_)
+      continue;
+    
+    add_lazy_file(*it, st.st_size);
+    if (truncate(mem_path.c_str(), 0) != 0) {
+      fprintf(stderr, "truncate(%s, 0) failed with errno: %d\n", mem_path.c_str(), errno);
+      drop_lazy_file(*it);
+      continue;
     }
-    task.first(task.second);
+    struct timeval tv[2] = {};
+    tv[0].tv_sec = st.st_atime;
+    tv[1].tv_sec = st.st_mtime;
+    utimes(mem_path.c_str(), tv);
+    
+    ++pbmemfs_evictions;
+    pbmemfs_evicted_bytes += st.st_size;
+    it = std::next(it);
+    lru_remove_locked(fit);
   }
 }
 
-// given an arbitrary callable function 'f', along with an arbitrary
-// list of (copyable) arguments, add a task that will execute
-// "f(args...)", to pbmemfs_task_list and then signal pbmemfs_worker
-// to pick up and execute that task.
-//
-// for example:
-//
-//    bkg_call(foo,100,j);
-//
-// causes "foo(100,j)" to execute in the background thread
-//
-template<typename F, typename ...Args>
-auto bkg_call(F&& f, Args&&... args) -> typename std::result_of<F (Args...)>::type
+// how long the oldest change that hasn't been copied to html5fs has been
+// waiting -- either as a queued task, or as a range recorded in an open file
+uint64_t mirror_lag_ns()
 {
-  auto b = std::bind(f, std::forward<Args>(args)...);
-  using function_type = decltype(b);
-  auto p = new function_type(b);
-    
-  std::unique_lock<std::mutex> lk(pbmemfs_mtx);
-  pbmemfs_task_list.push_back(std::make_pair<void (*)(void*), void*>(
-    [] (void* _f)
-    {
-      function_type* f = static_cast<function_type*>(_f);
-      (*f)();
-      delete f;
-    }, p)
-                            );
-  pbmemfs_cnd.notify_one();
+  auto now = now_ns();
+  auto oldest = now;
+  auto pos = pbmemfs_dequeue_pos.load(std::memory_order_relaxed);
+  auto& task = pbmemfs_ring[pos & (pbmemfs_ring_size-1)];
+  if (task.seq_.load(std::memory_order_acquire) == pos + 1)
+    oldest = std::min(oldest, task.queued_ns_.load(std::memory_order_relaxed));
+  
+  std::lock_guard<std::mutex> lk(pbmemfs_files_mtx);
+  for (auto fr : pbmemfs_files) {
+    std::lock_guard<std::mutex> lk(fr->mtx_);
+    if (fr->dirty_since_ns_ != 0)
+      oldest = std::min(oldest, fr->dirty_since_ns_);
+  }
+  return now - oldest;
 }
 
-// simple data structure for when we need to keep track
-// of both the file descriptor in /.memfs_shadow as well
-// as the one in /.html5fs_shadow
-struct file_ref
+// count an open of a file that was already in memory
+// (or, when 'loaded' is true, one that had to be loaded)
+void count_cache_access(bool loaded)
 {
-  int	memfs_fd_;
-  int html5fs_fd_;
-    
-  file_ref(int memfs_fd)
-    : memfs_fd_(memfs_fd),
-      html5fs_fd_(-1)
-  {}
+  if (pbmemfs_memory_budget.load() == 0)
+    return;
+  if (loaded)
+    ++pbmemfs_cache_misses;
+  else
+    ++pbmemfs_cache_hits;
+}
+
+// the entries of one /persistent directory, as of the last time
+// pbmemfs_opendir looked.  Each entry's name is stored in names_,
+// followed by a 0, starting at offset name_.  The only parts of
+// the stat data that are kept are the ones a directory listing
+// reports, so that writes to the files don't make a snapshot stale.
+struct dir_snapshot
+{
+  struct entry
+  {
+    uint32_t  name_;
+    ino_t     ino_;
+    mode_t    mode_;
+  };
+  std::vector<entry>  ents_;
+  std::string         names_;
 };
 
-// set the 'fh' field of finfo.  If the file is writable
-// then we use an allocated datastructure (file_ref) to keep
-// track of both the file descriptor in /.memfs_shadow as well
-// as /.html5fs_shadow.  Otherwise we just keep track of the
-// the one in /.memfs_shadow
-bool set_fh(struct fuse_file_info* finfo, int flags, int fd)
+// what pbmemfs_opendir stores in finfo->fh.  index_ is the
+// offset of the next entry pbmemfs_readdir will report
+struct dir_iter
 {
-  if ((flags & O_ACCMODE) != O_RDONLY) {
-    // it is possible that it will be written to
-    auto fr = new file_ref(fd);
-    finfo->fh = reinterpret_cast<decltype(finfo->fh)>(fr);
-    return true;
-  } else {
-    // malloc'ed pointers can't have 1 in the low bit, so use that
-    // to distinguish between the two cases.
-    finfo->fh = (fd << 1) | 1;
-    return false;
+  std::shared_ptr<const dir_snapshot> snap_;
+  size_t                              index_;
+};
+
+// snapshots of recently listed directories, keyed by path within /persistent.
+// pbmemfs_dir_cache_gen counts calls to invalidate_dir, so a snapshot that
+// raced with one of them doesn't get cached.  At most pbmemfs_dir_cache_max
+// are kept, and the one listed least recently (the smallest used_) is
+// dropped to make room for another
+struct dir_cache_ent
+{
+  std::shared_ptr<const dir_snapshot> snap_;
+  uint64_t                            used_;
+};
+const size_t                                pbmemfs_dir_cache_max = 64;
+std::map<std::string, dir_cache_ent>        pbmemfs_dir_cache;
+uint64_t                                    pbmemfs_dir_cache_gen = 0;
+uint64_t                                    pbmemfs_dir_cache_tick = 0;
+std::mutex                                  pbmemfs_dir_cache_mtx;
+
+std::shared_ptr<const dir_snapshot> make_dir_snapshot(const std::string& path)
+{
+  auto snap = std::make_shared<dir_snapshot>();
+  std::string ent_path = mem_shadow_name + path + "/";
+  auto dir_len = ent_path.size();
+  
+  DIR* dir;
+  if ((dir = opendir(ent_path.c_str())) != 0) {
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != 0) {
+      ent_path.resize(dir_len);
+      ent_path += ent->d_name;
+      struct stat st;
+      if (stat(ent_path.c_str(), &st) == 0) {
+        snap->ents_.push_back({(uint32_t)snap->names_.size(), st.st_ino, st.st_mode});
+        snap->names_.append(ent->d_name, strlen(ent->d_name) + 1);
+      }
+    }
+    closedir(dir);
   }
+  return snap;
 }
 
-// get the file_ref if there is one (the file is writable)
-// or 0 if not.
-file_ref* get_fr(struct fuse_file_info* finfo)
+std::shared_ptr<const dir_snapshot> get_dir_snapshot(const std::string& path)
 {
-  if (finfo->fh & 1)
-    return 0;
-  return reinterpret_cast<file_ref*>(finfo->fh);
+  uint64_t gen;
+  {
+    std::lock_guard<std::mutex> lk(pbmemfs_dir_cache_mtx);
+    auto it = pbmemfs_dir_cache.find(path);
+    if (it != pbmemfs_dir_cache.end()) {
+      it->second.used_ = ++pbmemfs_dir_cache_tick;
+      return it->second.snap_;
+    }
+    gen = pbmemfs_dir_cache_gen;
+  }
+  auto snap = make_dir_snapshot(path);
+  std::lock_guard<std::mutex> lk(pbmemfs_dir_cache_mtx);
+  if (gen == pbmemfs_dir_cache_gen) {
+    if (pbmemfs_dir_cache.size() >= pbmemfs_dir_cache_max && pbmemfs_dir_cache.find(path) == pbmemfs_dir_cache.end()) {
+      auto oldest = pbmemfs_dir_cache.begin();
+      for (auto it = oldest; it != pbmemfs_dir_cache.end(); ++it) {
+        if (it->second.used_ < oldest->second.used_)
+          oldest = it;
+      }
+      pbmemfs_dir_cache.erase(oldest);
+    }
+    pbmemfs_dir_cache[path] = dir_cache_ent{snap, ++pbmemfs_dir_cache_tick};
+  }
+  return snap;
 }
 
-// get the primary file descriptor (for the file in
-// in /.memfs_shadow)
-int get_fd(struct fuse_file_info* finfo)
+// forget the snapshot of the directory containing 'path'.  When 'tree'
+// is true (path is a directory that has been removed or renamed) also
+// forget the snapshots of path and everything below it
+void invalidate_dir(const std::string& path, bool tree = false)
 {
-  auto fr = get_fr(finfo);
-  return fr ? fr->memfs_fd_ : finfo->fh >> 1;
+  std::lock_guard<std::mutex> lk(pbmemfs_dir_cache_mtx);
+  ++pbmemfs_dir_cache_gen;
+  if (pbmemfs_dir_cache.empty())
+    return;
+  auto slash = path.rfind('/');
+  pbmemfs_dir_cache.erase(path.substr(0, slash == 0 ? 1 : slash));
+  if (tree) {
+    auto it = pbmemfs_dir_cache.lower_bound(path);
+    while (it != pbmemfs_dir_cache.end() && it->first.compare(0, path.size(), path) == 0) {
+      if (it->first.size() == path.size() || it->first[path.size()] == '/')
+        it = pbmemfs_dir_cache.erase(it);
+      else
+        ++it;
+    }
+  }
 }
-    
+
 ///////////////////////////////////////////////////////////
 
 // Called when a filesystem of this type is initialized.
@@ -194,9 +2758,30 @@ int pbmemfs_access(const char* path, int mode)
 int pbmemfs_create(const char* _path, mode_t mode, struct fuse_file_info* finfo)
 {
   std::string path(_path);
-  int fd = open((mem_shadow_name + path).c_str(),finfo->flags,mode);
+  auto el = evict_shared_lock();
+  bool loaded = false;
+  if (finfo->flags & O_TRUNC)
+    drop_lazy_file(path);
+  else {
+    auto ret = load_lazy_file(path, &loaded);
+    if (ret != 0)
+      return ret;
+  }
+  auto jl = journal_shared_lock();
+  int fd = open((mem_shadow_name + path).c_str(),memfs_flags(finfo->flags),mode);
   if (fd >= 0) {
-    set_fh(finfo, finfo->flags, fd);
+    invalidate_dir(path);
+    count_cache_access(loaded);
+    lru_open(path, fd);
+    set_fh(finfo, finfo->flags, fd, path);
+    if (pbmemfs_journal.load()) {
+      auto rec = journal_record(jr_create).str(path).num(mode).finish();
+      if (finfo->flags & O_TRUNC)
+        rec += journal_record(jr_truncate).str(path).num(0).finish();
+      queue_journal_record(jl, std::move(rec));
+      return 0;
+    }
+    jl.unlock();
     bkg_call([](std::string path, int flags, mode_t mode, file_ref* fr)
         {
           int fd = open(path.c_str(), flags, mode);
@@ -209,7 +2794,7 @@ int pbmemfs_create(const char* _path, mode_t mode, struct fuse_file_info* finfo)
           } else
             fprintf(stderr, "open(%s, %o, %o) failed with errno: %d\n", path.c_str(), (int)flags, (int)mode, errno);
         },
-        html5_shadow_name + path, finfo->flags, mode,get_fr(finfo));
+        html5_shadow_name + path, html5fs_flags(finfo->flags), mode,get_fr(finfo));
     return 0;
   }
   return -errno;
@@ -220,8 +2805,10 @@ int pbmemfs_create(const char* _path, mode_t mode, struct fuse_file_info* finfo)
 // file.
 int pbmemfs_getattr(const char* path, struct stat* st)
 {
-  if (stat((mem_shadow_name + path).c_str(), st) == 0)
+  if (stat((mem_shadow_name + path).c_str(), st) == 0) {
+    lazy_stat(path, st);
     return 0;
+  }
   return -errno;
 }
 
@@ -239,8 +2826,38 @@ int pbmemfs_fgetattr(const char* path, struct stat* st, struct fuse_file_info* f
 // Called by fsync(). The datasync paramater is not currently supported.
 int pbmemfs_fsync(const char* path, int datasync, struct fuse_file_info* finfo)
 {
-  // this can be a no-op for us, we always sync when
-  // the io operation happens
+  // queue a flush of any writes that are still waiting
+  // to be copied to the html5fs file
+  auto fr = get_fr(finfo);
+  if (fr) {
+    // the worker needs the main thread to be running
+    // in order to write to html5fs, so never wait there
+    if (pbmemfs_blocking_fsync.load() && !pp::Module::Get()->core()->IsMainThread()) {
+      std::mutex mtx;
+      std::condition_variable cnd;
+      bool done = false;
+      bkg_call([fr, &mtx, &cnd, &done]
+              {
+                sync_file_ref(fr);
+                std::lock_guard<std::mutex> lk(mtx);
+                done = true;
+                cnd.notify_one();
+              });
+      std::unique_lock<std::mutex> lk(mtx);
+      cnd.wait(lk, [&done]{return done;});
+      return 0;
+    }
+    
+    bool queue_flush;
+    {
+      std::lock_guard<std::mutex> lk(fr->mtx_);
+      queue_flush = !fr->dirty_.empty() && !fr->flush_queued_;
+      if (queue_flush)
+        fr->flush_queued_ = true;
+    }
+    if (queue_flush)
+      bkg_call(flush_file_ref, fr);
+  }
   return 0;
 }
 
@@ -248,12 +2865,32 @@ int pbmemfs_fsync(const char* path, int datasync, struct fuse_file_info* finfo)
 int pbmemfs_ftruncate(const char* _path, off_t pos, struct fuse_file_info* finfo)
 {
   if (ftruncate(get_fd(finfo), pos) == 0) {
+    auto fr = get_fr(finfo);
+    {
+      std::lock_guard<std::mutex> lk(fr->mtx_);
+      clip_dirty(fr, pos);
+    }
+    if (pbmemfs_journal.load()) {
+      // fr->path_ is only current as of the records written so far,
+      // so the record has to be made on the worker
+      std::shared_lock<std::shared_timed_mutex> jl(pbmemfs_journal_mtx);
+      auto gen = journal_change_gen();
+      jl.unlock();
+      bkg_call([](off_t pos, file_ref* fr, uint64_t gen)
+              {
+                std::lock_guard<std::mutex> lk(fr->mtx_);
+                if (!fr->unlinked_ && gen == pbmemfs_journal_gen.load())
+                  journal_append(journal_record(jr_truncate).str(fr->path_).num(pos).finish());
+              },
+              pos, fr, gen);
+      return 0;
+    }
     bkg_call([](off_t pos, file_ref* fr)
             {
               if (ftruncate(fr->html5fs_fd_,pos))
                 fprintf(stderr, "ftruncate(%d, %d) failed with errno: %d\n", fr->html5fs_fd_, (int)pos, errno);
             },
-            pos, get_fr(finfo));
+            pos, fr);
     return 0;
   }
   return -errno;
@@ -263,7 +2900,14 @@ int pbmemfs_ftruncate(const char* _path, off_t pos, struct fuse_file_info* finfo
 int pbmemfs_mkdir(const char* _path, mode_t mode)
 {
   std::string path(_path);
+  auto jl = journal_shared_lock();
   if (mkdir((mem_shadow_name + path).c_str(), mode) == 0) {
+    invalidate_dir(path);
+    if (pbmemfs_journal.load()) {
+      queue_journal_record(jl, journal_record(jr_mkdir).str(path).num(mode).finish());
+      return 0;
+    }
+    jl.unlock();
     bkg_call([](std::string path, mode_t mode)
             {
               if (mkdir(path.c_str(), mode) != 0)
@@ -292,9 +2936,27 @@ int pbmemfs_mknod(const char* path, mode_t mode, dev_t dev)
 int pbmemfs_open(const char* _path, struct fuse_file_info* finfo)
 {
   std::string path(_path);
-  int fd = open((mem_shadow_name + path).c_str(),finfo->flags);
+  auto el = evict_shared_lock();
+  bool loaded = false;
+  if (finfo->flags & O_TRUNC)
+    drop_lazy_file(path);
+  else {
+    auto ret = load_lazy_file(path, &loaded);
+    if (ret != 0)
+      return ret;
+  }
+  auto jl = journal_shared_lock();
+  int fd = open((mem_shadow_name + path).c_str(),memfs_flags(finfo->flags));
   if (fd >= 0) {
-    if (set_fh(finfo, finfo->flags, fd))
+    count_cache_access(loaded);
+    lru_open(path, fd);
+    if (pbmemfs_journal.load()) {
+      if (set_fh(finfo, finfo->flags, fd, path) && (finfo->flags & O_TRUNC))
+        queue_journal_record(jl, journal_record(jr_truncate).str(path).num(0).finish());
+      return 0;
+    }
+    jl.unlock();
+    if (set_fh(finfo, finfo->flags, fd, path))
       bkg_call([](std::string path, int flags, file_ref* fr)
               {
                 int fd = open(path.c_str(), flags);
@@ -303,7 +2965,7 @@ int pbmemfs_open(const char* _path, struct fuse_file_info* finfo)
                 else
                   fprintf(stderr, "open(%s, %o) failed with errno: %d\n", path.c_str(), (int)flags, errno);
               },
-              html5_shadow_name + path, finfo->flags, get_fr(finfo));
+              html5_shadow_name + path, html5fs_flags(finfo->flags), get_fr(finfo));
 
     return 0;
   }
@@ -312,15 +2974,16 @@ int pbmemfs_open(const char* _path, struct fuse_file_info* finfo)
 
 // Called by getdents(), which is called by the more standard functions
 // opendir()/readdir().  NaCl's fuse implementation calls our pbmemfs_readdir
-// once for each file/dir being enumerated.  So we just call opendir
-// here, keep the DIR*, and then call readdir (once) in our pbmemfs_readdir.
-// Unfortunately, NaCl calls this function (pbmemfs_opendir) once for each
-// file/dir too, so we test to see whether we have already done the opendir
-// step.
+// once for each file/dir being enumerated.  So we take a snapshot of the
+// whole directory here (or reuse the one from the last time it was listed,
+// if nothing in it has changed since), and pbmemfs_readdir reports one entry
+// from it on each call.  Unfortunately, NaCl calls this function
+// (pbmemfs_opendir) once for each file/dir too, so we test to see whether
+// we have already done the opendir step.
 int pbmemfs_opendir(const char* path, struct fuse_file_info* finfo)
 {
   if (finfo->fh == 0)
-    finfo->fh = reinterpret_cast<decltype(finfo->fh)>(opendir((mem_shadow_name + path).c_str()));
+    finfo->fh = reinterpret_cast<decltype(finfo->fh)>(new dir_iter{get_dir_snapshot(path), 0});
   return 0;
 }
 
@@ -330,6 +2993,10 @@ int pbmemfs_opendir(const char* path, struct fuse_file_info* finfo)
 int pbmemfs_read(const char* path, char* buf, size_t count, off_t pos,
              struct fuse_file_info* finfo)
 {
+  auto fr = get_fr(finfo);
+  if (fr && (fr->flags_ & O_ACCMODE) == O_WRONLY)
+    return -EBADF;
+    
   size_t bytesRead = 0;
   while (bytesRead < count) {
     auto bytes = pread(get_fd(finfo), &buf[bytesRead], count - bytesRead, pos + bytesRead);
@@ -346,13 +3013,16 @@ int pbmemfs_read(const char* path, char* buf, size_t count, off_t pos,
 int pbmemfs_readdir(const char* path, void* buf, fuse_fill_dir_t filldir, off_t pos,
                 struct fuse_file_info* finfo)
 {
-  DIR* dir = (DIR*)finfo->fh; // see pbmemfs_opendir
-    
-  struct dirent *ent = readdir(dir);
-  if (ent) {
+  dir_iter* it = reinterpret_cast<dir_iter*>(finfo->fh); // see pbmemfs_opendir
+  auto& snap = *it->snap_;
+  if (it->index_ < snap.ents_.size()) {
+    auto& ent = snap.ents_[it->index_++];
     struct stat st;
-    if (stat((mem_shadow_name + path + "/" + ent->d_name).c_str(),&st) == 0)
-      (*filldir)(buf, ent->d_name, &st, pos);
+    memset(&st, 0, sizeof(st));
+    st.st_ino = ent.ino_;
+    st.st_mode = ent.mode_;
+    st.st_nlink = 1;
+    (*filldir)(buf, &snap.names_[ent.name_], &st, pos);
   }
     
   return 0;
@@ -363,18 +3033,33 @@ int pbmemfs_readdir(const char* path, void* buf, fuse_fill_dir_t filldir, off_t
 // called instead.
 int pbmemfs_release(const char* path, struct fuse_file_info* finfo)
 {
-  if (close(get_fd(finfo)) == 0) {
-    file_ref* fr = get_fr(finfo);
-    if (fr)
-      bkg_call([](file_ref* fr)
+  file_ref* fr = get_fr(finfo);
+  if (fr) {
+    // the memfs file stays open until the worker has
+    // copied whatever is still dirty out of it
+    {
+      std::lock_guard<std::mutex> lk(pbmemfs_files_mtx);
+      pbmemfs_files.erase(fr);
+    }
+    bkg_call([](file_ref* fr)
+            {
+              flush_file_ref(fr);
               {
-                if (close(fr->html5fs_fd_) != 0)
-                  fprintf(stderr, "close(%d) failed, errno: %d\n", fr->html5fs_fd_, errno);
-                delete fr;
-              },
-              fr);
+                std::lock_guard<std::mutex> lk(fr->mtx_);
+                lru_close(fr->memfs_fd_, fr->unlinked_ ? 0 : &fr->path_);
+              }
+              if (fr->html5fs_fd_ != -1 && close(fr->html5fs_fd_) != 0)
+                fprintf(stderr, "close(%d) failed, errno: %d\n", fr->html5fs_fd_, errno);
+              if (close(fr->memfs_fd_) != 0)
+                fprintf(stderr, "close(%d) failed, errno: %d\n", fr->memfs_fd_, errno);
+              delete fr;
+            },
+            fr);
     return 0;
   }
+  lru_close(get_fd(finfo), 0);
+  if (close(get_fd(finfo)) == 0)
+    return 0;
   return -errno;
 }
 
@@ -385,7 +3070,7 @@ int pbmemfs_releasedir(const char* path, struct fuse_file_info* finfo)
 {
   // see pbmemfs_opendir
   if (finfo->fh) {
-    closedir((DIR*)finfo->fh);
+    delete reinterpret_cast<dir_iter*>(finfo->fh);
     finfo->fh = 0;
   }
     
@@ -397,8 +3082,37 @@ int pbmemfs_rename(const char* _path, const char* _new_path)
 {
   std::string path(_path);
   std::string new_path(_new_path);
+  auto el = evict_shared_lock();
+  
+  // the html5fs rename we queue below would move the /.html5fs_shadow
+  // copies of any placeholders out from under them
+  auto ret = load_lazy_tree(path);
+  if (ret != 0)
+    return ret;
     
+  auto jl = journal_shared_lock();
   if (rename((mem_shadow_name + path).c_str(), (mem_shadow_name + new_path).c_str()) == 0) {
+    
+    drop_lazy_file(new_path);
+    lru_rename(path, new_path);
+    invalidate_dir(path, true);
+    invalidate_dir(new_path, true);
+    
+    if (pbmemfs_journal.load()) {
+      auto gen = journal_change_gen();
+      jl.unlock();
+      bkg_call([](const std::string& path, const std::string& new_path, uint64_t seq, uint64_t gen)
+              {
+                rename_open_files(path, new_path, seq);
+                if (gen == pbmemfs_journal_gen.load())
+                  journal_append(journal_record(jr_rename).str(path).str(new_path).finish());
+              },
+              path, new_path, ++pbmemfs_op_seq, gen);
+      return 0;
+    }
+    jl.unlock();
+    
+    rename_open_files(path, new_path, UINT64_MAX);
     bkg_call([](std::string path, std::string new_path)
             {
               if (rename(path.c_str(), new_path.c_str()) != 0)
@@ -426,7 +3140,15 @@ int pbmemfs_utimens(const char* _path, const struct timespec _tv[2])
   if (!_tv)
     tvp = 0;
     
+  auto jl = journal_shared_lock();
   if (utimes((mem_shadow_name + path).c_str(), *tvp) == 0) {
+    if (pbmemfs_journal.load()) {
+      struct stat st;
+      if (stat((mem_shadow_name + path).c_str(), &st) == 0)
+        queue_journal_record(jl, journal_record(jr_utimes).str(path).num(st.st_atime).num(st.st_mtime).finish());
+      return 0;
+    }
+    jl.unlock();
     bkg_call([](std::string path, const struct timeval tv[2])
             {
               if (utimes(path.c_str(), tv) != 0)
@@ -442,7 +3164,14 @@ int pbmemfs_utimens(const char* _path, const struct timespec _tv[2])
 int pbmemfs_chmod(const char* _path, mode_t mode)
 {
   std::string path(_path);
+  auto jl = journal_shared_lock();
   if (chmod((mem_shadow_name + path).c_str(), mode) == 0) {
+    invalidate_dir(path);
+    if (pbmemfs_journal.load()) {
+      queue_journal_record(jl, journal_record(jr_chmod).str(path).num(mode).finish());
+      return 0;
+    }
+    jl.unlock();
     bkg_call([](std::string path, mode_t mode)
             {
               if (chmod(path.c_str(), mode) != 0)
@@ -459,7 +3188,14 @@ int pbmemfs_chmod(const char* _path, mode_t mode)
 int pbmemfs_rmdir(const char* _path)
 {
   std::string path(_path);
+  auto jl = journal_shared_lock();
   if (rmdir((mem_shadow_name + path).c_str()) == 0) {
+    invalidate_dir(path, true);
+    if (pbmemfs_journal.load()) {
+      queue_journal_record(jl, journal_record(jr_rmdir).str(path).finish());
+      return 0;
+    }
+    jl.unlock();
     bkg_call([](std::string path)
             {
               if (rmdir(path.c_str()) != 0)
@@ -475,7 +3211,23 @@ int pbmemfs_rmdir(const char* _path)
 int pbmemfs_truncate(const char* _path, off_t pos)
 {
   std::string	path(_path);
+  auto el = evict_shared_lock();
+  if (pos == 0)
+    drop_lazy_file(path);
+  else {
+    auto ret = load_lazy_file(path);
+    if (ret != 0)
+      return ret;
+  }
+  auto jl = journal_shared_lock();
   if (truncate((mem_shadow_name + path).c_str(),pos) == 0) {
+    for_each_open_file(path, [pos](file_ref* fr){clip_dirty(fr, pos);});
+    lru_touch(path, pos);
+    if (pbmemfs_journal.load()) {
+      queue_journal_record(jl, journal_record(jr_truncate).str(path).num(pos).finish());
+      return 0;
+    }
+    jl.unlock();
     bkg_call([](std::string path, off_t pos)
             {
               if (truncate(path.c_str(),pos) != 0)
@@ -491,7 +3243,29 @@ int pbmemfs_truncate(const char* _path, off_t pos)
 int pbmemfs_unlink(const char* _path)
 {
   std::string path(_path);
+  auto el = evict_shared_lock();
+  auto jl = journal_shared_lock();
   if (unlink((mem_shadow_name + path).c_str()) == 0) {
+    drop_lazy_file(path);
+    lru_remove(path);
+    invalidate_dir(path);
+    
+    if (pbmemfs_journal.load()) {
+      auto gen = journal_change_gen();
+      jl.unlock();
+      bkg_call([](const std::string& path, uint64_t seq, uint64_t gen)
+              {
+                unlink_open_files(path, seq);
+                if (gen == pbmemfs_journal_gen.load())
+                  journal_append(journal_record(jr_unlink).str(path).finish());
+              },
+              path, ++pbmemfs_op_seq, gen);
+      return 0;
+    }
+    jl.unlock();
+    
+    // nothing written to this file from now on needs to be copied anywhere
+    unlink_open_files(path, UINT64_MAX);
     bkg_call([](std::string path)
             {
               if (unlink(path.c_str()) != 0)
@@ -508,16 +3282,20 @@ int pbmemfs_unlink(const char* _path)
 int pbmemfs_write(const char* path, const char* buf, size_t count, off_t pos,
               struct fuse_file_info* finfo)
 {
-  int ret = pwrite(get_fd(finfo), buf, count, pos);
-  if (ret != -1)
-    bkg_call([](file_ref* fr, std::vector<char> buf, off_t pos)
-            {
-              int ret;
-              if ((ret = pwrite(fr->html5fs_fd_, &buf.front(), buf.size(), pos)) != buf.size())
-                fprintf(stderr, "pwrite(%d, %p, %d, %d) returned unexpected value (%d instead of %d), errno: %d\n",
-                        fr->html5fs_fd_, &buf.front(), (int)buf.size(), (int)pos, ret, (int)buf.size(), errno);
-            },
-            get_fr(finfo), std::vector<char>(buf,&buf[ret]), pos);
+  auto fr = get_fr(finfo);
+  if (!fr)
+    return -EBADF;
+  int ret = pwrite(fr->memfs_fd_, buf, count, pos);
+  if (ret == -1)
+    return -errno;
+    
+  // with O_APPEND the data lands at the end of the file, regardless of pos
+  if (fr->flags_ & O_APPEND) {
+    struct stat st;
+    if (fstat(fr->memfs_fd_, &st) == 0)
+      pos = st.st_size - ret;
+  }
+  add_dirty(fr, pos, ret);
   return ret;
 }
 
@@ -531,120 +3309,77 @@ struct fuse_operations pbmemfs_ops = {
     
   pbmemfs_init,
   pbmemfs_destroy,
-  pbmemfs_access,
-  pbmemfs_create,
-  pbmemfs_fgetattr,
-  pbmemfs_fsync,
-  pbmemfs_ftruncate,
-  pbmemfs_getattr,
-  pbmemfs_mkdir,
-  pbmemfs_mknod,
-  pbmemfs_open,
-  pbmemfs_opendir,
-  pbmemfs_read,
-  pbmemfs_readdir,
-  pbmemfs_release,
-  pbmemfs_releasedir,
-  pbmemfs_rename,
-  pbmemfs_rmdir,
-  pbmemfs_truncate,
-  pbmemfs_unlink,
-  pbmemfs_write
-    
-#else
-
-  pbmemfs_getattr,
-  0,                  // readlink
+  MS_TIMED(pbmemfs_access),
+  MS_TIMED(pbmemfs_create),
+  MS_TIMED(pbmemfs_fgetattr),
+  MS_TIMED(pbmemfs_fsync),
+  MS_TIMED(pbmemfs_ftruncate),
+  MS_TIMED(pbmemfs_getattr),
+  MS_TIMED(pbmemfs_mkdir),
   pbmemfs_mknod,
-  pbmemfs_mkdir,
-  pbmemfs_unlink,
-  pbmemfs_rmdir,
-  0,                  // symlink
-  pbmemfs_rename,
-  0,                  // link
-  pbmemfs_chmod,
-  0,                  // chown
-  pbmemfs_truncate,
-  pbmemfs_open,
-  pbmemfs_read,
-  pbmemfs_write,
-  0,                  // statfs
-  0,                  // flush
-  pbmemfs_release,
-  pbmemfs_fsync,
-  0,                  // setxattr
-  0,                  // getxattr
-  0,                  // listxattr
-  0,                  // removexattr
-  pbmemfs_opendir,
-  pbmemfs_readdir,
-  pbmemfs_releasedir,
-  0,                  // fsyncdir
-  pbmemfs_init,
-  pbmemfs_destroy,
-  pbmemfs_access,
-  pbmemfs_create,
-  pbmemfs_ftruncate,
-  pbmemfs_fgetattr,
-  0,                  // lock
-  pbmemfs_utimens
-
-#endif
-
-};
-
-// copy the contents of 'from' to 'to'
-void file_cp(const char *to, const char *from)
-{
-  auto from_f = open(from, O_RDONLY);
-  if (from_f == -1) {
-    fprintf(stderr, "open(\"%s\", O_RDONLY) failed with errno: %d\n", from, errno);
-    return;
-  }
-    
-  auto to_f = open(to, O_CREAT | O_WRONLY, 0666);
-  if (to_f == -1) {
-    fprintf(stderr, "open(\"%s\", O_CREAT | O_WRONLY) failed with errno: %d\n", to, errno);
-    close(from_f);
-    return;
-  }
-    
-  while (true) {
-    char buf[4096];
-    auto nread = read(from_f, buf, sizeof(buf));
-    if (nread == 0)
-      break;
-    if (nread == -1) {
-      fprintf(stderr, "read(%d, %p, %d) failed with errno: %d\n", from_f, buf, (int)sizeof(buf), errno);
-      return;
-    }
-    int written = 0;
-    while (written < nread) {
-      auto bytes = write(to_f, &buf[written], nread - written);
-      if (bytes == -1) {
-        fprintf(stderr, "write(%d, %p, %d) failed with errno: %d\n", to_f, &buf[written], nread-written, errno);
-        return;
-      }
-      written += bytes;
-    }
-  }
-    
-  close(to_f);
-  close(from_f);
+  MS_TIMED(pbmemfs_open),
+  MS_TIMED(pbmemfs_opendir),
+  MS_TIMED(pbmemfs_read),
+  MS_TIMED(pbmemfs_readdir),
+  MS_TIMED(pbmemfs_release),
+  MS_TIMED(pbmemfs_releasedir),
+  MS_TIMED(pbmemfs_rename),
+  MS_TIMED(pbmemfs_rmdir),
+  MS_TIMED(pbmemfs_truncate),
+  MS_TIMED(pbmemfs_unlink),
+  MS_TIMED(pbmemfs_write)
     
-  struct stat st;
-  if (stat(from, &st) != 0) {
-    fprintf(stderr, "stat(%s, %p) failed with errno: %d\n", from, &st, errno);
-    return;
-  }
-  if ((st.st_mode & 0777) != 0666) {
-    if (chmod(to, st.st_mode & 0777) != 0)
-      fprintf(stderr, "chmod(%s, 0%o) failed with errno: %d\n", to, (int)(st.st_mode & O_ACCMODE), errno);
-  }
-}
+#else
+
+  MS_TIMED(pbmemfs_getattr),
+  0,                  // readlink
+  pbmemfs_mknod,
+  MS_TIMED(pbmemfs_mkdir),
+  MS_TIMED(pbmemfs_unlink),
+  MS_TIMED(pbmemfs_rmdir),
+  0,                  // symlink
+  MS_TIMED(pbmemfs_rename),
+  0,                  // link
+  MS_TIMED(pbmemfs_chmod),
+  0,                  // chown
+  MS_TIMED(pbmemfs_truncate),
+  MS_TIMED(pbmemfs_open),
+  MS_TIMED(pbmemfs_read),
+  MS_TIMED(pbmemfs_write),
+  0,                  // statfs
+  0,                  // flush
+  MS_TIMED(pbmemfs_release),
+  MS_TIMED(pbmemfs_fsync),
+  0,                  // setxattr
+  0,                  // getxattr
+  0,                  // listxattr
+  0,                  // removexattr
+  MS_TIMED(pbmemfs_opendir),
+  MS_TIMED(pbmemfs_readdir),
+  MS_TIMED(pbmemfs_releasedir),
+  0,                  // fsyncdir
+  pbmemfs_init,
+  pbmemfs_destroy,
+  MS_TIMED(pbmemfs_access),
+  MS_TIMED(pbmemfs_create),
+  MS_TIMED(pbmemfs_ftruncate),
+  MS_TIMED(pbmemfs_fgetattr),
+  0,                  // lock
+  MS_TIMED(pbmemfs_utimens)
+
+#endif
 
-// copy the contents of /.html5fs_shadow/dirName to /.memfs_shadow/dirName (recursively)
-void do_sync(const std::string& dirName)
+};
+
+// number of threads load_startup_files uses, and the paths (relative
+// to /persistent, without a leading '/') that it loads first
+std::atomic<int>            pbmemfs_sync_threads(4);
+std::vector<std::string>    pbmemfs_priority_paths;
+
+// create the directory structure of /.html5fs_shadow/dirName in /.memfs_shadow/dirName
+// (recursively), along with a placeholder for each non-empty file (see lazy_file).
+// The paths of those placeholders are added to 'files'
+void do_sync(const std::string& dirName, std::vector<std::string>& files)
 {
   std::string html5_dir = html5_shadow_name + "/" + dirName;
   std::string mem_dir = mem_shadow_name + "/" + dirName;
@@ -661,10 +3396,17 @@ void do_sync(const std::string& dirName)
         if (stat(html5_path.c_str(),&st) == 0) {
           if (S_ISDIR(st.st_mode)) {
             mkdir(mem_path.c_str(),0777);
-            do_sync(dirName + "/" + ent->d_name);
+            do_sync(dirName + "/" + ent->d_name, files);
           } else {
-            // copy the contents
-            file_cp(mem_path.c_str(),html5_path.c_str());
+            auto fd = open(mem_path.c_str(), O_CREAT | O_WRONLY, st.st_mode & 0777);
+            if (fd != -1) {
+              close(fd);
+              if (st.st_size != 0) {
+                files.push_back("/" + dirName + "/" + ent->d_name);
+                add_lazy_file(files.back(), st.st_size);
+              }
+            } else
+              fprintf(stderr, "open(\"%s\", O_CREAT | O_WRONLY) failed with errno: %d\n", mem_path.c_str(), errno);
           }
         }
       }
@@ -673,6 +3415,64 @@ void do_sync(const std::string& dirName)
   }
 }
 
+// is 'path' one of pbmemfs_priority_paths, or inside of one of them?
+bool is_priority_path(const std::string& path)
+{
+  for (auto& p : pbmemfs_priority_paths) {
+    if (path.compare(1, p.size(), p) == 0 && (path.size() == p.size() + 1 || path[p.size() + 1] == '/'))
+      return true;
+  }
+  return false;
+}
+
+// load the contents of the placeholders in 'files', using pbmemfs_sync_threads
+// threads, starting with any that are priority paths.  Returns once the priority
+// files have been loaded -- or all of them if there are no priority files.  In
+// lazy mode, or with a memory budget, only the priority files are loaded, the
+// rest wait until they are opened
+void load_startup_files(std::vector<std::string> files)
+{
+  auto priority_end = std::stable_partition(files.begin(), files.end(), is_priority_path);
+  size_t num_priority = priority_end - files.begin();
+  if (pbmemfs_lazy_load.load() || pbmemfs_memory_budget.load() != 0)
+    files.erase(priority_end, files.end());
+  if (files.empty())
+    return;
+  
+  struct loader
+  {
+    std::vector<std::string>  files_;
+    size_t                    startup_count_;
+    std::atomic<size_t>       next_;
+    size_t                    startup_done_;
+    std::mutex                mtx_;
+    std::condition_variable   cnd_;
+  };
+  auto l = std::make_shared<loader>();
+  l->files_ = std::move(files);
+  l->startup_count_ = num_priority != 0 ? num_priority : l->files_.size();
+  l->next_ = 0;
+  l->startup_done_ = 0;
+  
+  auto num_threads = std::max(1, std::min(pbmemfs_sync_threads.load(), (int)l->files_.size()));
+  for (int i = 0; i < num_threads; i++) {
+    std::thread([l]{
+      size_t next;
+      while ((next = l->next_++) < l->files_.size()) {
+        load_lazy_file(l->files_[next]);
+        if (next < l->startup_count_) {
+          std::lock_guard<std::mutex> lk(l->mtx_);
+          if (++l->startup_done_ == l->startup_count_)
+            l->cnd_.notify_all();
+        }
+      }
+    }).detach();
+  }
+  
+  std::unique_lock<std::mutex> lk(l->mtx_);
+  l->cnd_.wait(lk, [l]{return l->startup_done_ == l->startup_count_;});
+}
+
 // assumes that the target directory is currently empty, and
 // duplicates the entire directory structure under /.html5fs_shadow/...
 // to /.memfs_shadow/...  We run this in a background thread because
@@ -681,10 +3481,22 @@ void do_sync(const std::string& dirName)
 // main thread is not blocked, waiting for this to complete)
 void populate_memfs(std::vector<std::string> persistent_dirs)
 {
+  bool journal = pbmemfs_journal.load();
   for (auto dir : persistent_dirs) {
-    mkdir_p(html5_shadow_name + "/" + dir);
+    if (!journal)
+      mkdir_p(html5_shadow_name + "/" + dir);
     mkdir_p(mem_shadow_name + "/" + dir);
-    do_sync(dir);
+  }
+  
+  // with no journal yet, import whatever the non-journal mode left in
+  // /.html5fs_shadow, and start the journal off with an image of that
+  if (!journal || !replay_journal()) {
+    std::vector<std::string> files;
+    for (auto dir : persistent_dirs)
+      do_sync(dir, files);
+    load_startup_files(std::move(files));
+    if (journal)
+      compact_journal();
   }
    
   MS_AsyncStartupComplete();
@@ -747,29 +3559,6 @@ void clear_all()
 
 #if defined(MS_HAS_RESOURCES)
 
-const mutantspider::rez_dir_ent* get_dir_ent(const std::string& path,const mutantspider::rez_dir* dir)
-{
-  // path always starts with a '/'
-    
-  auto pos = path.find("/",1);
-  auto d_name = path.substr(1,pos == std::string::npos ? path.length() - 1 : pos - 1);
-  for (size_t i = 0; i < dir->num_ents; i++) {
-    if (d_name == dir->ents[i].d_name) {
-      if (pos == std::string::npos)
-        return &dir->ents[i];
-      if (dir->ents[i].is_dir != 0)
-        return get_dir_ent(path.substr(pos, path.length() - pos), dir->ents[i].ptr.dir);
-      return 0;
-    }
-  }
-  return 0;
-}
-
-const mutantspider::rez_dir_ent* get_dir_ent(const std::string& path)
-{
-  return path == "/" ? &mutantspider::rez_root_dir_ent : get_dir_ent(path, &mutantspider::rez_root_dir);
-}
-
 // Called when a filesystem of this type is initialized.
 void* rezfs_init(struct fuse_conn_info* conn)
 {
@@ -869,6 +3658,11 @@ int rezfs_open(const char* path, struct fuse_file_info* finfo)
   if (ent) {
   if ((finfo->flags & O_ACCMODE) != O_RDONLY)
     return -EROFS;
+  if (!ent->is_dir) {
+    auto err = rez_pack_load(ent->ptr.file);
+    if (err != 0)
+      return -err;
+  }
   finfo->fh = reinterpret_cast<decltype(finfo->fh)>(ent);
   return 0;
   }
@@ -906,18 +3700,13 @@ int rezfs_opendir(const char* path, struct fuse_file_info* finfo)
 
 // Called by read(). Note that FUSE specifies that all reads will fill the
 // entire requested buffer. If this function returns less than that, the
-// remainder of the buffer is zeroed.
+// remainder of the buffer is zeroed -- so a corrupt block has to be an
+// error, not a short read.
 int rezfs_read(const char* path, char* buf, size_t count, off_t pos,
              struct fuse_file_info* finfo)
 {
   const mutantspider::rez_dir_ent* ent = reinterpret_cast<const mutantspider::rez_dir_ent*>(finfo->fh);
-  if ((size_t)pos > ent->ptr.file->file_data_sz)
-    pos = (off_t)ent->ptr.file->file_data_sz;
-  size_t mx_count = ent->ptr.file->file_data_sz - (size_t)pos;
-  if (count > mx_count)
-    count = mx_count;
-  memcpy(buf, &ent->ptr.file->file_data[pos], count);
-  return (int)count;
+  return (int)rez_read(ent->ptr.file, buf, count, (size_t)pos);
 }
 
 // (big, long comment from fuse.h omitted)
@@ -1037,63 +3826,63 @@ struct fuse_operations rezfs_ops = {
     
   rezfs_init,
   rezfs_destroy,
-  rezfs_access,
-  rezfs_create,
-  rezfs_fgetattr,
-  rezfs_fsync,
-  rezfs_ftruncate,
-  rezfs_getattr,
-  rezfs_mkdir,
+  MS_TIMED(rezfs_access),
+  MS_TIMED(rezfs_create),
+  MS_TIMED(rezfs_fgetattr),
+  MS_TIMED(rezfs_fsync),
+  MS_TIMED(rezfs_ftruncate),
+  MS_TIMED(rezfs_getattr),
+  MS_TIMED(rezfs_mkdir),
   rezfs_mknod,
-  rezfs_open,
-  rezfs_opendir,
-  rezfs_read,
-  rezfs_readdir,
-  rezfs_release,
-  rezfs_releasedir,
-  rezfs_rename,
-  rezfs_rmdir,
-  rezfs_truncate,
-  rezfs_unlink,
-  rezfs_write
+  MS_TIMED(rezfs_open),
+  MS_TIMED(rezfs_opendir),
+  MS_TIMED(rezfs_read),
+  MS_TIMED(rezfs_readdir),
+  MS_TIMED(rezfs_release),
+  MS_TIMED(rezfs_releasedir),
+  MS_TIMED(rezfs_rename),
+  MS_TIMED(rezfs_rmdir),
+  MS_TIMED(rezfs_truncate),
+  MS_TIMED(rezfs_unlink),
+  MS_TIMED(rezfs_write)
     
 #else
 
-  rezfs_getattr,
+  MS_TIMED(rezfs_getattr),
   0,                  // readlink
   rezfs_mknod,
-  rezfs_mkdir,
-  rezfs_unlink,
-  rezfs_rmdir,
+  MS_TIMED(rezfs_mkdir),
+  MS_TIMED(rezfs_unlink),
+  MS_TIMED(rezfs_rmdir),
   0,                  // symlink
-  rezfs_rename,
+  MS_TIMED(rezfs_rename),
   0,                  // link
-  rezfs_chmod,
+  MS_TIMED(rezfs_chmod),
   0,                  // chown
-  rezfs_truncate,
-  rezfs_open,
-  rezfs_read,
-  rezfs_write,
+  MS_TIMED(rezfs_truncate),
+  MS_TIMED(rezfs_open),
+  MS_TIMED(rezfs_read),
+  MS_TIMED(rezfs_write),
   0,                  // statfs
   0,                  // flush
-  rezfs_release,
-  rezfs_fsync,
+  MS_TIMED(rezfs_release),
+  MS_TIMED(rezfs_fsync),
   0,                  // setxattr
   0,                  // getxattr
   0,                  // listxattr
   0,                  // removexattr
-  rezfs_opendir,
-  rezfs_readdir,
-  rezfs_releasedir,
+  MS_TIMED(rezfs_opendir),
+  MS_TIMED(rezfs_readdir),
+  MS_TIMED(rezfs_releasedir),
   0,                  // fsyncdir
   rezfs_init,
   rezfs_destroy,
-  rezfs_access,
-  rezfs_create,
-  rezfs_ftruncate,
-  rezfs_fgetattr,
+  MS_TIMED(rezfs_access),
+  MS_TIMED(rezfs_create),
+  MS_TIMED(rezfs_ftruncate),
+  MS_TIMED(rezfs_fgetattr),
   0,                  // lock
-  rezfs_utimens
+  MS_TIMED(rezfs_utimens)
 
 #endif
 
@@ -1101,6 +3890,195 @@ struct fuse_operations rezfs_ops = {
 
 #endif
 
+
+#if !defined(MS_NO_FS_STATS)
+
+// /.ms is a small, read-only file system holding one file, "stats", whose
+// contents are made from mutantspider::fs_stats() each time it is opened
+
+// Called by access()
+int statsfs_access(const char* path, int mode)
+{
+  if (strcmp(path, "/") && strcmp(path, "/stats"))
+    return -ENOENT;
+  return (mode & W_OK) ? -EACCES : 0;
+}
+
+// Called by stat()/fstat(), but only when fuse_operations.fgetattr is NULL.
+// Also called by open() to determine if the path is a directory or a regular
+// file.
+int statsfs_getattr(const char* path, struct stat* st)
+{
+  memset(st, 0, sizeof(*st));
+  if (!strcmp(path, "/")) {
+    st->st_ino = 1;
+    st->st_nlink = 2;
+    st->st_mode = S_IFDIR | S_IRUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+    return 0;
+  }
+  if (!strcmp(path, "/stats")) {
+    st->st_ino = 2;
+    st->st_nlink = 1;
+    st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    st->st_size = fs_stats_text().size();
+    return 0;
+  }
+  return -ENOENT;
+}
+
+// Called by fstat()
+int statsfs_fgetattr(const char* path, struct stat* st, struct fuse_file_info* finfo)
+{
+  auto ret = statsfs_getattr(path, st);
+  if (ret == 0 && finfo->fh != 0 && S_ISREG(st->st_mode))
+    st->st_size = reinterpret_cast<std::string*>(finfo->fh)->size();
+  return ret;
+}
+
+// Called by open()
+int statsfs_open(const char* path, struct fuse_file_info* finfo)
+{
+  if (strcmp(path, "/stats"))
+    return -ENOENT;
+  if ((finfo->flags & O_ACCMODE) != O_RDONLY)
+    return -EACCES;
+  finfo->fh = reinterpret_cast<decltype(finfo->fh)>(new std::string(fs_stats_text()));
+  return 0;
+}
+
+// Called by read(). Note that FUSE specifies that all reads will fill the
+// entire requested buffer. If this function returns less than that, the
+// remainder of the buffer is zeroed.
+int statsfs_read(const char* path, char* buf, size_t count, off_t pos,
+             struct fuse_file_info* finfo)
+{
+  auto text = reinterpret_cast<std::string*>(finfo->fh);
+  if ((size_t)pos >= text->size())
+    return 0;
+  count = std::min(count, text->size() - (size_t)pos);
+  memcpy(buf, &(*text)[pos], count);
+  return (int)count;
+}
+
+// Called when the last reference to this node is released. This is only
+// called for regular files. For directories, fuse_operations.releasedir is
+// called instead.
+int statsfs_release(const char* path, struct fuse_file_info* finfo)
+{
+  delete reinterpret_cast<std::string*>(finfo->fh);
+  finfo->fh = 0;
+  return 0;
+}
+
+// Called by getdents(), which is called by the more standard functions
+// opendir()/readdir().  As with rezfs, fh holds the index of the next
+// entry to report, offset by one so that it isn't zero
+int statsfs_opendir(const char* path, struct fuse_file_info* finfo)
+{
+  if (strcmp(path, "/"))
+    return -ENOTDIR;
+  if (finfo->fh == 0)
+    finfo->fh = 1;
+  return 0;
+}
+
+// (big, long comment from fuse.h omitted)
+int statsfs_readdir(const char* path, void* buf, fuse_fill_dir_t filldir, off_t pos,
+                struct fuse_file_info* finfo)
+{
+  static const char* names[] = {".", "..", "stats"};
+  auto index = finfo->fh - 1;
+  if (index < sizeof(names) / sizeof(names[0])) {
+    struct stat st;
+    statsfs_getattr(index == 2 ? "/stats" : "/", &st);
+    ++finfo->fh;
+    (*filldir)(buf, names[index], &st, pos);
+  }
+  return 0;
+}
+
+// Called when the last reference to this node is released. This is only
+// called for directories. For regular files, fuse_operations.release is
+// called instead.
+int statsfs_releasedir(const char* path, struct fuse_file_info* finfo)
+{
+  finfo->fh = 0;
+  return 0;
+}
+
+// the data structure we give to fuse
+struct fuse_operations statsfs_ops = {
+    
+  0,
+  0,
+
+#if PPAPI_RELEASE < 39
+    
+  0,                  // init
+  0,                  // destroy
+  statsfs_access,
+  0,                  // create
+  statsfs_fgetattr,
+  0,                  // fsync
+  0,                  // ftruncate
+  statsfs_getattr,
+  0,                  // mkdir
+  0,                  // mknod
+  statsfs_open,
+  statsfs_opendir,
+  statsfs_read,
+  statsfs_readdir,
+  statsfs_release,
+  statsfs_releasedir,
+  0,                  // rename
+  0,                  // rmdir
+  0,                  // truncate
+  0,                  // unlink
+  0                   // write
+    
+#else
+
+  statsfs_getattr,
+  0,                  // readlink
+  0,                  // mknod
+  0,                  // mkdir
+  0,                  // unlink
+  0,                  // rmdir
+  0,                  // symlink
+  0,                  // rename
+  0,                  // link
+  0,                  // chmod
+  0,                  // chown
+  0,                  // truncate
+  statsfs_open,
+  statsfs_read,
+  0,                  // write
+  0,                  // statfs
+  0,                  // flush
+  statsfs_release,
+  0,                  // fsync
+  0,                  // setxattr
+  0,                  // getxattr
+  0,                  // listxattr
+  0,                  // removexattr
+  statsfs_opendir,
+  statsfs_readdir,
+  statsfs_releasedir,
+  0,                  // fsyncdir
+  0,                  // init
+  0,                  // destroy
+  statsfs_access,
+  0,                  // create
+  0,                  // ftruncate
+  statsfs_fgetattr,
+  0,                  // lock
+  0                   // utimens
+
+#endif
+
+};
+
+#endif
 }
 
 namespace mutantspider
@@ -1113,6 +4091,11 @@ void init_fs()
   umount("/");
   mount("", "/", "memfs", 0, "");
   
+  #if !defined(MS_NO_FS_STATS)
+    nacl_io_register_fs_type("ms_stats_fs", &statsfs_ops);
+    mount("", "/.ms", "ms_stats_fs", 0, "");
+  #endif
+  
   #if defined(MS_HAS_RESOURCES)
     nacl_io_register_fs_type("rez_fs", &rezfs_ops);
     mount("", "/resources", "rez_fs", 0, "");
@@ -1125,6 +4108,15 @@ void mount_fs(const std::vector<std::string>& persistent_dirs)
     MS_AsyncStartupComplete();
     ms_async_startup_complete();
   } else {
+    init_pbmemfs_ring();
+    pbmemfs_mounted = true;
+    if (pbmemfs_journal.load()) {
+      // replay needs the whole tree in memory, and loads it in one pass
+      pbmemfs_journal_dirs = persistent_dirs;
+      pbmemfs_lazy_load = false;
+      pbmemfs_priority_paths.clear();
+      pbmemfs_memory_budget = 0;
+    }
     nacl_io_register_fs_type("persist_backed_mem_fs", &pbmemfs_ops);
         
     mount("", html5_shadow_name.c_str(), "html5fs", 0, "type=PERSISTENT,expected_size=1048576");
@@ -1140,6 +4132,139 @@ void mount_fs(const std::vector<std::string>& persistent_dirs)
   }
 }
 
+void set_persist_flush_interval(int milli)
+{
+  pbmemfs_flush_interval_ms = milli;
+  pbmemfs_wake_worker();
+}
+
+void set_persist_lazy_load(bool lazy)
+{
+  pbmemfs_lazy_load = lazy;
+}
+
+void set_persist_sync_threads(int num_threads)
+{
+  pbmemfs_sync_threads = num_threads;
+}
+
+void set_persist_priority_paths(const std::vector<std::string>& paths)
+{
+  pbmemfs_priority_paths = paths;
+}
+
+void set_persist_memory_budget(size_t bytes)
+{
+  pbmemfs_memory_budget = bytes;
+}
+
+persist_cache_stats get_persist_cache_stats()
+{
+  persist_cache_stats st;
+  st.hits = pbmemfs_cache_hits.load();
+  st.misses = pbmemfs_cache_misses.load();
+  st.evictions = pbmemfs_evictions.load();
+  st.evicted_bytes = pbmemfs_evicted_bytes.load();
+  {
+    std::lock_guard<std::mutex> lk(pbmemfs_lru_mtx);
+    st.resident_bytes = pbmemfs_resident_bytes;
+  }
+  st.budget = pbmemfs_memory_budget.load();
+  return st;
+}
+
+void set_persist_journal(bool journal)
+{
+  pbmemfs_journal = journal;
+}
+
+void set_persist_blocking_fsync(bool block)
+{
+  pbmemfs_blocking_fsync = block;
+}
+
+void set_persist_queue_limit(size_t bytes, persist_queue_policy policy)
+{
+  pbmemfs_queue_policy = policy;
+  pbmemfs_queue_limit = bytes;
+  
+  // a higher limit (or none) may release blocked writers
+  std::lock_guard<std::mutex> lk(pbmemfs_queue_mtx);
+  pbmemfs_queue_cnd.notify_all();
+}
+
+// html5fs writes are already limited to the ranges that were written
+void set_persist_chunk_size(size_t bytes)
+{
+}
+
+void persist_flush(std::function<void()> callback)
+{
+  if (!pbmemfs_mounted.load()) {
+    ms_on_main_thread(std::move(callback));
+    return;
+  }
+  
+  // tasks run in the order they were queued, so by the time this one
+  // runs, everything queued before it has been done.  That leaves the
+  // writes still recorded in open file_refs, which we do here
+  bkg_call([callback]
+          {
+            std::vector<file_ref*> files;
+            {
+              std::lock_guard<std::mutex> lk(pbmemfs_files_mtx);
+              files.assign(pbmemfs_files.begin(), pbmemfs_files.end());
+            }
+            if (pbmemfs_journal.load()) {
+              for (auto fr : files)
+                flush_file_ref(fr);
+              journal_commit();
+            } else {
+              for (auto fr : files)
+                sync_file_ref(fr);
+            }
+            auto cb = callback;
+            ms_on_main_thread(std::move(cb));
+          });
+}
+
+persist_queue_stats get_persist_queue_stats()
+{
+  persist_queue_stats st = persist_queue_stats();
+  st.tasks_queued = pbmemfs_tasks_queued.load();
+  st.enqueue_ns_total = pbmemfs_enqueue_ns_total.load();
+  st.enqueue_ns_max = pbmemfs_enqueue_ns_max.load();
+  st.depth = pbmemfs_enqueue_pos.load() - pbmemfs_dequeue_pos.load();
+  st.peak_depth = pbmemfs_peak_depth.load();
+  st.queued_bytes = pbmemfs_queued_bytes.load();
+  st.queued_bytes_peak = pbmemfs_queued_bytes_peak.load();
+  st.queue_limit_waits = pbmemfs_queue_limit_waits.load();
+  return st;
+}
+
+fs_stats_snapshot fs_stats()
+{
+  fs_stats_snapshot st;
+  #if !defined(MS_NO_FS_STATS)
+    st.ops.resize(fs_op_count);
+    for (int i = 0; i < fs_op_count; i++) {
+      auto& c = fs_counters[i];
+      auto& o = st.ops[i];
+      o.name = fs_op_names[i];
+      o.calls = c.calls_.load(std::memory_order_relaxed);
+      o.errors = c.errors_.load(std::memory_order_relaxed);
+      o.bytes = c.bytes_.load(std::memory_order_relaxed);
+      o.ns_total = c.ns_total_.load(std::memory_order_relaxed);
+      o.ns_max = c.ns_max_.load(std::memory_order_relaxed);
+      for (int b = 0; b < fs_latency_buckets; b++)
+        o.latency[b] = c.latency_[b].load(std::memory_order_relaxed);
+    }
+  #endif
+  st.queue = get_persist_queue_stats();
+  st.mirror_lag_ns = pbmemfs_mounted.load() ? mirror_lag_ns() : 0;
+  return st;
+}
+
 // end of namespace mutantspider
 }
 
@@ -1153,6 +4278,11 @@ namespace mutantspider
 
   void init_fs()
   {
+    // before any mounts, so their ops are instrumented
+    #if !defined(MS_NO_FS_STATS)
+      ms_fs_stats_enable_js();
+    #endif
+    
     #if defined(MS_HAS_RESOURCES)
       mkdir("/resources", 0777);
       ms_rez_mount("/resources", &rez_root_dir);
@@ -1173,6 +4303,106 @@ namespace mutantspider
       ms_syncfs_from_persistent();
     }
   }
+  
+  // asm.js builds write each modified file to IndexedDB when it is closed
+  void set_persist_flush_interval(int milli)
+  {
+  }
+  
+  // IDBFS always loads everything at startup
+  void set_persist_lazy_load(bool lazy)
+  {
+  }
+  
+  // IDBFS loads everything in one pass
+  void set_persist_sync_threads(int num_threads)
+  {
+  }
+  
+  void set_persist_priority_paths(const std::vector<std::string>& paths)
+  {
+  }
+  
+  // IDBFS can't reload anything synchronously, so there is nothing to evict
+  void set_persist_memory_budget(size_t bytes)
+  {
+  }
+  
+  persist_cache_stats get_persist_cache_stats()
+  {
+    return persist_cache_stats();
+  }
+  
+  // asm.js builds always use IDBFS
+  void set_persist_journal(bool journal)
+  {
+  }
+  
+  // fsync can't block in asm.js builds
+  void set_persist_blocking_fsync(bool block)
+  {
+  }
+  
+  // writes can't block in asm.js builds either
+  void set_persist_queue_limit(size_t bytes, persist_queue_policy policy)
+  {
+  }
+  
+  void set_persist_chunk_size(size_t bytes)
+  {
+    ms_persist_chunk_size_js((int)bytes);
+  }
+  
+  void persist_flush(std::function<void()> callback)
+  {
+    ms_persist_flush_js(new ms_callback_struct<std::function<void()>>(new std::function<void()>(std::move(callback))));
+  }
+  
+  // there is no background mirroring queue in asm.js builds
+  persist_queue_stats get_persist_queue_stats()
+  {
+    return persist_queue_stats();
+  }
+  
+  // the counters are kept by the js code (see MSSTATS in library_mutantspider.js)
+  fs_stats_snapshot fs_stats()
+  {
+    fs_stats_snapshot st;
+    const int vals_per_op = 5 + fs_latency_buckets;
+    const int max_ops = 64;
+    const int queue_vals = 9;
+    std::vector<double> vals(queue_vals + max_ops * vals_per_op);
+    std::vector<char> names(max_ops * 32);
+    auto num_ops = ms_fs_stats_js(&vals[0], max_ops, &names[0], (int)names.size());
+    
+    st.queue = persist_queue_stats();
+    st.queue.tasks_queued = (uint64_t)vals[0];
+    st.queue.depth = (size_t)vals[1];
+    st.queue.peak_depth = (size_t)vals[2];
+    st.mirror_lag_ns = (uint64_t)vals[3];
+    st.queue.commits = (uint64_t)vals[4];
+    st.queue.commit_entries = (uint64_t)vals[5];
+    st.queue.commit_bytes = (uint64_t)vals[6];
+    st.queue.commit_ns_total = (uint64_t)vals[7];
+    st.queue.commit_ns_max = (uint64_t)vals[8];
+    
+    const char* name = &names[0];
+    for (int i = 0; i < num_ops; i++) {
+      auto v = &vals[queue_vals + i * vals_per_op];
+      fs_op_stats o;
+      o.name = name;
+      name += o.name.size() + 1;
+      o.calls = (uint64_t)v[0];
+      o.errors = (uint64_t)v[1];
+      o.bytes = (uint64_t)v[2];
+      o.ns_total = (uint64_t)v[3];
+      o.ns_max = (uint64_t)v[4];
+      for (int b = 0; b < fs_latency_buckets; b++)
+        o.latency[b] = (uint64_t)v[5 + b];
+      st.ops.push_back(o);
+    }
+    return st;
+  }
 
 // end of namespace mutantspider
 }
@@ -4,11 +4,14 @@
 #if defined(__native_client__)
 
 #include "ppapi/cpp/var.h"
+#include "ppapi/cpp/var_array.h"
 #include "ppapi/cpp/var_array_buffer.h"
 #include "ppapi/cpp/var_dictionary.h"
 #include "ppapi/cpp/instance.h"
 #include "ppapi/cpp/module.h"
 #include "ppapi/cpp/module_embedder.h"
+#include <mutex>
+#include <vector>
 
 void ms_free_transfered_buffer(ms_transfered_buffer* tb, void* ptr)
 {
@@ -17,13 +20,138 @@ void ms_free_transfered_buffer(ms_transfered_buffer* tb, void* ptr)
   delete tb_;
 }
 
+// written by msbind.js, after this file.  Each call from javascript arrives as
+// the array [id, arg0, arg1, ...], where 'id' is the index of the function in
+// this table
+extern void (* const ms_js_to_c_table[])(const pp::VarArray& args_);
+extern const size_t ms_js_to_c_table_size;
+
+// reads the ArrayBuffer that the bind code sends when batching is turned on
+// (see the 'batch' option of <component>-bind.js).  The buffer holds a series
+// of calls, each an int32 id followed by that function's arguments: an int32
+// for 'int', a float64 for 'double', and for 'const char*' a uint32 length
+// followed by that many utf8 bytes and a 0.  Everything is little-endian
+class ms_batch_reader
+{
+public:
+  ms_batch_reader(const char* p, size_t size)
+    : p_(p),
+      end_(p + size)
+  {}
+  
+  bool read(int& v) { return read_raw(&v, sizeof(v)); }
+  bool read(double& v) { return read_raw(&v, sizeof(v)); }
+  
+  // 'v' points into the buffer, so it's only valid while the batch is being dispatched
+  bool read(const char*& v)
+  {
+    uint32_t len;
+    if (!read_raw(&len, sizeof(len)) || (size_t)(end_ - p_) <= len || p_[len] != 0)
+      return false;
+    v = p_;
+    p_ += len + 1;
+    return true;
+  }
+  
+  bool done() const { return p_ == end_; }
+  
+private:
+  bool read_raw(void* v, size_t size)
+  {
+    if ((size_t)(end_ - p_) < size)
+      return false;
+    memcpy(v, p_, size);
+    p_ += size;
+    return true;
+  }
+  
+  const char* p_;
+  const char* end_;
+};
+
+// also written by msbind.js, indexed by the same ids.  Functions that can't be
+// batched (ones that transfer memory buffers) have a null entry.  Each returns
+// false if the buffer doesn't hold all of the function's arguments
+extern bool (* const ms_js_to_c_batch_table[])(ms_batch_reader& r_);
+
+// calls to the javascript functions listed in batched_js_functions (in the
+// msbind config file) are packed into ms_c_to_js_batch, in the same format
+// ms_batch_reader reads, and posted as one ArrayBuffer every
+// ms_c_to_js_batch_interval_ms (written by msbind.js).  Calls to the other
+// javascript functions post the batch first, so everything arrives in order.
+// The mutex is held while posting for the same reason
+extern const int32_t ms_c_to_js_batch_interval_ms;
+
+static std::mutex ms_c_to_js_batch_mtx;
+static std::vector<char> ms_c_to_js_batch;
+static bool ms_c_to_js_batch_scheduled = false;
+
+static void ms_c_to_js_batch_flush()
+{
+  std::lock_guard<std::mutex> lk(ms_c_to_js_batch_mtx);
+  if (ms_c_to_js_batch.empty())
+    return;
+  pp::VarArrayBuffer buf(ms_c_to_js_batch.size());
+  memcpy(buf.Map(), &ms_c_to_js_batch[0], ms_c_to_js_batch.size());
+  buf.Unmap();
+  ms_c_to_js_batch.clear();
+  gGlobalPPInstance->PostMessage(buf);
+}
+
+static void ms_c_to_js_batch_timer(void*, int32_t)
+{
+  {
+    std::lock_guard<std::mutex> lk(ms_c_to_js_batch_mtx);
+    ms_c_to_js_batch_scheduled = false;
+  }
+  ms_c_to_js_batch_flush();
+}
+
+// one batched call, holding the lock until all of its arguments are added
+class ms_c_to_js_batch_call
+{
+public:
+  explicit ms_c_to_js_batch_call(int id)
+    : lk_(ms_c_to_js_batch_mtx)
+  {
+    put(id);
+  }
+  
+  ~ms_c_to_js_batch_call()
+  {
+    if (!ms_c_to_js_batch_scheduled) {
+      ms_c_to_js_batch_scheduled = true;
+      pp::Module::Get()->core()->CallOnMainThread(ms_c_to_js_batch_interval_ms, pp::CompletionCallback(&ms_c_to_js_batch_timer, 0));
+    }
+  }
+  
+  void put(int v) { append(&v, sizeof(v)); }
+  void put(double v) { append(&v, sizeof(v)); }
+  void put(const char* v)
+  {
+    if (!v)
+      v = "";
+    uint32_t len = strlen(v);
+    append(&len, sizeof(len));
+    append(v, len + 1);
+  }
+  
+private:
+  void append(const void* v, size_t size)
+  {
+    auto p = (const char*)v;
+    ms_c_to_js_batch.insert(ms_c_to_js_batch.end(), p, p + size);
+  }
+  
+  std::lock_guard<std::mutex> lk_;
+};
+
 class msinstance : public pp::Instance
 {
 public:
   explicit msinstance(PP_Instance instance)
     : pp::Instance(instance)
   {
-    initDispatchMap();
   }
   
   bool Init(uint32_t argc, const char* argn[], const char* argv[])
@@ -40,18 +168,24 @@ public:
   
   void HandleMessage(const pp::Var& var_message)
   {
-    if (var_message.is_dictionary())
+    if (var_message.is_array())
+    {
+      pp::VarArray args(var_message);
+      auto id = args.Get(0).AsInt();
+      if (id >= 0 && (size_t)id < ms_js_to_c_table_size)
+        ms_js_to_c_table[id](args);
+    }
+    else if (var_message.is_array_buffer())
     {
-      pp::VarDictionary d(var_message);
-      auto it = map_.find(d.Get("api").AsString());
-      if (it != map_.end()) 
-        it->second(d);
+      pp::VarArrayBuffer batch(var_message);
+      ms_batch_reader r((const char*)batch.Map(), batch.ByteLength());
+      int id;
+      while (!r.done() && r.read(id) && id >= 0 && (size_t)id < ms_js_to_c_table_size
+              && ms_js_to_c_batch_table[id] && ms_js_to_c_batch_table[id](r))
+        ;
+      batch.Unmap();
     }
   }
-  
-  void initDispatchMap();
-  
-  std::map<std::string, void (*)(const pp::VarDictionary&)> map_;
 };
 
 class msmodule : public pp::Module
@@ -70,9 +204,10 @@ pp::Module* pp::CreateModule()
 
 #else
 
+// the glue allocates the copy with MS_StagingAlloc
 void ms_free_transfered_buffer(ms_transfered_buffer* tb, void* ptr)
 {
-  free(ptr);
+  ms_staging_free(ptr);
 }
 
 
@@ -0,0 +1,126 @@
+/*
+  General Concept: called by mutantspider.mk to produce the C++ file for a resource whose <file>_COMPRESS
+  make variable is set.  The file is split into --block_size blocks and each block is compressed on its
+  own, in the LZ4 block format, so that rezfs_read/MS_RezRead (in mutantspider_fs.cpp) can decompress
+  just the blocks a read touches.  A block that doesn't get smaller is stored as-is, which the reader
+  recognizes because its stored length equals its uncompressed length.
+
+  The generated C++ is written to stdout.  It defines the same rez_file_ent as the uncompressed recipe
+  in mutantspider.mk, plus the block index that the rez_file_ent points to.
+*/
+
+"use strict"
+
+let fs = require('fs');
+let path = require('path');
+let argv = require('minimist')(process.argv.slice(2));
+let ms = require('./mutantspider.js');
+
+ms.assert(!argv.input, 'no --input argument supplied');
+ms.assert(!argv.name, 'no --name argument supplied');
+
+let block_size = +(argv.block_size || 65536);
+ms.assert(!(block_size >= 1024 && block_size < 0x80000000), 'bad --block_size: ' + argv.block_size);
+
+// the usual LZ4 limits: matches are at least 4 bytes, reach back at most
+// 64K, the last 5 bytes of a block are always literals and no match starts
+// in its last 12 bytes
+const min_match = 4;
+const max_offset = 65535;
+const last_literals = 5;
+const match_find_limit = 12;
+const hash_bits = 14;
+
+function read32(src, pos) {
+  return (src[pos] | (src[pos+1] << 8) | (src[pos+2] << 16) | (src[pos+3] << 24)) >>> 0;
+}
+
+// the output functions below write to the Buffer 'out', starting at 'pos',
+// and return the position after what they wrote
+function write_length(out, pos, len) {
+  while (len >= 255) {
+    out[pos++] = 255;
+    len -= 255;
+  }
+  out[pos++] = len;
+  return pos;
+}
+
+// one sequence: the literals in src[lit_start, lit_end), followed by a
+// match of 'match_len' bytes 'offset' bytes back (or no match, when
+// match_len is 0, which is only allowed for the last sequence)
+function write_sequence(out, pos, src, lit_start, lit_end, offset, match_len) {
+  let lit_len = lit_end - lit_start;
+  let ml = match_len ? match_len - min_match : 0;
+  out[pos++] = (Math.min(lit_len, 15) << 4) | Math.min(ml, 15);
+  if (lit_len >= 15)
+    pos = write_length(out, pos, lit_len - 15);
+  pos += src.copy(out, pos, lit_start, lit_end);
+  if (match_len) {
+    out[pos++] = offset & 255;
+    out[pos++] = offset >> 8;
+    if (ml >= 15)
+      pos = write_length(out, pos, ml - 15);
+  }
+  return pos;
+}
+
+// compress src[start, end) as one independent block.  This can write
+// up to (end - start) + (end - start)/255 + 16 bytes
+function compress_block(out, pos, src, start, end) {
+  let hash = new Int32Array(1 << hash_bits);
+  hash.fill(-1);
+  let anchor = start;
+  let cur = start;
+  while (cur + match_find_limit < end) {
+    let seq = read32(src, cur);
+    let h = Math.imul(seq, 2654435761) >>> (32 - hash_bits);
+    let ref = hash[h];
+    hash[h] = cur;
+    if (ref >= start && cur - ref <= max_offset && read32(src, ref) === seq) {
+      let len = min_match;
+      while (cur + len < end - last_literals && src[ref + len] === src[cur + len])
+        ++len;
+      pos = write_sequence(out, pos, src, anchor, cur, cur - ref, len);
+      cur += len;
+      anchor = cur;
+    } else
+      ++cur;
+  }
+  return write_sequence(out, pos, src, anchor, end, 0, 0);
+}
+
+// every block ends up no larger than its uncompressed size, so only the
+// block being compressed can run past the end of the uncompressed data
+let src = fs.readFileSync(argv.input);
+let data = Buffer.alloc(src.length + Math.floor(block_size / 255) + 16);
+let data_len = 0;
+let index = [0];
+for (let start = 0; start < src.length; start += block_size) {
+  let end = Math.min(start + block_size, src.length);
+  let block_end = compress_block(data, data_len, src, start, end);
+  if (block_end - data_len >= end - start)
+    block_end = data_len + src.copy(data, data_len, start, end);
+  data_len = block_end;
+  index.push(data_len);
+}
+data = data.slice(0, data_len);
+
+let name = argv.name;
+let out = process.stdout.fd;
+fs.writeSync(out, '// AUTO-GENERATED by mutantspider.mk, based on the contents of ' + path.basename(argv.input) + '\n' +
+                  '// DO NOT EDIT\n' +
+                  '// ' + src.length + ' bytes compressed to ' + index[index.length-1] + ' in ' + (index.length-1) + ' blocks of ' + block_size + '\n' +
+                  '\n' +
+                  '#include <mutantspider.h>\n' +
+                  '\n' +
+                  'namespace mutantspider {\n' +
+                  'const unsigned char ' + name + '_[' + (data.length + 1) + '] =\n');
+ms.write_c_string(out, data);
+fs.writeSync(out, ';\n' +
+                  'const uint32_t ' + name + '_index_[' + index.length + '] = {\n' +
+                  ' ' + index.join(', ') + '\n' +
+                  '};\n' +
+                  'extern const rez_file_ent ' + name + ';\n' +
+                  'const rez_file_ent ' + name + ' = { &' + name + '_[0], ' + src.length + ', &' + name + '_index_[0], ' + block_size + ' };\n' +
+                  '}\n');
@@ -0,0 +1,35 @@
+/*
+  General Concept: called by mutantspider.mk to produce the C++ file for a resource (one whose <file>_COMPRESS
+  make variable isn't set -- see rez_compress.js for those).  The contents of the file are written as a
+  single string literal (see write_c_string in mutantspider.js), so the time and memory it takes to compile
+  the result stay proportional to the size of the file.
+
+  The generated C++ is written to stdout.  It defines the rez_file_ent for the file, which points at the
+  array initialized from the string literal.
+*/
+
+"use strict"
+
+let fs = require('fs');
+let path = require('path');
+let argv = require('minimist')(process.argv.slice(2));
+let ms = require('./mutantspider.js');
+
+ms.assert(!argv.input, 'no --input argument supplied');
+ms.assert(!argv.name, 'no --name argument supplied');
+
+let src = fs.readFileSync(argv.input);
+let name = argv.name;
+let out = process.stdout.fd;
+fs.writeSync(out, '// AUTO-GENERATED by mutantspider.mk, based on the contents of ' + path.basename(argv.input) + '\n' +
+                  '// DO NOT EDIT\n' +
+                  '\n' +
+                  '#include <mutantspider.h>\n' +
+                  '\n' +
+                  'namespace mutantspider {\n' +
+                  'const unsigned char ' + name + '_[' + (src.length + 1) + '] =\n');
+ms.write_c_string(out, src);
+fs.writeSync(out, ';\n' +
+                  'extern const rez_file_ent ' + name + ';\n' +
+                  'const rez_file_ent ' + name + ' = { &' + name + '_[0], ' + src.length + ', 0, 0 };\n' +
+                  '}\n');
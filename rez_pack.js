@@ -0,0 +1,55 @@
+/*
+  General Concept: called by mutantspider.mk to build the file for one resource pack (see RESOURCE_PACKS in
+  README.makefile, and mutantspider::mount_rez_pack).  Each argument after --output is <path>=<source file>,
+  where <path> is where the file appears inside the pack, like "/dir/level1.dat".
+
+  The pack file is (all integers little-endian):
+
+    "MSRP", u32 version (1), u32 size of the index
+    the index: u32 number of files, then for each file
+      u32 offset of its contents from the start of the pack file, u32 size, u16 length of its path, the path
+    the contents of each file
+
+  mount_rez_pack only downloads the header and the index.  The contents of each file are downloaded the first
+  time it is read.
+*/
+
+"use strict"
+
+let fs = require('fs');
+let argv = require('minimist')(process.argv.slice(2));
+let ms = require('./mutantspider.js');
+
+ms.assert(!argv.output, 'no --output argument supplied');
+
+let files = argv._.map((arg) => {
+  let eq = arg.indexOf('=');
+  ms.assert(eq < 1 || arg[0] != '/', 'bad file argument: ' + arg);
+  return { path: arg.substr(0, eq), data: fs.readFileSync(arg.substr(eq + 1)) };
+});
+
+let index_size = 4;
+let seen = {};
+files.forEach((file) => {
+  ms.assert(seen[file.path], 'file appears twice in the pack: ' + file.path);
+  seen[file.path] = true;
+  ms.assert(Buffer.byteLength(file.path) > 0xffff, 'path too long: ' + file.path);
+  index_size += 10 + Buffer.byteLength(file.path);
+});
+
+let header = new Buffer(12 + index_size);
+header.write('MSRP', 0, 'ascii');
+header.writeUInt32LE(1, 4);
+header.writeUInt32LE(index_size, 8);
+header.writeUInt32LE(files.length, 12);
+let pos = 16;
+let offset = header.length;
+files.forEach((file) => {
+  header.writeUInt32LE(offset, pos);
+  header.writeUInt32LE(file.data.length, pos + 4);
+  header.writeUInt16LE(Buffer.byteLength(file.path), pos + 8);
+  pos += 10 + header.write(file.path, pos + 10);
+  offset += file.data.length;
+});
+
+fs.writeFileSync(argv.output, Buffer.concat([header].concat(files.map((file) => file.data))));
@@ -0,0 +1,153 @@
+/*
+  General Concept: called by mutantspider.mk to produce resource_list.cpp -- the directory tree of /resources
+  (rez_root_dir and friends) and the sorted path index (rez_path_index) -- from the manifest that
+  mutantspider.mk writes for the files in RESOURCES.  Each line of the manifest is:
+
+    <path in /resources> <C name of the file's rez_file_ent> <source file> <1 if compressed, else 0>
+
+  With --header it instead writes ms_resources.h, the table of resource paths that MS_REZ (in mutantspider.h)
+  searches at compile time.  With --display it prints the list that "make display_rez" shows.
+*/
+
+"use strict"
+
+let fs = require('fs');
+let argv = require('minimist')(process.argv.slice(2));
+let ms = require('./mutantspider.js');
+
+ms.assert(!argv.manifest, 'no --manifest argument supplied');
+ms.assert(!argv.output && !argv.header && !argv.display, 'no --output, --header or --display argument supplied');
+
+let ents = fs.readFileSync(argv.manifest, 'utf8').split('\n').filter((line) => line.length > 0).map((line) => {
+  let parts = line.split(' ');
+  ms.assert(parts.length != 4, 'bad line in ' + argv.manifest + ': ' + line);
+  return { path: parts[0], c_name: parts[1], src: parts[2], compressed: parts[3] == '1' };
+});
+
+// the order get_dir_ent's binary search expects (strcmp, on the utf8 bytes)
+function strcmp_order(a, b) {
+  return Buffer.compare(Buffer.from(a), Buffer.from(b));
+}
+
+if (argv.display) {
+  let pad = (str) => str.length >= 40 ? str : str + ' '.repeat(40 - str.length);
+  let lines = ['',
+               'List of resource files that will be available to open/fopen',
+               'at runtime, and where their contents come from, relative to',
+               'the current directory:',
+               '',
+               pad('Resource File:') + 'Original File:',
+               '==============                          =============='];
+  ents.slice().sort((a, b) => strcmp_order(a.src, b.src)).forEach((ent) => lines.push(pad('/resources' + ent.path) + ent.src));
+  lines.push('');
+  console.log(lines.join('\n'));
+  process.exit(0);
+}
+
+if (argv.header) {
+  let sorted = ents.slice().sort((a, b) => strcmp_order(a.path, b.path));
+  let out = [];
+  out.push('// AUTO-GENERATED by rez_tree.js, based on the value of the make variable RESOURCES');
+  out.push('// DO NOT EDIT');
+  out.push('');
+  out.push('#pragma once');
+  out.push('');
+  out.push('#include <mutantspider.h>');
+  out.push('');
+  out.push('namespace mutantspider {');
+  out.push('');
+  sorted.forEach((ent) => out.push('extern const rez_file_ent ' + ent.c_name + ';'));
+  out.push('');
+  out.push('namespace rez_gen {');
+  out.push('constexpr const char* paths[] = {');
+  out.push(sorted.length ? sorted.map((ent) => JSON.stringify(ent.path) + ',').join('\n') : '0');
+  out.push('};');
+  out.push('constexpr const rez_file_ent* files[] = {');
+  out.push(sorted.length ? sorted.map((ent) => '&' + ent.c_name + ',').join('\n') : '0');
+  out.push('};');
+  out.push('constexpr bool compressed[] = {');
+  out.push(sorted.length ? sorted.map((ent) => ent.compressed + ',').join('\n') : 'false');
+  out.push('};');
+  out.push('}');
+  out.push('');
+  out.push('struct rez_table');
+  out.push('{');
+  out.push('  static constexpr size_t size() { return ' + sorted.length + '; }');
+  out.push('  static constexpr const char* path(size_t i) { return rez_gen::paths[i]; }');
+  out.push('  static constexpr const rez_file_ent* file(size_t i) { return rez_gen::files[i]; }');
+  out.push('  static constexpr bool compressed(size_t i) { return rez_gen::compressed[i]; }');
+  out.push('};');
+  out.push('');
+  out.push('}');
+  fs.writeFileSync(argv.header, out.join('\n') + '\n');
+  process.exit(0);
+}
+
+// build the tree.  Each directory is { dirs: {name: dir}, files: {name: ent} }
+let root = { dirs: {}, files: {} };
+ents.forEach((ent) => {
+  let names = ent.path.split('/').filter((name) => name.length > 0);
+  ms.assert(names.length == 0, 'bad resource path: ' + ent.path);
+  let dir = root;
+  let file_name = names.pop();
+  names.forEach((name) => {
+    ms.assert(dir.files[name], 'resource ' + ent.src + ' is in ' + ent.path + ', but ' + name + ' is a file');
+    if (!dir.dirs[name])
+      dir.dirs[name] = { dirs: {}, files: {} };
+    dir = dir.dirs[name];
+  });
+  let dup = dir.files[file_name];
+  ms.assert(dup, dup && ('resources ' + dup.src + ' and ' + ent.src + ' are both ' + ent.path));
+  ms.assert(dir.dirs[file_name], 'resource ' + ent.src + ' is ' + ent.path + ', which is also a directory');
+  dir.files[file_name] = ent;
+});
+
+let out = [];
+let index = [];
+let num_dirs = 0;
+
+// write out the rez_dir (named 'c_name') for 'dir', whose path is 'path',
+// after writing the ones for all of its subdirectories (so they are defined
+// before they are referenced)
+function write_dir(dir, path, c_name) {
+  let names = Object.keys(dir.dirs).concat(Object.keys(dir.files)).sort(strcmp_order);
+  let lines = names.map((name) => {
+    let ent;
+    if (dir.dirs[name]) {
+      let sub_c_name = 'rez_dir_' + (++num_dirs);
+      write_dir(dir.dirs[name], path + '/' + name, sub_c_name);
+      ent = '{' + JSON.stringify(name) + ',{(const rez_file_ent*)&' + sub_c_name + '},true}';
+    } else
+      ent = '{' + JSON.stringify(name) + ',{&' + dir.files[name].c_name + '},false}';
+    index.push({ path: path + '/' + name, ent: ent });
+    return ent + ',';
+  });
+  out.push('const rez_dir_ent ' + c_name + '_ents[] = {');
+  out.push(lines.length ? lines.join('\n') : '{0}');
+  out.push('};');
+  out.push('const rez_dir ' + c_name + ' = { ' + lines.length + ', &' + c_name + '_ents[0] };');
+  out.push('');
+}
+
+out.push('// AUTO-GENERATED by rez_tree.js, based on the value of the make variable RESOURCES');
+out.push('// DO NOT EDIT');
+out.push('');
+out.push('#include <mutantspider.h>');
+out.push('');
+out.push('namespace mutantspider {');
+out.push('');
+ents.forEach((ent) => out.push('extern const rez_file_ent ' + ent.c_name + ';'));
+out.push('');
+write_dir(root, '', 'rez_root_dir');
+out.push('const rez_dir_ent rez_root_dir_ent = { "", (const rez_file_ent*)&rez_root_dir, true };');
+out.push('');
+index.sort((a, b) => strcmp_order(a.path, b.path));
+out.push('const rez_path_ent rez_path_index[] = {');
+out.push(index.length ? index.map((i) => '{' + JSON.stringify(i.path) + ',' + i.ent + '},').join('\n') : '{0}');
+out.push('};');
+out.push('');
+out.push('const size_t rez_path_index_sz = ' + index.length + ';');
+out.push('');
+out.push('}');
+
+fs.writeFileSync(argv.output, out.join('\n') + '\n');
@@ -0,0 +1,139 @@
+/*
+  Drives the SharedArrayBuffer ring that msbind.js writes into <component>-bind.js (see write_ring there)
+  from both ends of node's worker_threads: a worker writes calls into a small ring as fast as it can, and the
+  main thread reads them, sometimes slowly, so that the ring fills up and wraps around.  Checks that every call
+  arrives complete and in order, that the writer's wait() blocked while the ring was full, that calls were
+  split around the end of the ring with a -1 skip record, and that calls too big for the ring are posted
+  instead, in their place among the others.
+
+  usage: npm test   (or node test/ring_test.js, which needs minimist, see package.json)
+*/
+
+"use strict"
+
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const child_process = require('child_process');
+const { Worker, isMainThread, parentPort, workerData } = require('worker_threads');
+
+const ring_bytes = 256;
+const num_calls = 5000;
+
+// the contents of call 'n', some of them too big for the ring
+function call_str(n) { return (n % 700 === 0 ? 'x'.repeat(ring_bytes) : 'é'.repeat(n % 37)) + n; }
+function call_bytes(n) { return new Uint8Array(n % 29).fill(n & 255); }
+
+if (isMainThread) {
+
+  // a bind file with nothing exported still has the ring and the batch encoding
+  let dir = fs.mkdtempSync(path.join(os.tmpdir(), 'ms_ring_test_'));
+  let config_file = path.join(dir, 'api.json');
+  fs.writeFileSync(config_file, JSON.stringify({js_to_c_files: [], c_to_js_files: [],
+    exported_c_functions: [], exported_js_functions: [], submodules: []}));
+  let bind_file = path.join(dir, 'ring_test-bind.js');
+  fs.writeFileSync(bind_file, child_process.execFileSync(process.execPath,
+    ['--no-deprecation', path.join(__dirname, '..', 'msbind.js'), '--config_file=' + config_file, '--task=write_bind',
+     '--component_name=ring_test']));
+  let bind = require(bind_file);
+
+  let sab = new SharedArrayBuffer(16 + ring_bytes);
+  let ring = bind.ms_ring(sab, null);
+  let next = 0;
+  let skips = 0;
+  let posted = 0;
+  let expected_off = 16;
+  let failed = function(msg) {
+    console.log('FAILED: ' + msg);
+    process.exit(1);
+  };
+  let check = function(n, str, bytes) {
+    if (n !== next)
+      failed('call ' + n + ' arrived when ' + next + ' was expected');
+    if (str !== call_str(n))
+      failed('call ' + n + ' has the wrong string');
+    let want = call_bytes(n);
+    if (bytes.length !== want.length || !bytes.every((b, i) => b === want[i]))
+      failed('call ' + n + ' has the wrong bytes');
+    ++next;
+  };
+  let read = function(pos, end) {
+    // a call that starts back at the beginning when the last one didn't
+    // end at the end of the ring means there was a skip record
+    if (pos - 4 !== expected_off && pos - 4 === 16 && expected_off !== 16 + ring_bytes)
+      ++skips;
+    expected_off = 16 + ((end - 16 + 3) & ~3);
+    let r = bind.ms_batch_reader(sab, pos, end);
+    check(r.i(), r.s(), r.b());
+  };
+  let drain = function() { ring.drain(read); };
+
+  // say we are waiting for the doorbell before the worker starts writing
+  drain();
+  let worker = new Worker(__filename, {workerData: {sab: sab, bind_file: bind_file}});
+  let doorbells = 0;
+  let ring_posted = false;
+  worker.on('message', function(m) {
+    if (m === 'ms_ring') {
+      // be slow now and then, so the ring fills up and the writer has to wait
+      if (++doorbells % 5 === 0) {
+        let until = Date.now() + 2;
+        while (Date.now() < until)
+          ;
+      }
+      drain();
+    } else if (m === 'ms_ring_posted')
+      ring_posted = true;
+    else if (m.posted !== undefined) {
+      if (!ring_posted)
+        failed('call ' + m.posted + ' was posted without ms_ring_posted');
+      ring_posted = false;
+      ++posted;
+      // after the calls written before its mark, and before the ones after it
+      ring.posted(read, () => check(m.posted, m.str, new Uint8Array(m.bytes)));
+    } else if (m.done) {
+      drain();
+      if (next !== num_calls)
+        failed('only ' + next + ' of ' + num_calls + ' calls arrived');
+      if (!m.blocked)
+        failed('the writer never had to wait for room');
+      if (!skips)
+        failed('no call was written after a skip record');
+      if (!posted)
+        failed('no call was too big for the ring');
+      console.log('ok: ' + num_calls + ' calls in order, ' + posted + ' posted, ' + skips + ' skip records, '
+                  + 'writer waited ' + m.blocked + ' times');
+      worker.terminate();
+      fs.unlinkSync(bind_file);
+      fs.unlinkSync(config_file);
+      fs.rmdirSync(dir);
+    }
+  });
+  worker.on('error', (e) => failed(e.stack));
+
+} else {
+
+  let bind = require(workerData.bind_file);
+  let ring = bind.ms_ring(workerData.sab, () => parentPort.postMessage('ms_ring'));
+  let blocked = 0;
+  for (let n = 0; n < num_calls; n++) {
+    let str = call_str(n);
+    let bytes = call_bytes(n);
+    let bound = 4 + 4 + str.length * 3 + 1 + 4 + bytes.length;
+    if (!ring.begin(bound)) {
+      if (ring.fits(bound))
+        ++blocked;
+      if (!ring.wait(bound)) {
+        parentPort.postMessage('ms_ring_posted');
+        parentPort.postMessage({posted: n, str: str, bytes: bytes.buffer});
+        continue;
+      }
+    }
+    ring.i(n);
+    ring.s(str);
+    ring.b(bytes);
+    ring.commit();
+  }
+  parentPort.postMessage({done: true, blocked: blocked});
+
+}